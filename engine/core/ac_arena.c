@@ -0,0 +1,204 @@
+#include "core/ac_arena.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+
+#include "core/ac_log.h"
+#include "core/ac_mem.h"
+
+typedef struct ac_arena_chunk_t {
+    struct ac_arena_chunk_t* next;
+    size_t capacity;
+    size_t offset;
+    // Keeps the data after the header aligned for any scalar type
+    alignas(max_align_t) unsigned char data[];
+} ac_arena_chunk_t;
+
+static ac_arena_t* ac_arena_list = NULL;
+
+static ac_arena_t* ac_frame_arenas[2] = {NULL, NULL};
+static size_t ac_frame_arena_index = 0;
+
+static ac_arena_chunk_t* ac_arena_chunk_new(size_t capacity, ac_mem_entry_type_t mem_type) {
+    ac_arena_chunk_t* chunk = ac_malloc(sizeof(ac_arena_chunk_t) + capacity, mem_type);
+    if (chunk == NULL) {
+        ac_log_fatal_exit("Failed to allocate arena chunk of %zu bytes\n", capacity);
+    }
+    chunk->next = NULL;
+    chunk->capacity = capacity;
+    chunk->offset = 0;
+    return chunk;
+}
+
+// Whether type indexes type_used, rejected like ac_malloc does
+static bool ac_arena_type_check(const char* name, ac_mem_entry_type_t type) {
+    if ((unsigned)type < AC_MEM_ENTRY_COUNT) {
+        return true;
+    }
+    ac_log_error("Invalid memory type %d for arena %s\n", (int)type, name);
+    return false;
+}
+
+ac_arena_t* ac_arena_create(const char* name, size_t capacity, ac_mem_entry_type_t mem_type) {
+    if (!ac_arena_type_check(name, mem_type)) {
+        return NULL;
+    }
+    ac_arena_t* arena = ac_calloc(1, sizeof(ac_arena_t), mem_type);
+    if (arena == NULL) {
+        ac_log_fatal_exit("Failed to allocate arena %s\n", name);
+    }
+    arena->name = name;
+    arena->mem_type = mem_type;
+    arena->chunk_capacity = capacity;
+    arena->chunks = ac_arena_chunk_new(capacity, mem_type);
+    arena->next = ac_arena_list;
+    ac_arena_list = arena;
+    return arena;
+}
+
+void ac_arena_destroy(ac_arena_t* arena) {
+    for (ac_arena_t** it = &ac_arena_list; *it != NULL; it = &(*it)->next) {
+        if (*it == arena) {
+            *it = arena->next;
+            break;
+        }
+    }
+    ac_arena_chunk_t* chunk = arena->chunks;
+    while (chunk != NULL) {
+        ac_arena_chunk_t* next = chunk->next;
+        ac_free(chunk);
+        chunk = next;
+    }
+    ac_free(arena);
+}
+
+void* ac_arena_alloc_aligned(ac_arena_t* arena, size_t size, size_t alignment, ac_mem_entry_type_t type) {
+    if (!ac_arena_type_check(arena->name, type)) {
+        return NULL;
+    }
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        ac_log_error("Invalid alignment %zu for arena %s, must be a power of two\n", alignment, arena->name);
+        return NULL;
+    }
+    // A chunk holding it must be addressable
+    if (size > SIZE_MAX - alignment - sizeof(ac_arena_chunk_t)) {
+        ac_log_error("Allocation of %zu bytes too large for arena %s\n", size, arena->name);
+        return NULL;
+    }
+    ac_arena_chunk_t* chunk = arena->chunks;
+    uintptr_t base = (uintptr_t)chunk->data;
+    uintptr_t end = base + chunk->capacity;
+    uintptr_t start = (base + chunk->offset + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (start > end || size > end - start) {
+        // Chain a new chunk in front, it is folded back on reset
+        size_t capacity = arena->chunk_capacity;
+        if (capacity < size + alignment) {
+            capacity = size + alignment;
+        }
+        chunk = ac_arena_chunk_new(capacity, arena->mem_type);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        base = (uintptr_t)chunk->data;
+        start = (base + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    }
+    chunk->offset = start + size - base;
+    arena->used += size;
+    arena->type_used[type] += size;
+    return (void*)start;
+}
+
+void* ac_arena_alloc(ac_arena_t* arena, size_t size, ac_mem_entry_type_t type) {
+    return ac_arena_alloc_aligned(arena, size, alignof(max_align_t), type);
+}
+
+void ac_arena_reset(ac_arena_t* arena) {
+    if (arena->used > arena->high_water) {
+        arena->high_water = arena->used;
+    }
+    for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
+        if (arena->type_used[i] > arena->type_high_water[i]) {
+            arena->type_high_water[i] = arena->type_used[i];
+        }
+        arena->type_used[i] = 0;
+    }
+    arena->used = 0;
+    arena->reset_count++;
+
+    if (arena->chunks->next != NULL) {
+        // Overflowed since the last reset, replace the chain by one chunk big
+        // enough for the whole of it. Growth is capped at twice the previous
+        // capacity, a single oversized allocation gets a chunk of its own
+        // again instead of inflating the arena for good.
+        size_t capacity = 0;
+        ac_arena_chunk_t* chunk = arena->chunks;
+        while (chunk != NULL) {
+            ac_arena_chunk_t* next = chunk->next;
+            capacity += chunk->capacity;
+            ac_free(chunk);
+            chunk = next;
+        }
+        if (capacity / 2 > arena->chunk_capacity) {
+            capacity = 2 * arena->chunk_capacity;
+        }
+        arena->chunk_capacity = capacity;
+        arena->chunks = ac_arena_chunk_new(capacity, arena->mem_type);
+    }
+    arena->chunks->offset = 0;
+}
+
+void ac_arena_show_usage(void) {
+    for (ac_arena_t* arena = ac_arena_list; arena != NULL; arena = arena->next) {
+        size_t high_water = arena->used > arena->high_water ? arena->used : arena->high_water;
+        ac_log_info("Arena: %s\n", arena->name);
+        ac_log_info("Capacity: %zu, In use: %zu, High-water: %zu, Resets: %zu\n", arena->chunk_capacity, arena->used, high_water,
+                    arena->reset_count);
+        for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
+            size_t type_high_water =
+                arena->type_used[i] > arena->type_high_water[i] ? arena->type_used[i] : arena->type_high_water[i];
+            if (type_high_water != 0) {
+                ac_log_info("  %s high-water: %zu\n", ac_mem_entry_type_str(i), type_high_water);
+            }
+        }
+    }
+}
+
+void ac_frame_arena_init(size_t capacity) {
+    if (ac_frame_arenas[0] != NULL) {
+        return;
+    }
+    if (capacity == 0) {
+        capacity = AC_FRAME_ARENA_DEFAULT_CAPACITY;
+    }
+    ac_frame_arenas[0] = ac_arena_create("frame 0", capacity, AC_MEM_ENTRY_CORE);
+    ac_frame_arenas[1] = ac_arena_create("frame 1", capacity, AC_MEM_ENTRY_CORE);
+    ac_frame_arena_index = 0;
+}
+
+void ac_frame_arena_shutdown(void) {
+    if (ac_frame_arenas[0] == NULL) {
+        return;
+    }
+    ac_arena_destroy(ac_frame_arenas[0]);
+    ac_arena_destroy(ac_frame_arenas[1]);
+    ac_frame_arenas[0] = NULL;
+    ac_frame_arenas[1] = NULL;
+}
+
+void ac_frame_arena_begin(void) {
+    if (ac_frame_arenas[0] == NULL) {
+        return;
+    }
+    ac_frame_arena_index ^= 1;
+    ac_arena_reset(ac_frame_arenas[ac_frame_arena_index]);
+}
+
+void* ac_frame_alloc(size_t size, ac_mem_entry_type_t type) {
+    if (ac_frame_arenas[0] == NULL) {
+        ac_frame_arena_init(0);
+    }
+    return ac_arena_alloc(ac_frame_arenas[ac_frame_arena_index], size, type);
+}
+
+ac_arena_t* ac_frame_arena_current(void) { return ac_frame_arenas[ac_frame_arena_index]; }
+
+ac_arena_t* ac_frame_arena_previous(void) { return ac_frame_arenas[ac_frame_arena_index ^ 1]; }
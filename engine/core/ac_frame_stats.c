@@ -0,0 +1,249 @@
+#include "core/ac_frame_stats.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "core/ac_log.h"
+#include "core/ac_time.h"
+
+// Frame statistics
+// Durations of the current frame are summed in ac_frame_stats_current and
+// committed by ac_frame_stats_frame_end to a log-linear histogram per stat and
+// to a ring of rows for the CSV. Everything is static, nothing allocates.
+
+// Values below 16 ns get a bucket each, above that every power of two is cut
+// in 16 buckets. Durations are capped to 2^41 ns, about 36 minutes.
+#define AC_FRAME_STATS_SUB_BITS 4
+#define AC_FRAME_STATS_SUB_COUNT (1 << AC_FRAME_STATS_SUB_BITS)
+#define AC_FRAME_STATS_MAX_EXPONENT 40
+#define AC_FRAME_STATS_MAX_NS ((UINT64_C(1) << (AC_FRAME_STATS_MAX_EXPONENT + 1)) - 1)
+#define AC_FRAME_STATS_BUCKETS ((AC_FRAME_STATS_MAX_EXPONENT - AC_FRAME_STATS_SUB_BITS + 2) * AC_FRAME_STATS_SUB_COUNT)
+
+// Marks a stat not recorded in a frame
+#define AC_FRAME_STATS_ABSENT UINT64_MAX
+
+typedef struct ac_frame_stats_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[AC_FRAME_STATS_BUCKETS];
+} ac_frame_stats_histogram_t;
+
+static const char* ac_frame_stats_names[AC_FRAME_STAT_COUNT] = {
+    "frame", "cpu", "fence_wait", "acquire", "present", "gpu",
+};
+
+static bool ac_frame_stats_recording = false;
+static bool ac_frame_stats_discarded = false;
+static uint64_t ac_frame_stats_frame_start = 0;
+static uint64_t ac_frame_stats_current[AC_FRAME_STAT_COUNT];
+static ac_frame_stats_histogram_t ac_frame_stats_histograms[AC_FRAME_STAT_COUNT];
+static uint64_t ac_frame_stats_rows[AC_FRAME_STATS_HISTORY][AC_FRAME_STAT_COUNT];
+static uint64_t ac_frame_stats_frames = 0;
+static uint64_t ac_frame_stats_hitch_count = 0;
+static uint64_t ac_frame_stats_hitch_ns = AC_FRAME_STATS_DEFAULT_HITCH_NS;
+
+static inline uint32_t ac_frame_stats_bucket(uint64_t ns) {
+    if (ns < AC_FRAME_STATS_SUB_COUNT) {
+        return (uint32_t)ns;
+    }
+    uint32_t exponent = 63 - __builtin_clzll(ns);
+    uint32_t sub = (ns >> (exponent - AC_FRAME_STATS_SUB_BITS)) & (AC_FRAME_STATS_SUB_COUNT - 1);
+    return (exponent - AC_FRAME_STATS_SUB_BITS + 1) * AC_FRAME_STATS_SUB_COUNT + sub;
+}
+
+// Largest value falling in a bucket
+static uint64_t ac_frame_stats_bucket_max(uint32_t bucket) {
+    if (bucket < AC_FRAME_STATS_SUB_COUNT) {
+        return bucket;
+    }
+    uint32_t shift = bucket / AC_FRAME_STATS_SUB_COUNT - 1;
+    uint64_t sub = bucket % AC_FRAME_STATS_SUB_COUNT;
+    return ((AC_FRAME_STATS_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+static uint64_t ac_frame_stats_percentile(const ac_frame_stats_histogram_t* histogram, uint32_t percent) {
+    uint64_t rank = (histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < AC_FRAME_STATS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t ns = ac_frame_stats_bucket_max(i);
+            return ns < histogram->max ? ns : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void ac_frame_stats_init(void) {
+    ac_time_init();
+    ac_frame_stats_reset();
+}
+
+void ac_frame_stats_record(ac_frame_stat_t stat, uint64_t ns) {
+    if (!ac_frame_stats_recording) {
+        return;
+    }
+    uint64_t current = ac_frame_stats_current[stat];
+    ac_frame_stats_current[stat] = current == AC_FRAME_STATS_ABSENT ? ns : current + ns;
+}
+
+void ac_frame_stats_record_ticks(ac_frame_stat_t stat, uint64_t begin_ticks, uint64_t end_ticks) {
+    if (!ac_frame_stats_recording) {
+        return;
+    }
+    ac_frame_stats_record(stat, ac_time_ticks_to_ns(end_ticks) - ac_time_ticks_to_ns(begin_ticks));
+}
+
+void ac_frame_stats_mark(ac_frame_stat_t stat) {
+    ac_frame_stats_record_ticks(stat, ac_frame_stats_frame_start, ac_time_ticks());
+}
+
+void ac_frame_stats_frame_end(void) {
+    uint64_t now = ac_time_ticks();
+    if (!ac_frame_stats_recording) {
+        ac_time_init();
+        ac_frame_stats_recording = true;
+        ac_frame_stats_frame_start = now;
+        return;
+    }
+    if (ac_frame_stats_discarded) {
+        for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+            ac_frame_stats_current[stat] = AC_FRAME_STATS_ABSENT;
+        }
+        ac_frame_stats_discarded = false;
+        ac_frame_stats_frame_start = now;
+        return;
+    }
+    ac_frame_stats_current[AC_FRAME_STAT_FRAME] =
+        ac_time_ticks_to_ns(now) - ac_time_ticks_to_ns(ac_frame_stats_frame_start);
+    if (ac_frame_stats_current[AC_FRAME_STAT_FRAME] > ac_frame_stats_hitch_ns) {
+        ac_frame_stats_hitch_count++;
+    }
+
+    uint64_t* row = ac_frame_stats_rows[ac_frame_stats_frames % AC_FRAME_STATS_HISTORY];
+    for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+        uint64_t ns = ac_frame_stats_current[stat];
+        row[stat] = ns;
+        ac_frame_stats_current[stat] = AC_FRAME_STATS_ABSENT;
+        if (ns == AC_FRAME_STATS_ABSENT) {
+            continue;
+        }
+        if (ns > AC_FRAME_STATS_MAX_NS) {
+            ns = AC_FRAME_STATS_MAX_NS;
+        }
+        ac_frame_stats_histogram_t* histogram = &ac_frame_stats_histograms[stat];
+        histogram->buckets[ac_frame_stats_bucket(ns)]++;
+        histogram->count++;
+        histogram->sum += ns;
+        if (ns > histogram->max) {
+            histogram->max = ns;
+        }
+    }
+    ac_frame_stats_frames++;
+    ac_frame_stats_frame_start = now;
+}
+
+void ac_frame_stats_frame_discard(void) { ac_frame_stats_discarded = true; }
+
+void ac_frame_stats_set_hitch_threshold(uint64_t ns) { ac_frame_stats_hitch_ns = ns; }
+
+void ac_frame_stats_get(ac_frame_stat_t stat, ac_frame_stats_summary_t* summary) {
+    const ac_frame_stats_histogram_t* histogram = &ac_frame_stats_histograms[stat];
+    *summary = (ac_frame_stats_summary_t){0};
+    if (histogram->count == 0) {
+        return;
+    }
+    summary->count = histogram->count;
+    summary->mean_ns = histogram->sum / histogram->count;
+    summary->p50_ns = ac_frame_stats_percentile(histogram, 50);
+    summary->p95_ns = ac_frame_stats_percentile(histogram, 95);
+    summary->p99_ns = ac_frame_stats_percentile(histogram, 99);
+    summary->max_ns = histogram->max;
+}
+
+uint64_t ac_frame_stats_hitches(void) { return ac_frame_stats_hitch_count; }
+
+void ac_frame_stats_reset(void) {
+    memset(ac_frame_stats_histograms, 0, sizeof(ac_frame_stats_histograms));
+    for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+        ac_frame_stats_current[stat] = AC_FRAME_STATS_ABSENT;
+    }
+    ac_frame_stats_frames = 0;
+    ac_frame_stats_hitch_count = 0;
+}
+
+void ac_frame_stats_log(void) {
+    ac_log_info("Frame stats over %llu frames, %llu hitches above %.2f ms\n", (unsigned long long)ac_frame_stats_frames,
+                (unsigned long long)ac_frame_stats_hitch_count, ac_frame_stats_hitch_ns / 1e6);
+    for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+        ac_frame_stats_summary_t summary;
+        ac_frame_stats_get(stat, &summary);
+        if (summary.count == 0) {
+            continue;
+        }
+        ac_log_info("%-10s mean %7.3f ms  p50 %7.3f ms  p95 %7.3f ms  p99 %7.3f ms  max %7.3f ms\n",
+                    ac_frame_stats_names[stat], summary.mean_ns / 1e6, summary.p50_ns / 1e6, summary.p95_ns / 1e6,
+                    summary.p99_ns / 1e6, summary.max_ns / 1e6);
+    }
+}
+
+bool ac_frame_stats_write_csv(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s for the frame stats\n", path);
+        return false;
+    }
+    fprintf(fp, "frame");
+    for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+        fprintf(fp, ",%s_us", ac_frame_stats_names[stat]);
+    }
+    fprintf(fp, "\n");
+    uint64_t first = ac_frame_stats_frames > AC_FRAME_STATS_HISTORY ? ac_frame_stats_frames - AC_FRAME_STATS_HISTORY : 0;
+    for (uint64_t frame = first; frame < ac_frame_stats_frames; frame++) {
+        const uint64_t* row = ac_frame_stats_rows[frame % AC_FRAME_STATS_HISTORY];
+        fprintf(fp, "%llu", (unsigned long long)frame);
+        for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+            if (row[stat] == AC_FRAME_STATS_ABSENT) {
+                fprintf(fp, ",");
+            } else {
+                fprintf(fp, ",%.3f", row[stat] / 1e3);
+            }
+        }
+        fprintf(fp, "\n");
+    }
+    if (ferror(fp) | fclose(fp)) {
+        ac_log_error("Failed to write the frame stats %s\n", path);
+        return false;
+    }
+    ac_log_info("Frame stats of %llu frames written to %s\n", (unsigned long long)(ac_frame_stats_frames - first), path);
+    return true;
+}
+
+bool ac_frame_stats_write_json(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s for the frame stats\n", path);
+        return false;
+    }
+    fprintf(fp, "{\"frames\":%llu,\"hitch_threshold_ns\":%llu,\"hitches\":%llu,\"stats\":{",
+            (unsigned long long)ac_frame_stats_frames, (unsigned long long)ac_frame_stats_hitch_ns,
+            (unsigned long long)ac_frame_stats_hitch_count);
+    for (uint32_t stat = 0; stat < AC_FRAME_STAT_COUNT; stat++) {
+        ac_frame_stats_summary_t summary;
+        ac_frame_stats_get(stat, &summary);
+        fprintf(fp,
+                "%s\n\"%s\":{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p95_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}",
+                stat == 0 ? "" : ",", ac_frame_stats_names[stat], (unsigned long long)summary.count,
+                (unsigned long long)summary.mean_ns, (unsigned long long)summary.p50_ns,
+                (unsigned long long)summary.p95_ns, (unsigned long long)summary.p99_ns,
+                (unsigned long long)summary.max_ns);
+    }
+    fprintf(fp, "\n}}\n");
+    if (ferror(fp) | fclose(fp)) {
+        ac_log_error("Failed to write the frame stats %s\n", path);
+        return false;
+    }
+    ac_log_info("Frame stats summary written to %s\n", path);
+    return true;
+}
@@ -1,9 +1,21 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "core/ac_log.h"
+#include "core/ac_time.h"
 
-static ac_log_level_t ac_log_level = AC_LOG_LEVEL_DEBUG;
 static bool ac_log_color = true;
 
 static const char *ac_log_level_colors[] = {
@@ -15,44 +27,586 @@ static const char *ac_log_level_colors[] = {
     "\x1b[41;1;30m"  // FATAL
 };
 
+static const char *ac_log_level_names[] = {"TRACE: ", "DEBUG: ", "INFO: ", "WARN: ", "ERROR: ", "FATAL: "};
+
 static const char *ac_log_level_reset_color = "\x1b[0m";
 
+// Longest color code and reset around a prefix
+#define AC_LOG_COLOR_SIZE 16
+
+// Messages are formatted in full here, once, then handed to every sink
+static _Thread_local char ac_log_buffer[AC_LOG_MESSAGE_SIZE];
+
+// Sinks
+// Slot AC_LOG_SINK_CONSOLE only has a level, the console is written by
+// ac_log_console. A slot is in use while its write function is set.
+// ac_log_active counts the calls going through the sinks, removing a sink
+// waits for it to drop to 0 before closing it. ac_log_min_level is the
+// lowest level of every sink, messages below it aren't even formatted.
+
+typedef struct ac_log_sink_entry_t {
+    _Atomic(ac_log_sink_fn) write;
+    void (*close)(void *user);
+    void *user;
+    _Atomic int level;
+} ac_log_sink_entry_t;
+
+static ac_log_sink_entry_t ac_log_sinks[AC_LOG_MAX_SINKS] = {[AC_LOG_SINK_CONSOLE] = {.level = AC_LOG_LEVEL_DEBUG}};
+static pthread_mutex_t ac_log_sinks_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int ac_log_min_level = AC_LOG_LEVEL_DEBUG;
+static _Atomic int ac_log_active = 0;
+
+// Memory mapped file, messages are appended with a fetch_add on offset
+typedef struct ac_log_file_sink_t {
+    int fd;
+    char *map;
+    size_t size;
+    _Atomic size_t offset;
+    _Atomic size_t dropped;
+} ac_log_file_sink_t;
+
+// Crash ring, the last ac_log_crash_size bytes logged. Writers copy at a
+// position taken with a fetch_add, a dump while they write can show a torn
+// message.
+static char *ac_log_crash_ring = NULL;
+static size_t ac_log_crash_size = 0;
+static _Atomic size_t ac_log_crash_pos = 0;
+// Set by FATAL messages until the ring is dumped, a run of FATAL lines is
+// dumped once
+static atomic_bool ac_log_crash_pending = false;
+static bool ac_log_crash_atexit = false;
+
+// Asynchronous writer
+// A bounded MPSC ring of fixed size slots: producers claim a position with a
+// CAS on ac_log_enqueue_pos and publish the slot by bumping its sequence, the
+// writer thread drains published slots in order and writes runs of messages
+// to the same stream with one write(). The writer sleeps on a condition
+// variable, producers only take the mutex to wake it when it sleeps. Only the
+// console goes through it, the other sinks don't make system calls.
+
+typedef struct ac_log_slot_t {
+    _Atomic size_t sequence;
+    FILE *fp;
+    ac_log_level_t level;
+    size_t length;
+    char text[AC_LOG_MESSAGE_SIZE];
+} ac_log_slot_t;
+
+static ac_log_slot_t ac_log_ring[AC_LOG_RING_SIZE];
+static _Atomic size_t ac_log_enqueue_pos = 0;
+static size_t ac_log_dequeue_pos = 0;
+static _Atomic size_t ac_log_written_pos = 0;
+static _Atomic size_t ac_log_dropped = 0;
+
+static atomic_bool ac_log_async = false;
+static _Atomic int ac_log_overflow = AC_LOG_OVERFLOW_BLOCK;
+static atomic_bool ac_log_writer_sleeping = false;
+static _Atomic int ac_log_flush_waiters = 0;
+static pthread_once_t ac_log_writer_once = PTHREAD_ONCE_INIT;
+static bool ac_log_writer_running = false;
+static pthread_mutex_t ac_log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ac_log_writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ac_log_writer_done = PTHREAD_COND_INITIALIZER;
+
+// Batch of the writer, messages to the same stream back to back
+static char ac_log_batch[(AC_LOG_MESSAGE_SIZE + AC_LOG_COLOR_SIZE) * 16];
+
 void ac_log_enable_color(bool enable) { ac_log_color = enable; }
-void ac_log_set_level(ac_log_level_t level) { ac_log_level = level; }
 
-void ac_log(FILE *fd, ac_log_level_t level, const char *fmt, ...) {
-    if (level < ac_log_level) {
-        return;
+// Must hold ac_log_sinks_lock
+static void ac_log_update_min_level(void) {
+    int min_level = atomic_load(&ac_log_sinks[AC_LOG_SINK_CONSOLE].level);
+    for (int i = 0; i < AC_LOG_MAX_SINKS; i++) {
+        if (i != AC_LOG_SINK_CONSOLE && atomic_load(&ac_log_sinks[i].write) == NULL) {
+            continue;
+        }
+        int level = atomic_load(&ac_log_sinks[i].level);
+        if (level < min_level) {
+            min_level = level;
+        }
     }
+    atomic_store(&ac_log_min_level, min_level);
+}
 
-    if (ac_log_color) {
-        fprintf(fd, "%s", ac_log_level_colors[level]);
+void ac_log_set_sink_level(int sink, ac_log_level_t level) {
+    if (sink < 0 || sink >= AC_LOG_MAX_SINKS) {
+        return;
     }
-    switch (level) {
-        case AC_LOG_LEVEL_TRACE:
-            fprintf(fd, "TRACE: ");
-            break;
-        case AC_LOG_LEVEL_DEBUG:
-            fprintf(fd, "DEBUG: ");
-            break;
-        case AC_LOG_LEVEL_INFO:
-            fprintf(fd, "INFO: ");
-            break;
-        case AC_LOG_LEVEL_WARN:
-            fprintf(fd, "WARN: ");
+    pthread_mutex_lock(&ac_log_sinks_lock);
+    atomic_store(&ac_log_sinks[sink].level, level);
+    ac_log_update_min_level();
+    pthread_mutex_unlock(&ac_log_sinks_lock);
+}
+
+void ac_log_set_level(ac_log_level_t level) { ac_log_set_sink_level(AC_LOG_SINK_CONSOLE, level); }
+
+int ac_log_add_sink(ac_log_sink_fn write, void (*close)(void *user), void *user, ac_log_level_t level) {
+    pthread_mutex_lock(&ac_log_sinks_lock);
+    int sink = -1;
+    for (int i = 0; i < AC_LOG_MAX_SINKS; i++) {
+        if (i != AC_LOG_SINK_CONSOLE && atomic_load(&ac_log_sinks[i].write) == NULL) {
+            sink = i;
             break;
-        case AC_LOG_LEVEL_ERROR:
-            fprintf(fd, "ERROR: ");
+        }
+    }
+    if (sink >= 0) {
+        ac_log_sink_entry_t *entry = &ac_log_sinks[sink];
+        entry->close = close;
+        entry->user = user;
+        atomic_store(&entry->level, level);
+        atomic_store(&entry->write, write);
+        ac_log_update_min_level();
+    }
+    pthread_mutex_unlock(&ac_log_sinks_lock);
+    return sink;
+}
+
+void ac_log_remove_sink(int sink) {
+    if (sink < 0 || sink >= AC_LOG_MAX_SINKS || sink == AC_LOG_SINK_CONSOLE) {
+        return;
+    }
+    pthread_mutex_lock(&ac_log_sinks_lock);
+    ac_log_sink_entry_t *entry = &ac_log_sinks[sink];
+    bool removed = atomic_exchange(&entry->write, NULL) != NULL;
+    if (removed) {
+        ac_log_update_min_level();
+        while (atomic_load(&ac_log_active) > 0) {
+            sched_yield();
+        }
+    }
+    void (*close)(void *) = entry->close;
+    void *user = entry->user;
+    pthread_mutex_unlock(&ac_log_sinks_lock);
+    // Outside of the lock, closing may log
+    if (removed && close != NULL) {
+        close(user);
+    }
+}
+
+static void ac_log_file_write(void *user, ac_log_level_t level, const char *message, size_t length) {
+    (void)level;
+    ac_log_file_sink_t *file = user;
+    size_t offset = atomic_fetch_add_explicit(&file->offset, length, memory_order_relaxed);
+    if (offset + length > file->size) {
+        atomic_fetch_add_explicit(&file->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    memcpy(file->map + offset, message, length);
+}
+
+static void ac_log_file_close(void *user) {
+    ac_log_file_sink_t *file = user;
+    size_t used = atomic_load(&file->offset);
+    if (used > file->size) {
+        used = file->size;
+    }
+    munmap(file->map, file->size);
+    if (ftruncate(file->fd, (off_t)used) != 0) {
+        ac_log_warn("Failed to truncate the log file\n");
+    }
+    close(file->fd);
+    size_t dropped = atomic_load(&file->dropped);
+    if (dropped > 0) {
+        ac_log_warn("%zu log messages didn't fit in the log file\n", dropped);
+    }
+    free(file);
+}
+
+int ac_log_add_file_sink(const char *path, size_t size, ac_log_level_t level) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ac_log_error("Failed to open the log file %s\n", path);
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if (size > 0 && ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ac_log_file_sink_t *file = map != MAP_FAILED ? calloc(1, sizeof(ac_log_file_sink_t)) : NULL;
+    if (file == NULL) {
+        if (map != MAP_FAILED) {
+            munmap(map, size);
+        }
+        close(fd);
+        ac_log_error("Failed to map %zu bytes of the log file %s\n", size, path);
+        return -1;
+    }
+    file->fd = fd;
+    file->map = map;
+    file->size = size;
+    int sink = ac_log_add_sink(ac_log_file_write, ac_log_file_close, file, level);
+    if (sink < 0) {
+        ac_log_file_close(file);
+        ac_log_error("No sink left for the log file %s\n", path);
+    }
+    return sink;
+}
+
+static void ac_log_crash_write(void *user, ac_log_level_t level, const char *message, size_t length) {
+    (void)user;
+    (void)level;
+    if (length > ac_log_crash_size) {
+        message += length - ac_log_crash_size;
+        length = ac_log_crash_size;
+    }
+    size_t pos = atomic_fetch_add_explicit(&ac_log_crash_pos, length, memory_order_relaxed) & (ac_log_crash_size - 1);
+    size_t first = ac_log_crash_size - pos < length ? ac_log_crash_size - pos : length;
+    memcpy(ac_log_crash_ring + pos, message, first);
+    memcpy(ac_log_crash_ring, message + first, length - first);
+}
+
+static void ac_log_crash_close(void *user) {
+    (void)user;
+    char *ring = ac_log_crash_ring;
+    ac_log_crash_ring = NULL;
+    free(ring);
+}
+
+int ac_log_add_crash_ring(size_t size, ac_log_level_t level) {
+    if (ac_log_crash_ring != NULL) {
+        ac_log_error("A crash ring is already in use\n");
+        return -1;
+    }
+    size_t rounded = 4096;
+    while (rounded < size) {
+        rounded *= 2;
+    }
+    char *ring = calloc(1, rounded);
+    if (ring == NULL) {
+        ac_log_error("Failed to allocate the %zu byte crash ring\n", rounded);
+        return -1;
+    }
+    ac_log_crash_ring = ring;
+    ac_log_crash_size = rounded;
+    atomic_store(&ac_log_crash_pos, 0);
+    if (!ac_log_crash_atexit) {
+        // FATAL messages not followed by ac_log_fatal_exit are reported at exit
+        atexit(ac_log_crash_report);
+        ac_log_crash_atexit = true;
+    }
+    int sink = ac_log_add_sink(ac_log_crash_write, ac_log_crash_close, NULL, level);
+    if (sink < 0) {
+        ac_log_crash_close(NULL);
+        ac_log_error("No sink left for the crash ring\n");
+    }
+    return sink;
+}
+
+static void ac_log_write_fd(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+void ac_log_dump_crash_ring(int fd) {
+    char *ring = ac_log_crash_ring;
+    if (ring == NULL) {
+        return;
+    }
+    size_t end = atomic_load(&ac_log_crash_pos);
+    size_t start = end > ac_log_crash_size ? end - ac_log_crash_size : 0;
+    if (start > 0) {
+        // The oldest message was cut by the wrap, start at the next one
+        while (start < end && ring[start & (ac_log_crash_size - 1)] != '\n') {
+            start++;
+        }
+        start++;
+    }
+    static const char header[] = "---- Last log messages ----\n";
+    static const char footer[] = "---- End of last log messages ----\n";
+    ac_log_write_fd(fd, header, sizeof(header) - 1);
+    while (start < end) {
+        size_t pos = start & (ac_log_crash_size - 1);
+        size_t chunk = ac_log_crash_size - pos < end - start ? ac_log_crash_size - pos : end - start;
+        ac_log_write_fd(fd, ring + pos, chunk);
+        start += chunk;
+    }
+    ac_log_write_fd(fd, footer, sizeof(footer) - 1);
+}
+
+void ac_log_crash_report(void) {
+    if (!atomic_exchange(&ac_log_crash_pending, false)) {
+        return;
+    }
+    ac_log_flush();
+    fflush(stdout);
+    fflush(stderr);
+    ac_log_dump_crash_ring(STDERR_FILENO);
+}
+
+// Copies a message to dst with the color codes around its prefix, dst needs
+// AC_LOG_COLOR_SIZE bytes more than the message
+static size_t ac_log_colorize(char *dst, ac_log_level_t level, const char *message, size_t length) {
+    if (!ac_log_color) {
+        memcpy(dst, message, length);
+        return length;
+    }
+    size_t prefix = strlen(ac_log_level_names[level]);
+    size_t color = strlen(ac_log_level_colors[level]);
+    size_t reset = strlen(ac_log_level_reset_color);
+    memcpy(dst, ac_log_level_colors[level], color);
+    memcpy(dst + color, message, prefix);
+    memcpy(dst + color + prefix, ac_log_level_reset_color, reset);
+    memcpy(dst + color + prefix + reset, message + prefix, length - prefix);
+    return length + color + reset;
+}
+
+static void ac_log_write_all(FILE *fp, const char *data, size_t length) {
+    // Whatever went through stdio before must come out first
+    fflush(fp);
+    ac_log_write_fd(fileno(fp), data, length);
+}
+
+static void ac_log_wake_writer(void) {
+    if (atomic_load(&ac_log_writer_sleeping)) {
+        pthread_mutex_lock(&ac_log_writer_lock);
+        pthread_cond_signal(&ac_log_writer_wake);
+        pthread_mutex_unlock(&ac_log_writer_lock);
+    }
+}
+
+// Appends the published slots from ac_log_dequeue_pos to the batch until the
+// stream changes or the batch is full, returns the number of slots taken
+static size_t ac_log_take_batch(FILE **fp, size_t *length) {
+    size_t taken = 0;
+    *length = 0;
+    *fp = NULL;
+    for (;;) {
+        ac_log_slot_t *slot = &ac_log_ring[ac_log_dequeue_pos & (AC_LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != ac_log_dequeue_pos + 1) {
             break;
-        case AC_LOG_LEVEL_FATAL:
-            fprintf(fd, "FATAL: ");
+        }
+        if ((*fp != NULL && slot->fp != *fp) || *length + slot->length + AC_LOG_COLOR_SIZE > sizeof(ac_log_batch)) {
             break;
+        }
+        *fp = slot->fp;
+        *length += ac_log_colorize(ac_log_batch + *length, slot->level, slot->text, slot->length);
+        atomic_store_explicit(&slot->sequence, ac_log_dequeue_pos + AC_LOG_RING_SIZE, memory_order_release);
+        ac_log_dequeue_pos++;
+        taken++;
+    }
+    return taken;
+}
+
+static void *ac_log_writer(void *arg) {
+    (void)arg;
+    for (;;) {
+        FILE *fp;
+        size_t length;
+        if (ac_log_take_batch(&fp, &length) > 0) {
+            ac_log_write_all(fp, ac_log_batch, length);
+            atomic_store(&ac_log_written_pos, ac_log_dequeue_pos);
+            if (atomic_load(&ac_log_flush_waiters) > 0) {
+                pthread_mutex_lock(&ac_log_writer_lock);
+                pthread_cond_broadcast(&ac_log_writer_done);
+                pthread_mutex_unlock(&ac_log_writer_lock);
+            }
+            continue;
+        }
+        size_t dropped = atomic_exchange(&ac_log_dropped, 0);
+        if (dropped > 0) {
+            char message[64];
+            int written = snprintf(message, sizeof(message), "%s%zu log messages dropped\n",
+                                   ac_log_level_names[AC_LOG_LEVEL_WARN], dropped);
+            length = ac_log_colorize(ac_log_batch, AC_LOG_LEVEL_WARN, message, (size_t)written);
+            ac_log_write_all(stderr, ac_log_batch, length);
+        }
+
+        // Checked again after announcing the sleep, a producer either sees the
+        // flag or its message is seen here
+        pthread_mutex_lock(&ac_log_writer_lock);
+        atomic_store(&ac_log_writer_sleeping, true);
+        ac_log_slot_t *slot = &ac_log_ring[ac_log_dequeue_pos & (AC_LOG_RING_SIZE - 1)];
+        if (atomic_load(&slot->sequence) != ac_log_dequeue_pos + 1) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&ac_log_writer_wake, &ac_log_writer_lock, &deadline);
+        }
+        atomic_store(&ac_log_writer_sleeping, false);
+        pthread_mutex_unlock(&ac_log_writer_lock);
+    }
+    return NULL;
+}
+
+static void ac_log_writer_start(void) {
+    for (size_t i = 0; i < AC_LOG_RING_SIZE; i++) {
+        atomic_init(&ac_log_ring[i].sequence, i);
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ac_log_writer, NULL) == 0) {
+        pthread_setname_np(thread, "ac_log");
+        pthread_detach(thread);
+        ac_log_writer_running = true;
+        atexit(ac_log_flush);
+    }
+}
+
+void ac_log_set_async(bool enable, ac_log_overflow_t overflow) {
+    atomic_store(&ac_log_overflow, overflow);
+    if (enable) {
+        fflush(stdout);
+        fflush(stderr);
+        pthread_once(&ac_log_writer_once, ac_log_writer_start);
+        atomic_store(&ac_log_async, ac_log_writer_running);
+    } else {
+        atomic_store(&ac_log_async, false);
+        ac_log_flush();
     }
+}
+
+void ac_log_flush(void) {
+    if (!ac_log_writer_running) {
+        return;
+    }
+    size_t target = atomic_load(&ac_log_enqueue_pos);
+    atomic_fetch_add(&ac_log_flush_waiters, 1);
+    pthread_mutex_lock(&ac_log_writer_lock);
+    while (atomic_load(&ac_log_written_pos) < target) {
+        pthread_cond_signal(&ac_log_writer_wake);
+        pthread_cond_wait(&ac_log_writer_done, &ac_log_writer_lock);
+    }
+    pthread_mutex_unlock(&ac_log_writer_lock);
+    atomic_fetch_sub(&ac_log_flush_waiters, 1);
+}
+
+// Returns false if the message has to be written by the caller
+static bool ac_log_push(FILE *fp, ac_log_level_t level, const char *text, size_t length) {
+    size_t pos = atomic_load_explicit(&ac_log_enqueue_pos, memory_order_relaxed);
+    ac_log_slot_t *slot;
+    for (;;) {
+        slot = &ac_log_ring[pos & (AC_LOG_RING_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == pos) {
+            if (atomic_compare_exchange_weak(&ac_log_enqueue_pos, &pos, pos + 1)) {
+                break;
+            }
+        } else if ((intptr_t)(sequence - pos) < 0) {
+            // Full
+            if (atomic_load_explicit(&ac_log_overflow, memory_order_relaxed) == AC_LOG_OVERFLOW_DROP) {
+                atomic_fetch_add_explicit(&ac_log_dropped, 1, memory_order_relaxed);
+                return true;
+            }
+            ac_log_wake_writer();
+            sched_yield();
+            pos = atomic_load_explicit(&ac_log_enqueue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&ac_log_enqueue_pos, memory_order_relaxed);
+        }
+    }
+    slot->fp = fp;
+    slot->level = level;
+    slot->length = length;
+    memcpy(slot->text, text, length);
+    atomic_store(&slot->sequence, pos + 1);
+    ac_log_wake_writer();
+    return true;
+}
+
+bool ac_log_limit_pass(ac_log_limit_t *limit, uint32_t count, uint64_t interval_ms, uint32_t *suppressed) {
+    uint64_t now = ac_time_ns();
+    uint64_t end = atomic_load_explicit(&limit->window_end, memory_order_relaxed);
+    // The caller that moves the window takes its first message and the
+    // count of the previous ones, others racing with it may let one more
+    // message through
+    if (now >= end &&
+        atomic_compare_exchange_strong_explicit(&limit->window_end, &end, now + interval_ms * 1000000ull, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        atomic_store_explicit(&limit->count, 1, memory_order_relaxed);
+        *suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+        return count > 0;
+    }
+    if (atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) < count) {
+        *suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+        return true;
+    }
+    atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+static void ac_log_console(FILE *fp, ac_log_level_t level, const char *message, size_t length) {
+    bool async = atomic_load_explicit(&ac_log_async, memory_order_relaxed);
+    // Fatal messages are written before returning, the process may be about to die
+    if (async && level < AC_LOG_LEVEL_FATAL && length < AC_LOG_MESSAGE_SIZE && ac_log_push(fp, level, message, length)) {
+        return;
+    }
+    if (async) {
+        ac_log_flush();
+    }
+    flockfile(fp);
     if (ac_log_color) {
-        fprintf(fd, "%s", ac_log_level_reset_color);
+        size_t prefix = strlen(ac_log_level_names[level]);
+        fputs(ac_log_level_colors[level], fp);
+        fwrite(message, 1, prefix, fp);
+        fputs(ac_log_level_reset_color, fp);
+        fwrite(message + prefix, 1, length - prefix, fp);
+    } else {
+        fwrite(message, 1, length, fp);
+    }
+    funlockfile(fp);
+    if (level == AC_LOG_LEVEL_FATAL) {
+        fflush(fp);
+    }
+}
+
+void ac_log(FILE *fd, ac_log_level_t level, const char *fmt, ...) {
+    if ((int)level < atomic_load_explicit(&ac_log_min_level, memory_order_relaxed)) {
+        return;
     }
+
+    char *message = ac_log_buffer;
+    size_t prefix = strlen(ac_log_level_names[level]);
+    memcpy(message, ac_log_level_names[level], prefix);
     va_list args;
     va_start(args, fmt);
-    vfprintf(fd, fmt, args);
+    int body = vsnprintf(message + prefix, AC_LOG_MESSAGE_SIZE - prefix, fmt, args);
     va_end(args);
+    if (body < 0) {
+        return;
+    }
+    size_t length = prefix + (size_t)body;
+    char *allocated = NULL;
+    if (length >= AC_LOG_MESSAGE_SIZE) {
+        // Too long for the buffer, formatted again in full, cut if even that fails
+        allocated = malloc(length + 1);
+        if (allocated != NULL) {
+            memcpy(allocated, message, prefix);
+            va_start(args, fmt);
+            vsnprintf(allocated + prefix, (size_t)body + 1, fmt, args);
+            va_end(args);
+            message = allocated;
+        } else {
+            length = AC_LOG_MESSAGE_SIZE - 1;
+        }
+    }
+
+    atomic_fetch_add(&ac_log_active, 1);
+    for (int i = 0; i < AC_LOG_MAX_SINKS; i++) {
+        ac_log_sink_entry_t *sink = &ac_log_sinks[i];
+        ac_log_sink_fn write = atomic_load_explicit(&sink->write, memory_order_acquire);
+        if (write != NULL && (int)level >= atomic_load_explicit(&sink->level, memory_order_relaxed)) {
+            write(sink->user, level, message, length);
+        }
+    }
+    atomic_fetch_sub(&ac_log_active, 1);
+    if ((int)level >= atomic_load_explicit(&ac_log_sinks[AC_LOG_SINK_CONSOLE].level, memory_order_relaxed)) {
+        ac_log_console(fd, level, message, length);
+    }
+    if (level == AC_LOG_LEVEL_FATAL) {
+        atomic_store(&ac_log_crash_pending, true);
+    }
+    free(allocated);
 }
@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include "core/ac_log_binary.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core/ac_time.h"
+
+// Binary log
+// Producers reserve records with a fetch_add on ac_log_binary_offset and
+// commit them by storing their size last. ac_log_binary_writers counts the
+// producers between loading the mapping and committing, close waits for it
+// to drop to 0 before unmapping. Sites get their id under the lock the first
+// time they log to an open file.
+
+// Marks a string limit taken from the '*' precision before it
+#define AC_LOG_BINARY_STAR_LIMIT UINT16_MAX
+
+// Largest arguments of a message
+#define AC_LOG_BINARY_MAX_PAYLOAD (AC_LOG_BINARY_MAX_ARGS * (sizeof(uint32_t) + AC_LOG_BINARY_MAX_STRING))
+
+static pthread_mutex_t ac_log_binary_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_log_site_t* ac_log_binary_sites = NULL;
+static uint32_t ac_log_binary_next_id = 1;
+
+static _Atomic(uint8_t*) ac_log_binary_map = NULL;
+static size_t ac_log_binary_size = 0;
+static int ac_log_binary_fd = -1;
+static _Atomic size_t ac_log_binary_offset = 0;
+static _Atomic int ac_log_binary_writers = 0;
+
+static _Thread_local uint32_t ac_log_binary_thread = 0;
+
+const char* ac_log_binary_conversion(const char* format, ac_log_binary_conversion_t* conversion) {
+    const char* c = strchr(format, '%');
+    if (c == NULL) {
+        return NULL;
+    }
+    *conversion = (ac_log_binary_conversion_t){.start = c, .precision = -1, .arg = AC_LOG_BINARY_ARG_INVALID};
+    c++;
+    while (*c != '\0' && strchr("-+ #0'", *c) != NULL) {
+        c++;
+    }
+    if (*c == '*') {
+        conversion->star_width = true;
+        c++;
+    } else {
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+    }
+    if (*c == '.') {
+        c++;
+        if (*c == '*') {
+            conversion->star_precision = true;
+            c++;
+        } else {
+            conversion->precision = 0;
+            while (*c >= '0' && *c <= '9') {
+                conversion->precision = conversion->precision * 10 + (*c - '0');
+                c++;
+            }
+        }
+    }
+
+    // Length modifier, 'h' and "hh" promote to int like no modifier
+    char length = '\0';
+    bool doubled = false;
+    if (*c != '\0' && strchr("hljztL", *c) != NULL) {
+        length = *c++;
+        if ((length == 'h' || length == 'l') && *c == length) {
+            doubled = true;
+            c++;
+        }
+    }
+
+    switch (*c) {
+        case '%':
+            conversion->arg = AC_LOG_BINARY_ARG_NONE;
+            break;
+        case 'd':
+        case 'i':
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'c':
+            switch (length) {
+                case '\0':
+                case 'h':
+                    conversion->arg = AC_LOG_BINARY_ARG_INT;
+                    break;
+                case 'l':
+                    // %lc takes a wint_t, promoted to int
+                    conversion->arg = doubled ? AC_LOG_BINARY_ARG_LONG_LONG
+                                      : *c == 'c' ? AC_LOG_BINARY_ARG_INT
+                                                  : AC_LOG_BINARY_ARG_LONG;
+                    break;
+                case 'j':
+                    conversion->arg = AC_LOG_BINARY_ARG_INTMAX;
+                    break;
+                case 'z':
+                    conversion->arg = AC_LOG_BINARY_ARG_SIZE;
+                    break;
+                case 't':
+                    conversion->arg = AC_LOG_BINARY_ARG_PTRDIFF;
+                    break;
+            }
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (length == 'L') {
+                conversion->arg = AC_LOG_BINARY_ARG_LONG_DOUBLE;
+            } else if (length == '\0' || (length == 'l' && !doubled)) {
+                conversion->arg = AC_LOG_BINARY_ARG_DOUBLE;
+            }
+            break;
+        case 's':
+            if (length == '\0') {
+                conversion->arg = AC_LOG_BINARY_ARG_STRING;
+            }
+            break;
+        case 'p':
+            if (length == '\0') {
+                conversion->arg = AC_LOG_BINARY_ARG_POINTER;
+            }
+            break;
+    }
+    if (*c == '\0') {
+        conversion->arg = AC_LOG_BINARY_ARG_INVALID;
+        conversion->length = (size_t)(c - conversion->start);
+        return c;
+    }
+    conversion->length = (size_t)(c + 1 - conversion->start);
+    return c + 1;
+}
+
+// Fills the arguments of the site, false if the format can't be logged
+static bool ac_log_binary_parse(ac_log_site_t* site) {
+    site->arg_count = 0;
+    const char* format = site->format;
+    ac_log_binary_conversion_t conversion;
+    while ((format = ac_log_binary_conversion(format, &conversion)) != NULL) {
+        if (conversion.arg == AC_LOG_BINARY_ARG_INVALID) {
+            return false;
+        }
+        if (conversion.arg == AC_LOG_BINARY_ARG_NONE) {
+            continue;
+        }
+        size_t needed = 1 + conversion.star_width + conversion.star_precision;
+        if (site->arg_count + needed > AC_LOG_BINARY_MAX_ARGS) {
+            return false;
+        }
+        if (conversion.star_width) {
+            site->args[site->arg_count++] = AC_LOG_BINARY_ARG_INT;
+        }
+        if (conversion.star_precision) {
+            site->args[site->arg_count++] = AC_LOG_BINARY_ARG_INT;
+        }
+        uint16_t limit = AC_LOG_BINARY_MAX_STRING;
+        if (conversion.star_precision) {
+            limit = AC_LOG_BINARY_STAR_LIMIT;
+        } else if (conversion.precision >= 0 && conversion.precision < AC_LOG_BINARY_MAX_STRING) {
+            limit = (uint16_t)conversion.precision;
+        }
+        site->limits[site->arg_count] = limit;
+        site->args[site->arg_count++] = (uint8_t)conversion.arg;
+    }
+    return true;
+}
+
+// Returns the record to fill, NULL if no file is open or it's full. Every
+// record returned must be committed with the size set here.
+static ac_log_binary_record_t* ac_log_binary_reserve(size_t payload, uint32_t* size) {
+    atomic_fetch_add(&ac_log_binary_writers, 1);
+    uint8_t* map = atomic_load(&ac_log_binary_map);
+    if (map == NULL) {
+        atomic_fetch_sub(&ac_log_binary_writers, 1);
+        return NULL;
+    }
+    *size = (uint32_t)((sizeof(ac_log_binary_record_t) + payload + 7) & ~(size_t)7);
+    size_t offset = atomic_fetch_add_explicit(&ac_log_binary_offset, *size, memory_order_relaxed);
+    if (offset + *size > ac_log_binary_size) {
+        ac_log_binary_header_t* header = (ac_log_binary_header_t*)map;
+        atomic_fetch_add_explicit((_Atomic uint64_t*)&header->dropped, 1, memory_order_relaxed);
+        atomic_fetch_sub(&ac_log_binary_writers, 1);
+        return NULL;
+    }
+    ac_log_binary_record_t* record = (ac_log_binary_record_t*)(map + offset);
+    record->ticks = ac_time_ticks();
+    if (ac_log_binary_thread == 0) {
+        ac_log_binary_thread = (uint32_t)syscall(SYS_gettid);
+    }
+    record->thread = ac_log_binary_thread;
+    record->padding = 0;
+    return record;
+}
+
+static void ac_log_binary_commit(ac_log_binary_record_t* record, uint32_t site, uint32_t size) {
+    record->site = site;
+    atomic_store_explicit((_Atomic uint32_t*)&record->size, size, memory_order_release);
+    atomic_fetch_sub(&ac_log_binary_writers, 1);
+}
+
+// Must hold the lock
+static void ac_log_binary_define(ac_log_site_t* site) {
+    size_t format_len = strlen(site->format);
+    size_t file_len = strlen(site->file);
+    uint32_t size;
+    ac_log_binary_record_t* record = ac_log_binary_reserve(sizeof(ac_log_binary_site_t) + format_len + file_len, &size);
+    if (record == NULL) {
+        return;
+    }
+    ac_log_binary_site_t definition = {
+        .id = atomic_load_explicit(&site->id, memory_order_relaxed),
+        .level = (uint32_t)site->level,
+        .line = site->line,
+        .format_len = (uint32_t)format_len,
+        .file_len = (uint32_t)file_len,
+    };
+    uint8_t* data = (uint8_t*)(record + 1);
+    memcpy(data, &definition, sizeof(definition));
+    memcpy(data + sizeof(definition), site->format, format_len);
+    memcpy(data + sizeof(definition) + format_len, site->file, file_len);
+    ac_log_binary_commit(record, AC_LOG_BINARY_SITE_DEFINITION, size);
+}
+
+static uint32_t ac_log_binary_register(ac_log_site_t* site) {
+    pthread_mutex_lock(&ac_log_binary_lock);
+    uint32_t id = atomic_load_explicit(&site->id, memory_order_relaxed);
+    if (id == 0) {
+        if (ac_log_binary_parse(site)) {
+            id = ac_log_binary_next_id++;
+            atomic_store_explicit(&site->id, id, memory_order_release);
+            site->next = ac_log_binary_sites;
+            ac_log_binary_sites = site;
+            ac_log_binary_define(site);
+        } else {
+            id = UINT32_MAX;
+            atomic_store_explicit(&site->id, id, memory_order_release);
+            ac_log_warn("%s:%u: format \"%s\" can't be logged in binary, the call is ignored\n", site->file, site->line,
+                        site->format);
+        }
+    }
+    pthread_mutex_unlock(&ac_log_binary_lock);
+    return id;
+}
+
+void ac_log_binary(ac_log_site_t* site, ...) {
+    if (atomic_load_explicit(&ac_log_binary_map, memory_order_relaxed) == NULL) {
+        return;
+    }
+    uint32_t id = atomic_load_explicit(&site->id, memory_order_acquire);
+    if (id == 0) {
+        id = ac_log_binary_register(site);
+    }
+    if (id == UINT32_MAX) {
+        return;
+    }
+
+    uint8_t payload[AC_LOG_BINARY_MAX_PAYLOAD];
+    size_t length = 0;
+    int last_int = 0;
+    va_list args;
+    va_start(args, site);
+    for (uint32_t i = 0; i < site->arg_count; i++) {
+        uint64_t value = 0;
+        switch ((ac_log_binary_arg_t)site->args[i]) {
+            case AC_LOG_BINARY_ARG_INT:
+                last_int = va_arg(args, int);
+                memcpy(payload + length, &last_int, sizeof(last_int));
+                length += sizeof(last_int);
+                continue;
+            case AC_LOG_BINARY_ARG_LONG:
+                value = (uint64_t)va_arg(args, long);
+                break;
+            case AC_LOG_BINARY_ARG_LONG_LONG:
+                value = (uint64_t)va_arg(args, long long);
+                break;
+            case AC_LOG_BINARY_ARG_SIZE:
+                value = (uint64_t)va_arg(args, size_t);
+                break;
+            case AC_LOG_BINARY_ARG_INTMAX:
+                value = (uint64_t)va_arg(args, intmax_t);
+                break;
+            case AC_LOG_BINARY_ARG_PTRDIFF:
+                value = (uint64_t)va_arg(args, ptrdiff_t);
+                break;
+            case AC_LOG_BINARY_ARG_POINTER:
+                value = (uint64_t)(uintptr_t)va_arg(args, void*);
+                break;
+            case AC_LOG_BINARY_ARG_DOUBLE: {
+                double number = va_arg(args, double);
+                memcpy(&value, &number, sizeof(value));
+                break;
+            }
+            case AC_LOG_BINARY_ARG_LONG_DOUBLE: {
+                // Stored as 16 bytes, the padding of x87 long doubles zeroed
+                uint8_t bytes[16] = {0};
+                long double number = va_arg(args, long double);
+                memcpy(bytes, &number, sizeof(number) < sizeof(bytes) ? sizeof(number) : sizeof(bytes));
+                memcpy(payload + length, bytes, sizeof(bytes));
+                length += sizeof(bytes);
+                continue;
+            }
+            case AC_LOG_BINARY_ARG_STRING: {
+                const char* string = va_arg(args, const char*);
+                if (string == NULL) {
+                    string = "(null)";
+                }
+                size_t limit = site->limits[i];
+                if (limit == AC_LOG_BINARY_STAR_LIMIT) {
+                    limit = last_int >= 0 && last_int < AC_LOG_BINARY_MAX_STRING ? (size_t)last_int
+                                                                                 : AC_LOG_BINARY_MAX_STRING;
+                }
+                uint32_t string_len = (uint32_t)strnlen(string, limit);
+                memcpy(payload + length, &string_len, sizeof(string_len));
+                memcpy(payload + length + sizeof(string_len), string, string_len);
+                length += sizeof(string_len) + string_len;
+                continue;
+            }
+            default:
+                break;
+        }
+        memcpy(payload + length, &value, sizeof(value));
+        length += sizeof(value);
+    }
+    va_end(args);
+
+    uint32_t size;
+    ac_log_binary_record_t* record = ac_log_binary_reserve(length, &size);
+    if (record == NULL) {
+        return;
+    }
+    memcpy(record + 1, payload, length);
+    ac_log_binary_commit(record, id, size);
+}
+
+bool ac_log_binary_open(const char* path, size_t size) {
+    ac_log_binary_close();
+    if (size < sizeof(ac_log_binary_header_t)) {
+        size = sizeof(ac_log_binary_header_t);
+    }
+
+    pthread_mutex_lock(&ac_log_binary_lock);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&ac_log_binary_lock);
+        ac_log_error("Failed to open %s for the binary log\n", path);
+        return false;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        pthread_mutex_unlock(&ac_log_binary_lock);
+        ac_log_error("Failed to map %zu bytes of %s for the binary log\n", size, path);
+        return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t ticks = ac_time_ticks();
+    uint64_t span = 1ull << 32;
+    ac_log_binary_header_t* header = map;
+    *header = (ac_log_binary_header_t){
+        .magic = AC_LOG_BINARY_MAGIC,
+        .version = AC_LOG_BINARY_VERSION,
+        .size = size,
+        .base_ticks = ticks,
+        .base_realtime_ns = (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec,
+        .ns_per_tick = (double)(ac_time_ticks_to_ns(ticks + span) - ac_time_ticks_to_ns(ticks)) / (double)span,
+    };
+
+    ac_log_binary_fd = fd;
+    ac_log_binary_size = size;
+    atomic_store(&ac_log_binary_offset, sizeof(ac_log_binary_header_t));
+    atomic_store(&ac_log_binary_map, (uint8_t*)map);
+    // Sites used with a previous file
+    for (ac_log_site_t* site = ac_log_binary_sites; site != NULL; site = site->next) {
+        ac_log_binary_define(site);
+    }
+    pthread_mutex_unlock(&ac_log_binary_lock);
+    return true;
+}
+
+void ac_log_binary_close(void) {
+    pthread_mutex_lock(&ac_log_binary_lock);
+    uint8_t* map = atomic_exchange(&ac_log_binary_map, NULL);
+    if (map != NULL) {
+        while (atomic_load(&ac_log_binary_writers) > 0) {
+            sched_yield();
+        }
+        size_t used = atomic_load(&ac_log_binary_offset);
+        if (used > ac_log_binary_size) {
+            used = ac_log_binary_size;
+        }
+        munmap(map, ac_log_binary_size);
+        if (ftruncate(ac_log_binary_fd, (off_t)used) != 0) {
+            ac_log_warn("Failed to truncate the binary log\n");
+        }
+        close(ac_log_binary_fd);
+        ac_log_binary_fd = -1;
+    }
+    pthread_mutex_unlock(&ac_log_binary_lock);
+}
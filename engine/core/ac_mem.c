@@ -1,11 +1,23 @@
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "core/ac_arena.h"
 #include "core/ac_log.h"
 #include "core/ac_mem.h"
+#include "core/ac_mem_snapshot.h"
+#include "core/ac_pool.h"
+#include "core/ac_tcache.h"
 #include "core/ac_trace.h"
-#include "ds/ac_map.h"
+#include "core/ac_vmem.h"
 
 static ac_malloc_t ac_malloc_func = malloc;
 static ac_free_t ac_free_func = free;
@@ -13,11 +25,71 @@ static ac_calloc_t ac_calloc_func = calloc;
 static ac_realloc_t ac_realloc_func = realloc;
 
 static bool ac_mem_track = true;
-
-static ac_map_t* ac_mem_map = NULL;
+static atomic_bool ac_mem_tracked_any = false;
+static atomic_size_t ac_mem_sample_interval = 0;
+static atomic_size_t ac_mem_large_threshold = AC_MEM_LARGE_THRESHOLD;
+
+// Tracking state of one thread. Blocks are linked into the list of the thread
+// that allocated them and the lock is only contended when another thread
+// frees one of them or a report walks the list. Records of exited threads
+// stay registered, with their blocks, and get adopted by new threads.
+typedef struct ac_mem_thread_t {
+    pthread_mutex_t lock;
+    ac_mem_entry_t live;
+    size_t live_count;
+    bool exited;
+    int64_t bytes_until_sample;
+    uint64_t rng;
+    struct ac_mem_thread_t* next;
+} ac_mem_thread_t;
+
+// Counters of one memory entry type, updated inline by every tracked call.
+// frame_peak_bytes is restarted by ac_mem_frame_end.
+typedef struct ac_mem_counters_t {
+    atomic_size_t live_bytes;
+    atomic_size_t peak_bytes;
+    atomic_size_t frame_peak_bytes;
+    atomic_size_t alloc_count;
+    atomic_size_t alloc_bytes;
+    atomic_size_t free_count;
+    atomic_size_t free_bytes;
+} ac_mem_counters_t;
+
+static ac_mem_counters_t ac_mem_counters[AC_MEM_ENTRY_COUNT];
+
+typedef struct ac_mem_budget_t {
+    atomic_size_t soft;
+    atomic_size_t hard;
+    ac_mem_budget_callback_t callback;
+    void* user_data;
+} ac_mem_budget_t;
+
+static ac_mem_budget_t ac_mem_budgets[AC_MEM_ENTRY_COUNT];
+// Allocations made by a budget callback don't call it again
+static _Thread_local bool ac_mem_budget_in_callback = false;
+
+#define AC_MEM_TYPE_STACK_DEPTH 32
+
+static _Thread_local ac_mem_entry_type_t ac_mem_type_stack[AC_MEM_TYPE_STACK_DEPTH];
+static _Thread_local size_t ac_mem_type_depth = 0;
+
+// Ring of the last AC_MEM_FRAME_HISTORY frames. The cumulative counters at
+// the end of the last frame are kept to turn the next snapshot into deltas.
+static pthread_mutex_t ac_mem_frames_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_mem_frame_stats_t ac_mem_frames[AC_MEM_FRAME_HISTORY];
+static uint64_t ac_mem_frame_count = 0;
+static ac_mem_stats_t ac_mem_frame_last[AC_MEM_ENTRY_COUNT];
+
+static pthread_mutex_t ac_mem_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_mem_thread_t* ac_mem_threads = NULL;
+static pthread_once_t ac_mem_thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ac_mem_thread_key;
+static _Thread_local ac_mem_thread_t* ac_mem_thread_local = NULL;
 
 #define ALLOC_TRACE_SIZE 32
 
+_Static_assert(sizeof(ac_mem_entry_t) % 16 == 0, "ac_mem_entry_t must keep the user pointer 16 byte aligned");
+
 void set_custom_malloc(ac_malloc_t malloc) { ac_malloc_func = malloc; }
 
 void set_custom_free(ac_free_t free) { ac_free_func = free; }
@@ -26,283 +98,553 @@ void set_custom_calloc(ac_calloc_t calloc) { ac_calloc_func = calloc; }
 
 void set_custom_realloc(ac_realloc_t realloc) { ac_realloc_func = realloc; }
 
-void ac_mem_track_enabled(bool enabled) { ac_mem_track = enabled; }
+void ac_mem_set_sample_interval(size_t interval) {
+    atomic_store_explicit(&ac_mem_sample_interval, interval, memory_order_relaxed);
+}
 
-static int ac_mem_ptr_cmp(const void* a, const void* b) {
-    if (a == b) {
-        return 0;
+void ac_mem_set_large_threshold(size_t threshold) {
+    atomic_store_explicit(&ac_mem_large_threshold, threshold, memory_order_relaxed);
+}
+
+// Whether type indexes the per-type tables
+static inline bool ac_mem_type_check(ac_mem_entry_type_t type) {
+    if ((unsigned)type < AC_MEM_ENTRY_COUNT) {
+        return true;
+    }
+    ac_log_error("Invalid memory type %d\n", (int)type);
+    return false;
+}
+
+void ac_mem_set_budget(ac_mem_entry_type_t type, size_t soft, size_t hard, ac_mem_budget_callback_t callback, void* user_data) {
+    if (!ac_mem_type_check(type)) {
+        return;
+    }
+    ac_mem_budget_t* budget = &ac_mem_budgets[type];
+    budget->callback = callback;
+    budget->user_data = user_data;
+    atomic_store_explicit(&budget->soft, soft, memory_order_relaxed);
+    atomic_store_explicit(&budget->hard, hard, memory_order_relaxed);
+}
+
+void ac_mem_push_type(ac_mem_entry_type_t type) {
+    if (ac_mem_type_depth >= AC_MEM_TYPE_STACK_DEPTH) {
+        ac_log_error("Memory type scopes nested deeper than %d, keeping %s\n", AC_MEM_TYPE_STACK_DEPTH,
+                     ac_mem_entry_type_str(ac_mem_type_stack[AC_MEM_TYPE_STACK_DEPTH - 1]));
+    } else {
+        ac_mem_type_stack[ac_mem_type_depth] = type;
     }
-    return a < b ? -1 : 1;
+    ac_mem_type_depth++;
 }
 
-static size_t ac_mem_ptr_hash(const void* key) {
-    size_t hash = SIP64((void*)&key, sizeof(void*), 0, 1);
-    // size_t hash = (size_t)key;
-    return hash;
+void ac_mem_pop_type(void) {
+    if (ac_mem_type_depth == 0) {
+        ac_log_error("ac_mem_pop_type without a matching ac_mem_push_type\n");
+        return;
+    }
+    ac_mem_type_depth--;
 }
 
-static void* ac_mem_ptr_copy(const void* key, ac_mem_entry_type_t type) {
-    (void)type;
-    return (void*)key;
+void ac_mem_track_enabled(bool enabled) {
+    if (atomic_load_explicit(&ac_mem_tracked_any, memory_order_relaxed) && enabled != ac_mem_track) {
+        ac_log_warn("Memory tracking can't be toggled after the first tracked allocation\n");
+        return;
+    }
+    ac_mem_track = enabled;
 }
 
-static void ac_mem_ptr_free(void* key) { (void)key; }
+static inline ac_mem_entry_t* ac_mem_entry_of(void* ptr) { return (ac_mem_entry_t*)ptr - 1; }
 
-static int ac_mem_ptr_display(const void* key, char* buffer, size_t size) { return snprintf(buffer, size, "%p", key); }
+static inline void* ac_mem_entry_data(ac_mem_entry_t* entry) { return entry + 1; }
 
-static ac_map_key_ops_t ac_mem_key_ops = {.cmp = ac_mem_ptr_cmp,
-                                          .hash = ac_mem_ptr_hash,
-                                          .copy = ac_mem_ptr_copy,
-                                          .free = ac_mem_ptr_free,
-                                          .display = ac_mem_ptr_display};
+static void ac_mem_thread_exit(void* value) {
+    ac_mem_thread_t* thread = value;
+    pthread_mutex_lock(&ac_mem_threads_lock);
+    thread->exited = true;
+    pthread_mutex_unlock(&ac_mem_threads_lock);
+}
 
-static void* ac_mem_entry_copy(const void* value, ac_mem_entry_type_t type) {
-    (void)type;
-    ac_mem_entry_t* entry = (ac_mem_entry_t*)value;
-    ac_mem_entry_t* copy = ac_malloc_func(sizeof(ac_mem_entry_t));
-    memcpy(copy, entry, sizeof(ac_mem_entry_t));
+static void ac_mem_thread_key_init(void) { pthread_key_create(&ac_mem_thread_key, ac_mem_thread_exit); }
 
-    copy->alloc_trace = ac_malloc_func(entry->alloc_trace_size * sizeof(void*));
-    memcpy(copy->alloc_trace, entry->alloc_trace, entry->alloc_trace_size * sizeof(void*));
-    copy->alloc_trace_size = entry->alloc_trace_size;
+static ac_mem_thread_t* ac_mem_thread_get(void) {
+    if (ac_mem_thread_local != NULL) {
+        return ac_mem_thread_local;
+    }
+    pthread_once(&ac_mem_thread_key_once, ac_mem_thread_key_init);
+    atomic_store_explicit(&ac_mem_tracked_any, true, memory_order_relaxed);
 
-    if (entry->free_trace == NULL) {
-        copy->free_trace = NULL;
+    pthread_mutex_lock(&ac_mem_threads_lock);
+    ac_mem_thread_t* thread = ac_mem_threads;
+    while (thread != NULL && !thread->exited) {
+        thread = thread->next;
+    }
+    if (thread != NULL) {
+        thread->exited = false;
     } else {
-        copy->free_trace = ac_malloc_func(entry->free_trace_size * sizeof(void*));
-        memcpy(copy->free_trace, entry->free_trace, entry->free_trace_size * sizeof(void*));
-        copy->free_trace_size = entry->free_trace_size;
-    }
-
-    if (entry->realloc_traces == NULL) {
-        copy->realloc_traces = NULL;
-        copy->realloc_trace_sizes = NULL;
-        copy->realloc_traces_size = 0;
-        copy->realloc_traces_capacity = 0;
-        copy->realloc_count = 0;
-        copy->realloc_trace_sizes_capacity = 0;
+        thread = ac_calloc_func(1, sizeof(ac_mem_thread_t));
+        if (thread == NULL) {
+            ac_log_fatal_exit("Failed to allocate memory tracking state\n");
+        }
+        pthread_mutex_init(&thread->lock, NULL);
+        thread->live.prev = &thread->live;
+        thread->live.next = &thread->live;
+        thread->live.owner = thread;
+        thread->rng = (uint64_t)(uintptr_t)thread ^ 0x9E3779B97F4A7C15ULL;
+        thread->next = ac_mem_threads;
+        ac_mem_threads = thread;
+    }
+    pthread_mutex_unlock(&ac_mem_threads_lock);
+
+    pthread_setspecific(ac_mem_thread_key, thread);
+    ac_mem_thread_local = thread;
+    return thread;
+}
+
+// Called with the owner's lock held
+static void ac_mem_entry_link(ac_mem_thread_t* thread, ac_mem_entry_t* entry) {
+    entry->owner = thread;
+    entry->prev = &thread->live;
+    entry->next = thread->live.next;
+    thread->live.next->prev = entry;
+    thread->live.next = entry;
+    thread->live_count++;
+}
+
+// Called with the owner's lock held
+static void ac_mem_entry_unlink(ac_mem_entry_t* entry) {
+    ac_mem_thread_t* thread = entry->owner;
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    thread->live_count--;
+}
+
+static inline void ac_mem_peak_update(atomic_size_t* peak, size_t live) {
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while (old < live && !atomic_compare_exchange_weak_explicit(peak, &old, live, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static __attribute__((noinline, cold)) void ac_mem_budget_notify(ac_mem_entry_type_t type, size_t live, size_t budget, bool hard) {
+    ac_mem_budget_t* entry = &ac_mem_budgets[type];
+    if (entry->callback == NULL || ac_mem_budget_in_callback) {
+        return;
+    }
+    ac_mem_budget_in_callback = true;
+    entry->callback(type, live, budget, hard, entry->user_data);
+    ac_mem_budget_in_callback = false;
+}
+
+static __attribute__((noinline, cold)) bool ac_mem_budget_check_hard(ac_mem_entry_type_t type, size_t size, size_t hard) {
+    ac_mem_counters_t* counters = &ac_mem_counters[type];
+    size_t live = atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+    if (live + size <= hard) {
+        return true;
+    }
+    // Give the callback a chance to free enough
+    ac_mem_budget_notify(type, live, hard, true);
+    live = atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+    if (live + size <= hard) {
+        return true;
+    }
+    ac_log_error("%s over its hard budget: %zu live + %zu requested > %zu\n", ac_mem_entry_type_str(type), live, size, hard);
+    return false;
+}
+
+// Whether size more bytes of type fit in its hard budget
+static inline bool ac_mem_budget_check(ac_mem_entry_type_t type, size_t size) {
+    size_t hard = atomic_load_explicit(&ac_mem_budgets[type].hard, memory_order_relaxed);
+    return hard == 0 || ac_mem_budget_check_hard(type, size, hard);
+}
+
+static inline ac_mem_entry_type_t ac_mem_type_scoped(ac_mem_entry_type_t type) {
+    if (ac_mem_type_depth == 0) {
+        return type;
+    }
+    size_t top = ac_mem_type_depth < AC_MEM_TYPE_STACK_DEPTH ? ac_mem_type_depth : AC_MEM_TYPE_STACK_DEPTH;
+    return ac_mem_type_stack[top - 1];
+}
+
+static inline void ac_mem_counters_alloc(ac_mem_entry_type_t type, size_t size) {
+    ac_mem_counters_t* counters = &ac_mem_counters[type];
+    atomic_fetch_add_explicit(&counters->alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->alloc_bytes, size, memory_order_relaxed);
+    size_t live = atomic_fetch_add_explicit(&counters->live_bytes, size, memory_order_relaxed) + size;
+    ac_mem_peak_update(&counters->peak_bytes, live);
+    ac_mem_peak_update(&counters->frame_peak_bytes, live);
+    // Only fires when this allocation is the one crossing the soft budget
+    size_t soft = atomic_load_explicit(&ac_mem_budgets[type].soft, memory_order_relaxed);
+    if (soft != 0 && live > soft && live - size <= soft) {
+        ac_mem_budget_notify(type, live, soft, false);
+    }
+}
+
+static inline void ac_mem_counters_free(ac_mem_entry_type_t type, size_t size) {
+    ac_mem_counters_t* counters = &ac_mem_counters[type];
+    atomic_fetch_add_explicit(&counters->free_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->free_bytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&counters->live_bytes, size, memory_order_relaxed);
+}
+
+// A resize counts as a free of the old size and an allocation of the new one,
+// live_bytes only moves by the difference
+static inline void ac_mem_counters_realloc(ac_mem_entry_type_t type, size_t old_size, size_t size) {
+    ac_mem_counters_t* counters = &ac_mem_counters[type];
+    atomic_fetch_add_explicit(&counters->free_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->free_bytes, old_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->alloc_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counters->alloc_bytes, size, memory_order_relaxed);
+    if (size <= old_size) {
+        atomic_fetch_sub_explicit(&counters->live_bytes, old_size - size, memory_order_relaxed);
+        return;
+    }
+    size_t growth = size - old_size;
+    size_t live = atomic_fetch_add_explicit(&counters->live_bytes, growth, memory_order_relaxed) + growth;
+    ac_mem_peak_update(&counters->peak_bytes, live);
+    ac_mem_peak_update(&counters->frame_peak_bytes, live);
+    size_t soft = atomic_load_explicit(&ac_mem_budgets[type].soft, memory_order_relaxed);
+    if (soft != 0 && live > soft && live - growth <= soft) {
+        ac_mem_budget_notify(type, live, soft, false);
+    }
+}
+
+static uint64_t ac_mem_thread_random(ac_mem_thread_t* thread) {
+    // xorshift64*
+    thread->rng ^= thread->rng >> 12;
+    thread->rng ^= thread->rng << 25;
+    thread->rng ^= thread->rng >> 27;
+    return thread->rng * 0x2545F4914F6CDD1DULL;
+}
+
+// Whether this allocation is picked by the byte interval sampler. The gaps
+// between samples are exponentially distributed, so every byte has the same
+// 1 / interval chance of triggering a sample.
+static bool ac_mem_thread_sample(ac_mem_thread_t* thread, size_t size, size_t interval) {
+    thread->bytes_until_sample -= (int64_t)size;
+    if (thread->bytes_until_sample > 0) {
+        return false;
+    }
+    double u = ((double)(ac_mem_thread_random(thread) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    thread->bytes_until_sample = (int64_t)(-log(u) * (double)interval) + 1;
+    return true;
+}
+
+// Number of bytes a block stands for in the live heap estimate
+static double ac_mem_entry_weight(ac_mem_entry_t* entry, size_t interval) {
+    if (!(entry->flags & AC_MEM_ENTRY_FLAG_SAMPLED) || interval == 0 || entry->size == 0) {
+        return (double)entry->size;
+    }
+    double probability = 1.0 - exp(-(double)entry->size / (double)interval);
+    return (double)entry->size / probability;
+}
+
+// Always inlined so the captured trace starts at the public entry point
+static inline __attribute__((always_inline)) ac_trace_id_t ac_mem_capture_trace(void) {
+    if (ac_trace_get_unwinder() == AC_TRACE_UNWINDER_CALLER) {
+        // Inlined in ac_malloc and friends, so this is their caller. The first
+        // two frames stand for ac_get_intermediate_trace and the allocation
+        // function, as in a full trace.
+        void* pc = ac_trace_pc();
+        void* trace[3] = {pc, pc, __builtin_return_address(0)};
+        return ac_trace_intern(trace, 3);
+    }
+    void* trace[ALLOC_TRACE_SIZE];
+    int trace_size = ac_get_intermediate_trace(trace, ALLOC_TRACE_SIZE);
+    return ac_trace_intern(trace, trace_size);
+}
+
+static inline __attribute__((always_inline)) void* ac_mem_entry_init(ac_mem_entry_t* entry, size_t size, ac_mem_entry_type_t type,
+                                                                     size_t offset, size_t alignment, uint32_t flags) {
+    ac_mem_thread_t* thread = ac_mem_thread_get();
+    ac_mem_counters_alloc(type, size);
+
+    entry->offset = (uint16_t)offset;
+    entry->alignment = (uint16_t)alignment;
+    entry->size = size;
+    entry->state = AC_MEM_ENTRY_STATE_ALLOCATED;
+    entry->type = type;
+    entry->canary = AC_MEM_CANARY_ALIVE;
+    entry->realloc_trace = AC_TRACE_ID_NONE;
+    entry->realloc_count = 0;
+    entry->owner = thread;
+    entry->prev = NULL;
+    entry->next = NULL;
+
+    size_t interval = atomic_load_explicit(&ac_mem_sample_interval, memory_order_relaxed);
+    if (interval == 0) {
+        entry->flags = flags | AC_MEM_ENTRY_FLAG_TRACED;
+    } else if (ac_mem_thread_sample(thread, size, interval)) {
+        entry->flags = flags | AC_MEM_ENTRY_FLAG_TRACED | AC_MEM_ENTRY_FLAG_SAMPLED;
     } else {
-        copy->realloc_traces = ac_malloc_func(entry->realloc_traces_capacity * sizeof(void*));
-        memcpy(copy->realloc_traces, entry->realloc_traces, entry->realloc_traces_capacity * sizeof(void*));
-        copy->realloc_trace_sizes = ac_malloc_func(entry->realloc_trace_sizes_capacity * sizeof(int32_t));
-        memcpy(copy->realloc_trace_sizes, entry->realloc_trace_sizes, entry->realloc_trace_sizes_capacity * sizeof(int32_t));
-        copy->realloc_traces_size = entry->realloc_traces_size;
-        copy->realloc_traces_capacity = entry->realloc_traces_capacity;
-        copy->realloc_count = entry->realloc_count;
-        copy->realloc_trace_sizes_capacity = entry->realloc_trace_sizes_capacity;
-    }
-    return copy;
-}
-
-static void ac_mem_entry_free(void* value) {
-    ac_mem_entry_t* entry = (ac_mem_entry_t*)value;
-    if (entry->alloc_trace != NULL) {
-        ac_free_func(entry->alloc_trace);
-        entry->alloc_trace = NULL;
-    }
-    if (entry->free_trace != NULL) {
-        ac_free_func(entry->free_trace);
-        entry->free_trace = NULL;
-    }
-
-    if (entry->realloc_traces != NULL) {
-        ac_free_func(entry->realloc_traces);
-        entry->realloc_traces = NULL;
-        ac_free_func(entry->realloc_trace_sizes);
-        entry->realloc_trace_sizes = NULL;
-    }
-    ac_free_func(entry);
-}
-
-static int ac_mem_entry_display(const void* value, char* buffer, size_t size) {
-    ac_mem_entry_t* entry = (ac_mem_entry_t*)value;
-    int offset = 0;
-    offset += snprintf(buffer + offset, size - offset, "ptr: %p\n", entry->ptr);
-    offset += snprintf(buffer + offset, size - offset, "size: %zu\n", entry->size);
-    offset += snprintf(buffer + offset, size - offset, "state: %d\n", entry->state);
-    offset += snprintf(buffer + offset, size - offset, "type: %d\n", entry->type);
-    offset += snprintf(buffer + offset, size - offset, "alloc_trace: ");
-    char trace_buffer[1024];
-    ac_sprint_intermediate_trace(entry->alloc_trace, trace_buffer, 0, entry->alloc_trace_size);
-    offset += snprintf(buffer + offset, size - offset, "%s", trace_buffer);
-    offset += snprintf(buffer + offset, size - offset, "\n");
-    offset += snprintf(buffer + offset, size - offset, "free_trace: ");
-    ac_sprint_intermediate_trace(entry->free_trace, trace_buffer, 0, entry->free_trace_size);
-    offset += snprintf(buffer + offset, size - offset, "%s", trace_buffer);
-    offset += snprintf(buffer + offset, size - offset, "\n");
-    offset += snprintf(buffer + offset, size - offset, "realloc_traces: ");
-    int32_t trace_offset = 0;
-    for (int32_t i = 0; i < entry->realloc_count; i++) {
-        ac_sprint_intermediate_trace(entry->realloc_traces + trace_offset, trace_buffer, 0, entry->realloc_trace_sizes[i]);
-        offset += snprintf(buffer + offset, size - offset, "%s", trace_buffer);
-        trace_offset += entry->realloc_trace_sizes[i];
-    }
-    offset += snprintf(buffer + offset, size - offset, "\n");
-    return offset;
-}
-
-static ac_map_value_ops_t ac_mem_value_ops = {
-    .copy = ac_mem_entry_copy,
-    .free = ac_mem_entry_free,
-    .display = ac_mem_entry_display,
-};
-
-static void ac_mem_map_free_op(void* ptr) { ac_free_func(ptr); }
-
-static void* ac_mem_map_malloc_op(size_t size, ac_mem_entry_type_t entry_type) {
-    (void)entry_type;
-    return ac_malloc_func(size);
-}
-
-static void* ac_mem_map_calloc_op(size_t nmemb, size_t size, ac_mem_entry_type_t entry_type) {
-    (void)entry_type;
-    return ac_calloc_func(nmemb, size);
-}
-
-static ac_map_mem_ops_t map_mem_ops = {
-    .map_free = ac_mem_map_free_op,
-    .map_malloc = ac_mem_map_malloc_op,
-    .map_calloc = ac_mem_map_calloc_op,
-};
+        entry->flags = flags;
+        entry->alloc_trace = AC_TRACE_ID_NONE;
+        return ac_mem_entry_data(entry);
+    }
+
+    entry->alloc_trace = ac_mem_capture_trace();
+    pthread_mutex_lock(&thread->lock);
+    ac_mem_entry_link(thread, entry);
+    pthread_mutex_unlock(&thread->lock);
+    return ac_mem_entry_data(entry);
+}
+
+// Checks the header of a block handed back to us. Returns false if the
+// pointer can't be one of ours. A freed header is only read on a best effort
+// basis, the allocator is free to have reused the memory by then.
+static bool ac_mem_entry_check(void* ptr, ac_mem_entry_t* entry, const char* op) {
+    if (entry->canary == AC_MEM_CANARY_ALIVE) {
+        return true;
+    }
+    if (entry->canary == AC_MEM_CANARY_FREED) {
+        ac_log_fatal("Double %s detected\n", op);
+        ac_log_fatal("Ptr: %p, size: %zu\n", ptr, entry->size);
+        ac_log_fatal("Allocated at:\n");
+        char buffer[AC_TRACE_BUFFER_SIZE];
+        ac_sprint_trace_id_cached(entry->alloc_trace, buffer, 0);
+        ac_log_fatal("%s\n", buffer);
+        ac_log_fatal("Current %s at:\n", op);
+        ac_print_trace_cached(3);
+        return false;
+    }
+    ac_log_info("%s trace: ", op);
+    ac_print_trace_cached(3);
+    ac_log_fatal("Ptr: %p\n", ptr);
+    ac_log_fatal("Trying to %s a ptr not in the records.. Header canary mismatch\n", op);
+    return false;
+}
 
 void ac_mem_init(void) {
     if (!ac_mem_track) {
         return;
     }
-    ac_mem_map = ac_map_new_custom(16, AC_MEM_ENTRY_CORE, map_mem_ops, ac_mem_key_ops, ac_mem_value_ops);
+    ac_mem_thread_get();
 }
 
-void* ac_malloc(size_t size, ac_mem_entry_type_t type) {
+// Bytes to skip from the start of an allocation for the data past the header
+// to be aligned
+static inline size_t ac_mem_align_offset(void* raw, size_t alignment) {
+    return (size_t)(-((uintptr_t)raw + sizeof(ac_mem_entry_t))) & (alignment - 1);
+}
+
+static inline bool ac_mem_is_large(size_t size) {
+    size_t threshold = atomic_load_explicit(&ac_mem_large_threshold, memory_order_relaxed);
+    return threshold != 0 && size >= threshold;
+}
+
+// Length of the mapping of a large block. Mappings are page aligned, which
+// covers every alignment up to AC_MEM_MAX_ALIGNMENT, so the offset only skips
+// room for the header.
+static inline size_t ac_mem_mapping_length(size_t offset, size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (offset + sizeof(ac_mem_entry_t) + size + page - 1) & ~(page - 1);
+}
+
+static void* ac_mem_map(size_t offset, size_t size) {
+    void* raw = mmap(NULL, ac_mem_mapping_length(offset, size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return raw == MAP_FAILED ? NULL : raw;
+}
+
+// Gives back the memory of an entry, whichever way it was allocated
+static void ac_mem_entry_release(ac_mem_entry_t* entry) {
+    uint8_t* raw = (uint8_t*)entry - entry->offset;
+    if (entry->flags & AC_MEM_ENTRY_FLAG_MAPPED) {
+        munmap(raw, ac_mem_mapping_length(entry->offset, entry->size));
+    } else {
+        ac_free_func(raw);
+    }
+}
+
+// Reallocates the memory of an entry, keeping its alignment. Large blocks
+// grow with mremap, which moves pages instead of copying them, and a block
+// that crosses the large threshold is copied once into a mapping. Aligned
+// blocks have alignment - 1 bytes of slack, if the new memory isn't aligned
+// like the old one the header and data are moved within it.
+static ac_mem_entry_t* ac_mem_entry_resize(ac_mem_entry_t* entry, size_t size) {
+    size_t old_offset = entry->offset;
+    if (entry->flags & AC_MEM_ENTRY_FLAG_MAPPED) {
+        uint8_t* raw = mremap((uint8_t*)entry - old_offset, ac_mem_mapping_length(old_offset, entry->size),
+                              ac_mem_mapping_length(old_offset, size), MREMAP_MAYMOVE);
+        return raw == MAP_FAILED ? NULL : (ac_mem_entry_t*)(raw + old_offset);
+    }
+    if (ac_mem_is_large(size)) {
+        size_t offset = entry->alignment == 0 ? 0 : ac_mem_align_offset(NULL, entry->alignment);
+        uint8_t* raw = ac_mem_map(offset, size);
+        if (raw == NULL) {
+            return NULL;
+        }
+        memcpy(raw + offset, entry, sizeof(ac_mem_entry_t) + (entry->size < size ? entry->size : size));
+        ac_free_func((uint8_t*)entry - old_offset);
+        entry = (ac_mem_entry_t*)(raw + offset);
+        entry->offset = (uint16_t)offset;
+        entry->flags |= AC_MEM_ENTRY_FLAG_MAPPED;
+        return entry;
+    }
+    if (entry->alignment == 0) {
+        return ac_realloc_func(entry, sizeof(ac_mem_entry_t) + size);
+    }
+    size_t alignment = entry->alignment;
+    size_t kept = entry->size < size ? entry->size : size;
+    uint8_t* raw = ac_realloc_func((uint8_t*)entry - old_offset, alignment - 1 + sizeof(ac_mem_entry_t) + size);
+    if (raw == NULL) {
+        return NULL;
+    }
+    size_t offset = ac_mem_align_offset(raw, alignment);
+    if (offset != old_offset) {
+        memmove(raw + offset, raw + old_offset, sizeof(ac_mem_entry_t) + kept);
+    }
+    entry = (ac_mem_entry_t*)(raw + offset);
+    entry->offset = (uint16_t)offset;
+    return entry;
+}
+
+// Untracked aligned blocks keep the start of their allocation and their size
+// right before the data, ac_free can't tell them apart from other blocks.
+typedef struct ac_mem_aligned_prefix_t {
+    void* raw;
+    size_t size;
+} ac_mem_aligned_prefix_t;
+
+static bool ac_mem_alignment_check(size_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > AC_MEM_MAX_ALIGNMENT) {
+        ac_log_error("Invalid alignment %zu, must be a power of two up to %d\n", alignment, AC_MEM_MAX_ALIGNMENT);
+        return false;
+    }
+    return true;
+}
+
+static void* ac_mem_untracked_aligned(void* old, size_t size, size_t alignment) {
+    if (alignment < sizeof(ac_mem_aligned_prefix_t)) {
+        alignment = sizeof(ac_mem_aligned_prefix_t);
+    }
+    uint8_t* raw = ac_malloc_func(sizeof(ac_mem_aligned_prefix_t) + alignment - 1 + size);
+    if (raw == NULL) {
+        return NULL;
+    }
+    uintptr_t data = ((uintptr_t)raw + sizeof(ac_mem_aligned_prefix_t) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ac_mem_aligned_prefix_t* prefix = (ac_mem_aligned_prefix_t*)data - 1;
+    prefix->raw = raw;
+    prefix->size = size;
+    if (old != NULL) {
+        ac_mem_aligned_prefix_t* old_prefix = (ac_mem_aligned_prefix_t*)old - 1;
+        memcpy((void*)data, old, old_prefix->size < size ? old_prefix->size : size);
+        ac_free_func(old_prefix->raw);
+    }
+    return (void*)data;
+}
+
+void* ac_malloc_aligned(size_t size, size_t alignment, ac_mem_entry_type_t type) {
+    if (!ac_mem_alignment_check(alignment)) {
+        return NULL;
+    }
     if (!ac_mem_track) {
-        return ac_malloc_func(size);
+        return ac_mem_untracked_aligned(NULL, size, alignment);
+    }
+    if (size > SIZE_MAX - sizeof(ac_mem_entry_t) - AC_MEM_MAX_ALIGNMENT) {
+        return NULL;
+    }
+    type = ac_mem_type_scoped(type);
+    if (!ac_mem_type_check(type) || !ac_mem_budget_check(type, size)) {
+        return NULL;
     }
 
-    void* ptr = ac_malloc_func(size);
-    ac_mem_entry_t entry = {0};
-    entry.ptr = ptr;
-    entry.size = size;
-    entry.state = AC_MEM_ENTRY_STATE_ALLOCATED;
-    entry.type = type;
+    bool large = ac_mem_is_large(size);
+    uint8_t* raw = large ? ac_mem_map(ac_mem_align_offset(NULL, alignment), size)
+                         : ac_malloc_func(alignment - 1 + sizeof(ac_mem_entry_t) + size);
+    if (raw == NULL) {
+        return NULL;
+    }
+    size_t offset = ac_mem_align_offset(raw, alignment);
+    return ac_mem_entry_init((ac_mem_entry_t*)(raw + offset), size, type, offset, alignment, large ? AC_MEM_ENTRY_FLAG_MAPPED : 0);
+}
 
-    void* trace[ALLOC_TRACE_SIZE];
-    entry.alloc_trace_size = ac_get_intermediate_trace(trace, ALLOC_TRACE_SIZE);
-    entry.alloc_trace = ac_malloc_func(entry.alloc_trace_size * sizeof(void*));
-    memcpy(entry.alloc_trace, trace, entry.alloc_trace_size * sizeof(void*));
-    entry.free_trace = NULL;
-    entry.free_trace_size = 0;
-    entry.realloc_traces = NULL;
-    entry.realloc_traces_size = 0;
-    entry.realloc_traces_capacity = 0;
-    entry.realloc_trace_sizes = NULL;
-    entry.realloc_count = 0;
-    entry.realloc_trace_sizes_capacity = 0;
-
-    ac_mem_entry_t* sus_entry = ac_map_get(ac_mem_map, ptr);
-    if (sus_entry) {
-        if (sus_entry->state != AC_MEM_ENTRY_STATE_FREED) {
-            ac_log_fatal("Memory corruption detected\n");
-            ac_log_fatal("Allocated at:\n");
-            char buffer[1024];
-            ac_sprint_intermediate_trace(sus_entry->alloc_trace, buffer, 0, sus_entry->alloc_trace_size);
-            ac_log_fatal("%s\n", buffer);
-            ac_log_fatal("Current malloc at:\n");
-            ac_print_trace(2);
-            ac_log_fatal_exit("Exiting");
+void* ac_realloc_aligned(void* ptr, size_t size, size_t alignment, ac_mem_entry_type_t type) {
+    if (ptr == NULL) {
+        return ac_malloc_aligned(size, alignment, type);
+    }
+    if (!ac_mem_alignment_check(alignment)) {
+        return NULL;
+    }
+    if (!ac_mem_track) {
+        return ac_mem_untracked_aligned(ptr, size, alignment);
+    }
+    // The header knows the alignment of the block
+    return ac_realloc(ptr, size, type);
+}
+
+void ac_free_aligned(void* ptr) {
+    if (!ac_mem_track) {
+        if (ptr != NULL) {
+            ac_free_func(((ac_mem_aligned_prefix_t*)ptr - 1)->raw);
         }
-        ac_mem_entry_free(sus_entry);
+        return;
+    }
+    ac_free(ptr);
+}
+
+void* ac_malloc(size_t size, ac_mem_entry_type_t type) {
+    if (!ac_mem_track) {
+        return ac_malloc_func(size);
+    }
+    if (size > SIZE_MAX - sizeof(ac_mem_entry_t)) {
+        return NULL;
+    }
+    type = ac_mem_type_scoped(type);
+    if (!ac_mem_type_check(type) || !ac_mem_budget_check(type, size)) {
+        return NULL;
     }
 
-    ac_map_set(ac_mem_map, ptr, &entry);
-    ac_free_func(entry.alloc_trace);
-    return ptr;
+    bool large = ac_mem_is_large(size);
+    ac_mem_entry_t* entry = large ? ac_mem_map(0, size) : ac_malloc_func(sizeof(ac_mem_entry_t) + size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    return ac_mem_entry_init(entry, size, type, 0, 0, large ? AC_MEM_ENTRY_FLAG_MAPPED : 0);
 }
 
 void ac_free(void* ptr) {
     if (!ac_mem_track) {
         ac_free_func(ptr);
+        return;
     }
-
-    ac_mem_entry_t* entry = ac_map_get(ac_mem_map, ptr);
-    if (!entry) {
-        ac_log_info("Free trace: ");
-        ac_print_trace(2);
-        ac_log_fatal("Ptr: %p\n", ptr);
-        ac_log_fatal("Trying to free a ptr not in the records.. Entry not found... Exiting\n");
+    if (ptr == NULL) {
         return;
     }
-    if (entry->ptr == ptr) {
-        if (entry->state == AC_MEM_ENTRY_STATE_FREED) {
-            ac_log_fatal("Double free detected\n");
-            ac_log_fatal("Allocated at:\n");
-            char buffer[1024];
-            ac_sprint_intermediate_trace(entry->alloc_trace, buffer, 0, entry->alloc_trace_size);
-            ac_log_fatal("%s\n", buffer);
-            ac_log_fatal("Freed previously at :\n");
-            ac_sprint_intermediate_trace(entry->free_trace, buffer, 0, entry->free_trace_size);
-            ac_log_fatal("%s\n", buffer);
-            ac_log_fatal("Current free at:\n");
-            ac_print_trace(2);
-            return;
-        }
-        entry->state = AC_MEM_ENTRY_STATE_FREED;
-        void* trace[ALLOC_TRACE_SIZE];
-        entry->free_trace_size = ac_get_intermediate_trace(trace, ALLOC_TRACE_SIZE);
-        entry->free_trace = ac_malloc_func(entry->free_trace_size * sizeof(void*));
-        memcpy(entry->free_trace, trace, entry->free_trace_size * sizeof(void*));
-        ac_free_func(ptr);
-        ac_map_set(ac_mem_map, ptr, entry);
-        ac_mem_entry_free(entry);
+
+    ac_mem_entry_t* entry = ac_mem_entry_of(ptr);
+    if (!ac_mem_entry_check(ptr, entry, "free")) {
         return;
     }
-    ac_log_fatal("Entry pointer mismatch... \n");
-    ac_log_fatal("Entry ptr: %p\n", entry->ptr);
-    ac_log_fatal("Free ptr: %p\n", ptr);
-    ac_log_fatal_exit("Exiting");
+    ac_mem_counters_free(entry->type, entry->size);
+    if (entry->flags & AC_MEM_ENTRY_FLAG_TRACED) {
+        ac_mem_thread_t* thread = entry->owner;
+        pthread_mutex_lock(&thread->lock);
+        ac_mem_entry_unlink(entry);
+        pthread_mutex_unlock(&thread->lock);
+    }
+    entry->state = AC_MEM_ENTRY_STATE_FREED;
+    entry->canary = AC_MEM_CANARY_FREED;
+    ac_mem_entry_release(entry);
 }
 
 void* ac_calloc(size_t nmemb, size_t size, ac_mem_entry_type_t type) {
     if (!ac_mem_track) {
-        return ac_calloc_func(size, nmemb);
+        return ac_calloc_func(nmemb, size);
     }
-
-    void* ptr = ac_calloc_func(nmemb, size);
-    ac_mem_entry_t entry = {0};
-    entry.ptr = ptr;
-    entry.size = size;
-    entry.state = AC_MEM_ENTRY_STATE_ALLOCATED;
-    entry.type = type;
-
-    void* trace[ALLOC_TRACE_SIZE];
-    entry.alloc_trace_size = ac_get_intermediate_trace(trace, ALLOC_TRACE_SIZE);
-    entry.alloc_trace = ac_malloc_func(entry.alloc_trace_size * sizeof(void*));
-    memcpy(entry.alloc_trace, trace, entry.alloc_trace_size * sizeof(void*));
-    entry.free_trace = NULL;
-    entry.free_trace_size = 0;
-    entry.realloc_traces = NULL;
-    entry.realloc_traces_size = 0;
-    entry.realloc_traces_capacity = 0;
-    entry.realloc_trace_sizes = NULL;
-    entry.realloc_count = 0;
-    entry.realloc_trace_sizes_capacity = 0;
-
-    ac_mem_entry_t* sus_entry = ac_map_get(ac_mem_map, ptr);
-    if (sus_entry) {
-        if (sus_entry->state != AC_MEM_ENTRY_STATE_FREED) {
-            ac_log_fatal("Memory corruption detected\n");
-            ac_log_fatal("Allocated at:\n");
-            char buffer[1024];
-            ac_sprint_intermediate_trace(sus_entry->alloc_trace, buffer, 0, sus_entry->alloc_trace_size);
-            ac_log_fatal("%s\n", buffer);
-            ac_log_fatal("Current calloc at:\n");
-            ac_print_trace(2);
-            ac_log_fatal_exit("Exiting");
-        }
-        ac_mem_entry_free(sus_entry);
+    if (size != 0 && nmemb > (SIZE_MAX - sizeof(ac_mem_entry_t)) / size) {
+        return NULL;
+    }
+    type = ac_mem_type_scoped(type);
+    if (!ac_mem_type_check(type) || !ac_mem_budget_check(type, nmemb * size)) {
+        return NULL;
     }
 
-    ac_map_set(ac_mem_map, ptr, &entry);
-    ac_free_func(entry.alloc_trace);
-    return entry.ptr;
+    // Fresh mappings are zeroed already
+    bool large = ac_mem_is_large(nmemb * size);
+    ac_mem_entry_t* entry = large ? ac_mem_map(0, nmemb * size) : ac_calloc_func(1, sizeof(ac_mem_entry_t) + nmemb * size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    return ac_mem_entry_init(entry, nmemb * size, type, 0, 0, large ? AC_MEM_ENTRY_FLAG_MAPPED : 0);
 }
 
 void* ac_realloc(void* ptr, size_t size, ac_mem_entry_type_t type) {
@@ -312,116 +654,226 @@ void* ac_realloc(void* ptr, size_t size, ac_mem_entry_type_t type) {
     if (ptr == NULL) {
         return ac_malloc(size, type);
     }
+    if (size > SIZE_MAX - sizeof(ac_mem_entry_t) - AC_MEM_MAX_ALIGNMENT) {
+        return NULL;
+    }
 
-    ac_mem_entry_t* entry = NULL;
-    entry = ac_map_get(ac_mem_map, ptr);
-
-    if (!entry) {
+    ac_mem_entry_t* entry = ac_mem_entry_of(ptr);
+    if (!ac_mem_entry_check(ptr, entry, "realloc")) {
         ac_log_warn("Trying to realloc a ptr not in the records... Returning NULL");
-        ac_log_info("Reallocation trace: ");
-        ac_print_trace(2);
         return NULL;
     }
 
-    if (entry->ptr == ptr) {
-        entry->state = AC_MEM_ENTRY_STATE_REALLOCATED;
-        void* realloc_trace[ALLOC_TRACE_SIZE];
-        int32_t realloc_trace_size = ac_get_intermediate_trace(realloc_trace, ALLOC_TRACE_SIZE);
-        if (entry->realloc_traces_capacity < realloc_trace_size + entry->realloc_traces_size) {
-            entry->realloc_traces_capacity = (realloc_trace_size + entry->realloc_traces_size) * 2;
-            void** new_realloc_traces = ac_realloc_func(entry->realloc_traces, entry->realloc_traces_capacity * sizeof(void*));
-            if (new_realloc_traces) {
-                entry->realloc_traces = new_realloc_traces;
-            } else {
-                ac_log_fatal("Realloc failed\n");
-                ac_log_fatal_exit("Exiting");
-            }
+    // Only calls back when the budget refuses the growth, nothing is resized then
+    if (size > entry->size && !ac_mem_budget_check(entry->type, size - entry->size)) {
+        return NULL;
+    }
+
+    ac_mem_thread_t* current = ac_mem_thread_get();
+    ac_mem_entry_type_t entry_type = entry->type;
+    size_t old_size = entry->size;
+
+    // Like tcmalloc, a reallocation is sampled as a fresh allocation of the
+    // new size. Blocks traced because sampling was off stay traced.
+    bool was_traced = entry->flags & AC_MEM_ENTRY_FLAG_TRACED;
+    uint32_t flags = entry->flags & (AC_MEM_ENTRY_FLAG_TRACED | AC_MEM_ENTRY_FLAG_SAMPLED);
+    if (!(flags & AC_MEM_ENTRY_FLAG_TRACED) || (flags & AC_MEM_ENTRY_FLAG_SAMPLED)) {
+        size_t interval = atomic_load_explicit(&ac_mem_sample_interval, memory_order_relaxed);
+        bool sampled = interval != 0 && ac_mem_thread_sample(current, size, interval);
+        flags = sampled ? AC_MEM_ENTRY_FLAG_TRACED | AC_MEM_ENTRY_FLAG_SAMPLED : 0;
+    }
+    ac_trace_id_t realloc_trace = AC_TRACE_ID_NONE;
+    if (flags & AC_MEM_ENTRY_FLAG_TRACED) {
+        realloc_trace = ac_mem_capture_trace();
+    }
+
+    // The neighbours keep pointing at the old header while the block moves,
+    // the lock keeps anyone from following them until they're patched.
+    ac_mem_thread_t* thread = was_traced ? entry->owner : current;
+    bool locked = was_traced || (flags & AC_MEM_ENTRY_FLAG_TRACED);
+    if (locked) {
+        pthread_mutex_lock(&thread->lock);
+    }
+    ac_mem_entry_t* new_entry = ac_mem_entry_resize(entry, size);
+    if (new_entry == NULL) {
+        if (locked) {
+            pthread_mutex_unlock(&thread->lock);
         }
-        if (entry->realloc_count == entry->realloc_trace_sizes_capacity) {
-            entry->realloc_trace_sizes_capacity =
-                entry->realloc_trace_sizes_capacity == 0 ? 1 : entry->realloc_trace_sizes_capacity * 2;
-            int32_t* new_realloc_trace_sizes =
-                ac_realloc_func(entry->realloc_trace_sizes, entry->realloc_trace_sizes_capacity * sizeof(int32_t));
-            if (new_realloc_trace_sizes) {
-                entry->realloc_trace_sizes = new_realloc_trace_sizes;
-            } else {
-                ac_log_fatal("Realloc failed\n");
-                ac_log_fatal_exit("Exiting");
-            }
+        return NULL;
+    }
+    if (was_traced) {
+        new_entry->prev->next = new_entry;
+        new_entry->next->prev = new_entry;
+        if (!(flags & AC_MEM_ENTRY_FLAG_TRACED)) {
+            ac_mem_entry_unlink(new_entry);
         }
-        entry->realloc_trace_sizes[entry->realloc_count] = realloc_trace_size;
-        memcpy(entry->realloc_traces + entry->realloc_traces_size, realloc_trace, realloc_trace_size * sizeof(void*));
-        entry->realloc_traces_size += realloc_trace_size;
-        entry->realloc_count++;
-        void* new_ptr = ac_realloc_func(ptr, size);
-
-        ac_mem_entry_t* sus_entry = ac_map_get(ac_mem_map, new_ptr);
-        if (sus_entry) {
-            if (sus_entry->state != AC_MEM_ENTRY_STATE_FREED) {
-                ac_log_fatal("Memory corruption detected\n");
-                ac_log_fatal("Allocated at:\n");
-                char buffer[1024];
-                ac_sprint_intermediate_trace(sus_entry->alloc_trace, buffer, 0, sus_entry->alloc_trace_size);
-                ac_log_fatal("%s\n", buffer);
-                ac_log_fatal("Current realloc at:\n");
-                ac_print_trace(2);
-                ac_log_fatal_exit("Exiting");
-            }
-            ac_mem_entry_free(sus_entry);
+    }
+    new_entry->size = size;
+    new_entry->state = AC_MEM_ENTRY_STATE_REALLOCATED;
+    new_entry->realloc_count++;
+    new_entry->flags = (new_entry->flags & AC_MEM_ENTRY_FLAG_MAPPED) | flags;
+    if (flags & AC_MEM_ENTRY_FLAG_TRACED) {
+        if (new_entry->alloc_trace == AC_TRACE_ID_NONE) {
+            new_entry->alloc_trace = realloc_trace;
         }
-        entry->ptr = new_ptr;
-        ac_map_remove(ac_mem_map, ptr);
-        ac_map_set(ac_mem_map, new_ptr, entry);
-
-        ac_mem_entry_free(entry);
-
-        return new_ptr;
-    }
-    ac_log_warn("Trying to realloc a ptr not in the records... Returning NULL");
-    ac_log_info("Reallocation trace: ");
-    ac_print_trace(2);
-    return NULL;
-}
-
-void ac_mem_map_exit_iter_cb(const void* key, const void* value) {
-    (void)key;
-    ac_mem_entry_t* entry = (ac_mem_entry_t*)value;
-    if (entry->state == AC_MEM_ENTRY_STATE_ALLOCATED) {
-        ac_log_warn("----------------------------\n");
-        ac_log_warn("Memory leak detected\n");
-        ac_log_warn("Pointer: %p\n", entry->ptr);
-        ac_log_warn("Allocated at:\n");
-        char buffer[1024];
-        ac_sprint_intermediate_trace(entry->alloc_trace, buffer, 0, entry->alloc_trace_size);
-        ac_log_warn("\n---\n%s\n---\n", buffer);
-        ac_log_warn("Not freed\n");
-        ac_log_warn("----------------------------\n");
-    } else if (entry->state == AC_MEM_ENTRY_STATE_REALLOCATED) {
-        ac_log_warn("----------------------------\n");
-        ac_log_warn("Memory leak detected\n");
-        ac_log_warn("Pointer: %p\n", entry->ptr);
-        ac_log_warn("Allocated at:\n");
-        char buffer[1024];
-        ac_sprint_intermediate_trace(entry->alloc_trace, buffer, 0, entry->alloc_trace_size);
-        ac_log_warn("\n---\n%s\n---\n", buffer);
-        int32_t trace_offset = 0;
-        for (int32_t j = 0; j < entry->realloc_count; j++) {
-            ac_log_warn("Reallocated at:\n");
-            ac_sprint_intermediate_trace(entry->realloc_traces + trace_offset, buffer, 0, entry->realloc_trace_sizes[j]);
-            ac_log_warn("\n---\n%s\n---\n", buffer);
-            trace_offset += entry->realloc_trace_sizes[j];
+        new_entry->realloc_trace = realloc_trace;
+        if (!was_traced) {
+            ac_mem_entry_link(thread, new_entry);
         }
+    }
+    if (locked) {
+        pthread_mutex_unlock(&thread->lock);
+    }
+    // Counted once the block has its new size, a failed resize leaves it as it
+    // was and notifies nobody
+    ac_mem_counters_realloc(entry_type, old_size, size);
+    return ac_mem_entry_data(new_entry);
+}
+
+static void ac_mem_report_leak(ac_mem_entry_t* entry) {
+    ac_log_warn("----------------------------\n");
+    ac_log_warn("Memory leak detected\n");
+    ac_log_warn("Pointer: %p\n", ac_mem_entry_data(entry));
+    ac_log_warn("Size: %zu\n", entry->size);
+    if (entry->flags & AC_MEM_ENTRY_FLAG_SAMPLED) {
+        ac_log_warn("Sampled, stands for about %.0f bytes\n", ac_mem_entry_weight(entry, atomic_load(&ac_mem_sample_interval)));
+    }
+    ac_log_warn("Allocated at:\n");
+    char buffer[AC_TRACE_BUFFER_SIZE];
+    ac_sprint_trace_id(entry->alloc_trace, buffer, 0);
+    ac_log_warn("\n---\n%s\n---\n", buffer);
+    if (entry->state == AC_MEM_ENTRY_STATE_REALLOCATED) {
+        ac_log_warn("Last reallocated at (%d reallocations):\n", entry->realloc_count);
+        ac_sprint_trace_id(entry->realloc_trace, buffer, 0);
+        ac_log_warn("\n---\n%s\n---\n", buffer);
         ac_log_warn("Reallocated but not freed\n");
-        ac_log_warn("----------------------------\n");
+    } else {
+        ac_log_warn("Not freed\n");
     }
+    ac_log_warn("----------------------------\n");
 }
 
 void ac_mem_exit(void) {
+    ac_pool_ds_shutdown();
     if (!ac_mem_track) {
         return;
     }
-    ac_map_iter(ac_mem_map, ac_mem_map_exit_iter_cb);
-    ac_map_destroy(ac_mem_map);
+    pthread_mutex_lock(&ac_mem_threads_lock);
+    for (ac_mem_thread_t* thread = ac_mem_threads; thread != NULL; thread = thread->next) {
+        pthread_mutex_lock(&thread->lock);
+        for (ac_mem_entry_t* entry = thread->live.next; entry != &thread->live; entry = entry->next) {
+            ac_mem_report_leak(entry);
+        }
+        pthread_mutex_unlock(&thread->lock);
+    }
+    pthread_mutex_unlock(&ac_mem_threads_lock);
+}
+
+// Writes the file backed executable mappings, the only ones addresses can be
+// symbolized against once the process is gone.
+static uint32_t ac_mem_snapshot_write_modules(FILE* fp) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        ac_log_warn("Failed to open /proc/self/maps, the snapshot has no modules\n");
+        return 0;
+    }
+    uint32_t count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        unsigned long long start, end, offset;
+        char perms[8];
+        int path_start = 0;
+        if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &path_start) < 4 || path_start == 0 ||
+            perms[2] != 'x' || line[path_start] != '/') {
+            continue;
+        }
+        const char* path = line + path_start;
+        ac_mem_snapshot_module_t module = {
+            .start = start,
+            .end = end,
+            .file_offset = offset,
+            .path_len = (uint32_t)strcspn(path, "\n"),
+        };
+        fwrite(&module, sizeof(module), 1, fp);
+        fwrite(path, 1, module.path_len, fp);
+        count++;
+    }
+    fclose(maps);
+    return count;
+}
+
+static uint32_t ac_mem_snapshot_write_traces(FILE* fp) {
+    uint32_t count = (uint32_t)ac_trace_table_count();
+    for (uint32_t id = 1; id <= count; id++) {
+        int size = 0;
+        void** frames = ac_trace_get(id, &size);
+        ac_mem_snapshot_trace_t trace = {.id = id, .frame_count = (uint32_t)size};
+        fwrite(&trace, sizeof(trace), 1, fp);
+        for (int i = 0; i < size; i++) {
+            uint64_t address = (uint64_t)(uintptr_t)frames[i];
+            fwrite(&address, sizeof(address), 1, fp);
+        }
+    }
+    return count;
+}
+
+static uint64_t ac_mem_snapshot_write_blocks(FILE* fp) {
+    uint64_t count = 0;
+    ac_mem_snapshot_block_t blocks[256];
+    size_t pending = 0;
+    pthread_mutex_lock(&ac_mem_threads_lock);
+    for (ac_mem_thread_t* thread = ac_mem_threads; thread != NULL; thread = thread->next) {
+        pthread_mutex_lock(&thread->lock);
+        for (ac_mem_entry_t* entry = thread->live.next; entry != &thread->live; entry = entry->next) {
+            blocks[pending++] = (ac_mem_snapshot_block_t){
+                .size = entry->size,
+                .alloc_trace = entry->alloc_trace,
+                .realloc_trace = entry->realloc_trace,
+                .type = entry->type,
+                .flags = entry->flags,
+            };
+            if (pending == sizeof(blocks) / sizeof(blocks[0])) {
+                fwrite(blocks, sizeof(blocks[0]), pending, fp);
+                count += pending;
+                pending = 0;
+            }
+        }
+        pthread_mutex_unlock(&thread->lock);
+    }
+    pthread_mutex_unlock(&ac_mem_threads_lock);
+    fwrite(blocks, sizeof(blocks[0]), pending, fp);
+    return count + pending;
+}
+
+bool ac_mem_write_snapshot(const char* path) {
+    if (!ac_mem_track) {
+        ac_log_warn("Memory tracking is disabled, no snapshot written\n");
+        return false;
+    }
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s for the heap snapshot\n", path);
+        return false;
+    }
+    // Traces after blocks, so every trace a block refers to is already interned.
+    ac_mem_snapshot_header_t header = {
+        .magic = AC_MEM_SNAPSHOT_MAGIC,
+        .version = AC_MEM_SNAPSHOT_VERSION,
+        .sample_interval = atomic_load_explicit(&ac_mem_sample_interval, memory_order_relaxed),
+    };
+    fwrite(&header, sizeof(header), 1, fp);
+    header.module_count = ac_mem_snapshot_write_modules(fp);
+    header.block_count = ac_mem_snapshot_write_blocks(fp);
+    header.trace_count = ac_mem_snapshot_write_traces(fp);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    if (ferror(fp) | fclose(fp)) {
+        ac_log_error("Failed to write the heap snapshot %s\n", path);
+        return false;
+    }
+    ac_log_info("Heap snapshot written to %s: %llu blocks, %u traces\n", path, (unsigned long long)header.block_count,
+                header.trace_count);
+    return true;
 }
 
 void ac_memcpy(void* dest, const void* src, size_t n) { memcpy(dest, src, n); }
@@ -432,7 +884,7 @@ void ac_memset(void* s, int c, size_t n) { memset(s, c, n); }
 
 void ac_memzero(void* s, size_t n) { memset(s, 0, n); }
 
-static const char* mem_entry_type_str(ac_mem_entry_type_t type) {
+const char* ac_mem_entry_type_str(ac_mem_entry_type_t type) {
     switch (type) {
         case AC_MEM_ENTRY_CORE:
             return "AC_MEM_ENTRY_CORE";
@@ -451,27 +903,100 @@ static const char* mem_entry_type_str(ac_mem_entry_type_t type) {
     }
 }
 
-static size_t mem_entry_sizes[AC_MEM_ENTRY_COUNT] = {0};
-
-void ac_mem_map_count_iter_cb(const void* key, const void* value) {
-    (void)key;
-    ac_mem_entry_t* entry = (ac_mem_entry_t*)value;
-    if (entry->state == AC_MEM_ENTRY_STATE_FREED) {
+void ac_mem_get_stats(ac_mem_entry_type_t type, ac_mem_stats_t* stats) {
+    if (!ac_mem_type_check(type)) {
+        memset(stats, 0, sizeof(*stats));
         return;
     }
-    mem_entry_sizes[entry->type] += entry->size;
+    ac_mem_counters_t* counters = &ac_mem_counters[type];
+    stats->live_bytes = atomic_load_explicit(&counters->live_bytes, memory_order_relaxed);
+    stats->peak_bytes = atomic_load_explicit(&counters->peak_bytes, memory_order_relaxed);
+    stats->alloc_count = atomic_load_explicit(&counters->alloc_count, memory_order_relaxed);
+    stats->alloc_bytes = atomic_load_explicit(&counters->alloc_bytes, memory_order_relaxed);
+    stats->free_count = atomic_load_explicit(&counters->free_count, memory_order_relaxed);
+    stats->free_bytes = atomic_load_explicit(&counters->free_bytes, memory_order_relaxed);
+}
+
+void ac_mem_frame_end(void) {
+    pthread_mutex_lock(&ac_mem_frames_lock);
+    ac_mem_frame_stats_t* frame = &ac_mem_frames[ac_mem_frame_count % AC_MEM_FRAME_HISTORY];
+    frame->frame = ac_mem_frame_count;
+    for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
+        ac_mem_stats_t now;
+        ac_mem_get_stats(i, &now);
+        ac_mem_stats_t* last = &ac_mem_frame_last[i];
+        ac_mem_stats_t* stats = &frame->types[i];
+        stats->live_bytes = now.live_bytes;
+        stats->peak_bytes = atomic_exchange_explicit(&ac_mem_counters[i].frame_peak_bytes, now.live_bytes, memory_order_relaxed);
+        if (stats->peak_bytes < now.live_bytes) {
+            stats->peak_bytes = now.live_bytes;
+        }
+        stats->alloc_count = now.alloc_count - last->alloc_count;
+        stats->alloc_bytes = now.alloc_bytes - last->alloc_bytes;
+        stats->free_count = now.free_count - last->free_count;
+        stats->free_bytes = now.free_bytes - last->free_bytes;
+        *last = now;
+    }
+    ac_mem_frame_count++;
+    pthread_mutex_unlock(&ac_mem_frames_lock);
+}
+
+bool ac_mem_get_frame_stats(size_t frames_ago, ac_mem_frame_stats_t* stats) {
+    pthread_mutex_lock(&ac_mem_frames_lock);
+    if (frames_ago >= AC_MEM_FRAME_HISTORY || frames_ago >= ac_mem_frame_count) {
+        pthread_mutex_unlock(&ac_mem_frames_lock);
+        return false;
+    }
+    *stats = ac_mem_frames[(ac_mem_frame_count - 1 - frames_ago) % AC_MEM_FRAME_HISTORY];
+    pthread_mutex_unlock(&ac_mem_frames_lock);
+    return true;
 }
 
 void ac_mem_show_usage(void) {
-    memset(mem_entry_sizes, 0, sizeof(mem_entry_sizes));
+    size_t interval = atomic_load_explicit(&ac_mem_sample_interval, memory_order_relaxed);
+    double mem_entry_estimates[AC_MEM_ENTRY_COUNT] = {0};
+    double estimate = 0;
+    size_t traced_count = 0;
+    size_t thread_count = 0;
+    pthread_mutex_lock(&ac_mem_threads_lock);
+    for (ac_mem_thread_t* thread = ac_mem_threads; thread != NULL; thread = thread->next) {
+        pthread_mutex_lock(&thread->lock);
+        for (ac_mem_entry_t* entry = thread->live.next; entry != &thread->live; entry = entry->next) {
+            double weight = ac_mem_entry_weight(entry, interval);
+            mem_entry_estimates[entry->type] += weight;
+            estimate += weight;
+        }
+        traced_count += thread->live_count;
+        pthread_mutex_unlock(&thread->lock);
+        thread_count++;
+    }
+    pthread_mutex_unlock(&ac_mem_threads_lock);
+
+    ac_mem_stats_t stats[AC_MEM_ENTRY_COUNT];
+    ac_mem_stats_t total = {0};
+    for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
+        ac_mem_get_stats(i, &stats[i]);
+        total.live_bytes += stats[i].live_bytes;
+        total.alloc_count += stats[i].alloc_count;
+        total.free_count += stats[i].free_count;
+    }
+    size_t live_count = total.alloc_count - total.free_count;
     ac_log_info("Memory usage:\n");
-    ac_log_info("Memory map size: %zu\n", ac_map_size(ac_mem_map));
-    ac_log_info("Memory map capacity: %zu\n", ac_map_capacity(ac_mem_map));
-    ac_log_info("Memory map load factor: %f\n", (float)ac_mem_map->size / (float)ac_mem_map->capacity);
-    ac_map_iter(ac_mem_map, ac_mem_map_count_iter_cb);
+    ac_log_info("Tracking threads: %zu\n", thread_count);
+    ac_log_info("Sample interval: %zu\n", interval);
+    ac_log_info("Live blocks: %zu (%zu traced)\n", live_count, traced_count);
+    ac_log_info("Live bytes: %zu (estimated from traces: %.0f)\n", total.live_bytes, estimate);
+    ac_log_info("Allocations: %zu, frees: %zu\n", total.alloc_count, total.free_count);
+    ac_log_info("Header overhead: %zu\n", live_count * sizeof(ac_mem_entry_t));
+    ac_log_info("Interned traces: %zu (%zu bytes)\n", ac_trace_table_count(), ac_trace_table_bytes());
     for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
-        ac_log_info("Memory entry type: %s\n", mem_entry_type_str(i));
-        ac_log_info("Size: %zu\n", mem_entry_sizes[i]);
+        ac_log_info("Memory entry type: %s\n", ac_mem_entry_type_str(i));
+        ac_log_info("Size: %zu (peak %zu, estimated from traces: %.0f)\n", stats[i].live_bytes, stats[i].peak_bytes,
+                    mem_entry_estimates[i]);
+        ac_log_info("Allocations: %zu, frees: %zu\n", stats[i].alloc_count, stats[i].free_count);
     }
-    memset(mem_entry_sizes, 0, sizeof(mem_entry_sizes));
+    ac_arena_show_usage();
+    ac_pool_show_usage();
+    ac_vmem_show_usage();
+    ac_tcache_show_usage();
 }
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include "core/ac_perf.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "core/ac_log.h"
+
+// Performance counters
+// Every thread opens one group, led by the first counter that opens, and
+// reads all of it with one read. Zones register themselves in a list the
+// first time they end.
+
+#define AC_PERF_UNOPENED -2
+#define AC_PERF_UNAVAILABLE -1
+
+typedef struct ac_perf_group_t {
+    int fd;
+    uint32_t size;
+    // Position of each counter in the group, -1 when it didn't open
+    int8_t slots[AC_PERF_COUNTER_COUNT];
+    // Descriptor of each position, the leader first
+    int fds[AC_PERF_COUNTER_COUNT];
+} ac_perf_group_t;
+
+static const struct {
+    uint64_t config;
+    const char* name;
+} ac_perf_events[AC_PERF_COUNTER_COUNT] = {
+    [AC_PERF_CYCLES] = {PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [AC_PERF_INSTRUCTIONS] = {PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [AC_PERF_CACHE_MISSES] = {PERF_COUNT_HW_CACHE_MISSES, "cache misses"},
+    [AC_PERF_BRANCH_MISSES] = {PERF_COUNT_HW_BRANCH_MISSES, "branch misses"},
+};
+
+static _Thread_local ac_perf_group_t ac_perf_group = {.fd = AC_PERF_UNOPENED};
+static atomic_bool ac_perf_warned = false;
+static pthread_once_t ac_perf_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ac_perf_key;
+static pthread_mutex_t ac_perf_zones_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_perf_zone_t* ac_perf_zones = NULL;
+
+static int ac_perf_open_event(uint64_t config, int group_fd) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Descriptors belong to the process, those of an exiting thread are closed
+// here. Zones ending after that only count calls.
+static void ac_perf_thread_exit(void* value) {
+    ac_perf_group_t* group = value;
+    for (uint32_t i = group->size; i > 0; i--) {
+        close(group->fds[i - 1]);
+    }
+    group->fd = AC_PERF_UNAVAILABLE;
+    group->size = 0;
+}
+
+static void ac_perf_key_create(void) { pthread_key_create(&ac_perf_key, ac_perf_thread_exit); }
+
+static void ac_perf_open_group(ac_perf_group_t* group) {
+    group->fd = AC_PERF_UNAVAILABLE;
+    group->size = 0;
+    int error = 0;
+    for (uint32_t i = 0; i < AC_PERF_COUNTER_COUNT; i++) {
+        group->slots[i] = -1;
+        int fd = ac_perf_open_event(ac_perf_events[i].config, group->fd);
+        if (fd < 0) {
+            if (error == 0) {
+                error = errno;
+            }
+            continue;
+        }
+        if (group->fd < 0) {
+            group->fd = fd;
+        }
+        group->fds[group->size] = fd;
+        group->slots[i] = (int8_t)group->size++;
+    }
+    if (group->fd >= 0) {
+        pthread_once(&ac_perf_key_once, ac_perf_key_create);
+        pthread_setspecific(ac_perf_key, group);
+    }
+    if (group->fd < 0 && !atomic_exchange(&ac_perf_warned, true)) {
+        ac_log_warn("Performance counters unavailable (%s), perf zones only count calls. Check "
+                    "/proc/sys/kernel/perf_event_paranoid\n",
+                    strerror(error));
+    }
+}
+
+bool ac_perf_read(ac_perf_sample_t* sample) {
+    ac_perf_group_t* group = &ac_perf_group;
+    if (group->fd == AC_PERF_UNOPENED) {
+        ac_perf_open_group(group);
+    }
+    sample->valid = 0;
+    if (group->fd < 0) {
+        return false;
+    }
+    // nr, time enabled, time running, then one value per counter
+    uint64_t data[3 + AC_PERF_COUNTER_COUNT];
+    ssize_t size = read(group->fd, data, sizeof(data));
+    if (size < (ssize_t)(3 * sizeof(uint64_t))) {
+        return false;
+    }
+    sample->time_enabled = data[1];
+    sample->time_running = data[2];
+    for (uint32_t i = 0; i < AC_PERF_COUNTER_COUNT; i++) {
+        int slot = group->slots[i];
+        if (slot >= 0 && (uint64_t)slot < data[0]) {
+            sample->values[i] = data[3 + slot];
+            sample->valid |= 1u << i;
+        }
+    }
+    return sample->valid != 0;
+}
+
+ac_perf_scope_t ac_perf_scope_begin(ac_perf_zone_t* zone) {
+    ac_perf_scope_t scope = {.zone = zone};
+    ac_perf_read(&scope.start);
+    return scope;
+}
+
+void ac_perf_scope_end(ac_perf_scope_t* scope) {
+    ac_perf_sample_t end;
+    ac_perf_read(&end);
+    ac_perf_zone_t* zone = scope->zone;
+    atomic_fetch_add_explicit(&zone->calls, 1, memory_order_relaxed);
+
+    uint32_t valid = scope->start.valid & end.valid;
+    uint64_t enabled = end.time_enabled - scope->start.time_enabled;
+    uint64_t running = end.time_running - scope->start.time_running;
+    if (valid != 0 && running != 0) {
+        // Counters only count while scheduled on the PMU, extrapolate to the
+        // whole time when the kernel multiplexed them
+        double scale = running < enabled ? (double)enabled / (double)running : 1.0;
+        for (uint32_t i = 0; i < AC_PERF_COUNTER_COUNT; i++) {
+            if ((valid & (1u << i)) == 0) {
+                continue;
+            }
+            uint64_t delta = (uint64_t)((double)(end.values[i] - scope->start.values[i]) * scale);
+            atomic_fetch_add_explicit(&zone->totals[i], delta, memory_order_relaxed);
+            atomic_fetch_add_explicit(&zone->measured[i], 1, memory_order_relaxed);
+        }
+    }
+
+    if (!atomic_load_explicit(&zone->registered, memory_order_acquire)) {
+        pthread_mutex_lock(&ac_perf_zones_lock);
+        if (!atomic_load_explicit(&zone->registered, memory_order_relaxed)) {
+            zone->next = ac_perf_zones;
+            ac_perf_zones = zone;
+            atomic_store_explicit(&zone->registered, true, memory_order_release);
+        }
+        pthread_mutex_unlock(&ac_perf_zones_lock);
+    }
+}
+
+void ac_perf_zone_summary(ac_perf_zone_t* zone, ac_perf_summary_t* summary) {
+    *summary = (ac_perf_summary_t){0};
+    summary->calls = atomic_load_explicit(&zone->calls, memory_order_relaxed);
+    for (uint32_t i = 0; i < AC_PERF_COUNTER_COUNT; i++) {
+        uint64_t measured = atomic_load_explicit(&zone->measured[i], memory_order_relaxed);
+        if (measured == 0) {
+            continue;
+        }
+        summary->available[i] = true;
+        summary->per_call[i] = (double)atomic_load_explicit(&zone->totals[i], memory_order_relaxed) / (double)measured;
+    }
+    if (summary->per_call[AC_PERF_CYCLES] > 0.0) {
+        summary->ipc = summary->per_call[AC_PERF_INSTRUCTIONS] / summary->per_call[AC_PERF_CYCLES];
+    }
+}
+
+void ac_perf_log(void) {
+    pthread_mutex_lock(&ac_perf_zones_lock);
+    for (ac_perf_zone_t* zone = ac_perf_zones; zone != NULL; zone = zone->next) {
+        ac_perf_summary_t summary;
+        ac_perf_zone_summary(zone, &summary);
+        char counters[256];
+        size_t length = 0;
+        counters[0] = '\0';
+        if (summary.available[AC_PERF_CYCLES] && summary.available[AC_PERF_INSTRUCTIONS]) {
+            length += snprintf(counters + length, sizeof(counters) - length, "  IPC %.2f", summary.ipc);
+        }
+        for (uint32_t i = 0; i < AC_PERF_COUNTER_COUNT && length < sizeof(counters); i++) {
+            if (summary.available[i]) {
+                length += snprintf(counters + length, sizeof(counters) - length, "  %.1f %s", summary.per_call[i],
+                                   ac_perf_events[i].name);
+            }
+        }
+        ac_log_info("%-24s %10llu calls%s%s\n", zone->name, (unsigned long long)summary.calls, counters,
+                    length > 0 ? " per call" : "  (no counters)");
+    }
+    pthread_mutex_unlock(&ac_perf_zones_lock);
+}
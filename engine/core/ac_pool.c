@@ -0,0 +1,370 @@
+#include "core/ac_pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "core/ac_log.h"
+#include "core/ac_mem.h"
+
+#define AC_POOL_GRANULE 16
+#define AC_POOL_REFILL_COUNT (AC_POOL_MAGAZINE_SIZE / 2)
+
+typedef struct ac_pool_block_t {
+    struct ac_pool_block_t* next;
+} ac_pool_block_t;
+
+typedef struct ac_pool_slab_t {
+    struct ac_pool_slab_t* next;
+} ac_pool_slab_t;
+
+// Blocks start one granule into the slab, right after the slab link
+#define AC_POOL_SLAB_HEADER AC_POOL_GRANULE
+
+typedef struct ac_pool_class_t {
+    ac_pool_block_t* free_list;
+    unsigned char* bump;
+    unsigned char* bump_end;
+    ac_pool_stats_t stats;
+} ac_pool_class_t;
+
+struct ac_pool_t {
+    const char* name;
+    ac_mem_entry_type_t mem_type;
+    bool thread_cached;
+    uint32_t cache_slot;
+    uint32_t cache_generation;
+    pthread_mutex_t lock;
+    ac_pool_slab_t* slabs;
+    ac_pool_class_t classes[AC_POOL_CLASS_COUNT];
+    struct ac_pool_t* next;
+};
+
+typedef struct ac_pool_magazine_t {
+    uint32_t generation;
+    uint32_t count;
+    void* blocks[AC_POOL_MAGAZINE_SIZE];
+} ac_pool_magazine_t;
+
+// The magazines of a thread, linked in ac_pool_threads from its first use of
+// a thread cached pool until it exits
+typedef struct ac_pool_thread_t {
+    ac_pool_magazine_t magazines[AC_POOL_MAX_CACHED_POOLS][AC_POOL_CLASS_COUNT];
+    bool registered;
+    struct ac_pool_thread_t* prev;
+    struct ac_pool_thread_t* next;
+} ac_pool_thread_t;
+
+static const size_t ac_pool_class_sizes[AC_POOL_CLASS_COUNT] = {16, 32, 48, 64, 96, 128, 192, 256};
+
+// Size class of a request, indexed by the request size in granules
+static const uint8_t ac_pool_class_lookup[AC_POOL_MAX_SIZE / AC_POOL_GRANULE + 1] = {0, 0, 1, 2, 3, 4, 4, 5, 5,
+                                                                                     6, 6, 6, 6, 7, 7, 7, 7};
+
+static pthread_mutex_t ac_pool_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_pool_t* ac_pool_list = NULL;
+static ac_pool_t* ac_pool_cache_slots[AC_POOL_MAX_CACHED_POOLS];
+static uint32_t ac_pool_cache_generation = 0;
+
+static pthread_once_t ac_pool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ac_pool_thread_key;
+static _Thread_local ac_pool_thread_t ac_pool_thread;
+static ac_pool_thread_t* ac_pool_threads = NULL;
+
+static _Atomic(ac_pool_t*) ac_pool_ds_instance = NULL;
+
+static inline size_t ac_pool_class_of(size_t size) {
+    return ac_pool_class_lookup[(size + AC_POOL_GRANULE - 1) / AC_POOL_GRANULE];
+}
+
+// Central free list. Called with the pool lock held for thread cached pools.
+static void* ac_pool_central_alloc(ac_pool_t* pool, size_t class_index) {
+    ac_pool_class_t* cls = &pool->classes[class_index];
+    void* block;
+    if (cls->free_list != NULL) {
+        block = cls->free_list;
+        cls->free_list = cls->free_list->next;
+    } else {
+        size_t block_size = ac_pool_class_sizes[class_index];
+        if (cls->bump == NULL || cls->bump + block_size > cls->bump_end) {
+            ac_pool_slab_t* slab = ac_malloc(AC_POOL_SLAB_SIZE, pool->mem_type);
+            if (slab == NULL) {
+                return NULL;
+            }
+            slab->next = pool->slabs;
+            pool->slabs = slab;
+            cls->bump = (unsigned char*)slab + AC_POOL_SLAB_HEADER;
+            cls->bump_end = (unsigned char*)slab + AC_POOL_SLAB_SIZE;
+            cls->stats.slab_count++;
+        }
+        block = cls->bump;
+        cls->bump += block_size;
+    }
+    cls->stats.alloc_count++;
+    cls->stats.live++;
+    if (cls->stats.live > cls->stats.peak_live) {
+        cls->stats.peak_live = cls->stats.live;
+    }
+    return block;
+}
+
+static void ac_pool_central_free(ac_pool_t* pool, size_t class_index, void* ptr) {
+    ac_pool_class_t* cls = &pool->classes[class_index];
+    ac_pool_block_t* block = ptr;
+    block->next = cls->free_list;
+    cls->free_list = block;
+    cls->stats.free_count++;
+    cls->stats.live--;
+}
+
+// Hands the magazines of a thread back to their pools, those of every pool
+// when only is NULL. Called with the registry lock held.
+static void ac_pool_thread_drain(ac_pool_thread_t* thread, ac_pool_t* only) {
+    for (size_t slot = 0; slot < AC_POOL_MAX_CACHED_POOLS; slot++) {
+        ac_pool_t* pool = ac_pool_cache_slots[slot];
+        if (pool == NULL || (only != NULL && pool != only)) {
+            continue;
+        }
+        for (size_t i = 0; i < AC_POOL_CLASS_COUNT; i++) {
+            ac_pool_magazine_t* magazine = &thread->magazines[slot][i];
+            if (magazine->generation == pool->cache_generation && magazine->count != 0) {
+                pthread_mutex_lock(&pool->lock);
+                while (magazine->count != 0) {
+                    ac_pool_central_free(pool, i, magazine->blocks[--magazine->count]);
+                }
+                pthread_mutex_unlock(&pool->lock);
+            }
+        }
+    }
+}
+
+static void ac_pool_thread_exit(void* value) {
+    (void)value;
+    pthread_mutex_lock(&ac_pool_registry_lock);
+    ac_pool_thread_drain(&ac_pool_thread, NULL);
+    if (ac_pool_thread.registered) {
+        if (ac_pool_thread.prev != NULL) {
+            ac_pool_thread.prev->next = ac_pool_thread.next;
+        } else {
+            ac_pool_threads = ac_pool_thread.next;
+        }
+        if (ac_pool_thread.next != NULL) {
+            ac_pool_thread.next->prev = ac_pool_thread.prev;
+        }
+        ac_pool_thread.registered = false;
+    }
+    pthread_mutex_unlock(&ac_pool_registry_lock);
+}
+
+static void ac_pool_key_init(void) { pthread_key_create(&ac_pool_thread_key, ac_pool_thread_exit); }
+
+static ac_pool_magazine_t* ac_pool_magazine(ac_pool_t* pool, size_t class_index) {
+    ac_pool_magazine_t* magazine = &ac_pool_thread.magazines[pool->cache_slot][class_index];
+    if (magazine->generation != pool->cache_generation) {
+        // Left over from a destroyed pool that used the same slot, its blocks are gone
+        magazine->generation = pool->cache_generation;
+        magazine->count = 0;
+        if (!ac_pool_thread.registered) {
+            pthread_mutex_lock(&ac_pool_registry_lock);
+            ac_pool_thread.prev = NULL;
+            ac_pool_thread.next = ac_pool_threads;
+            if (ac_pool_threads != NULL) {
+                ac_pool_threads->prev = &ac_pool_thread;
+            }
+            ac_pool_threads = &ac_pool_thread;
+            ac_pool_thread.registered = true;
+            pthread_mutex_unlock(&ac_pool_registry_lock);
+        }
+        pthread_setspecific(ac_pool_thread_key, pool);
+    }
+    return magazine;
+}
+
+ac_pool_t* ac_pool_create(const char* name, bool thread_cached, ac_mem_entry_type_t mem_type) {
+    ac_pool_t* pool = ac_calloc(1, sizeof(ac_pool_t), mem_type);
+    pool->name = name;
+    pool->mem_type = mem_type;
+    pool->thread_cached = thread_cached;
+    for (size_t i = 0; i < AC_POOL_CLASS_COUNT; i++) {
+        pool->classes[i].stats.block_size = ac_pool_class_sizes[i];
+    }
+
+    if (thread_cached) {
+        pthread_once(&ac_pool_key_once, ac_pool_key_init);
+        pthread_mutex_init(&pool->lock, NULL);
+    }
+
+    pthread_mutex_lock(&ac_pool_registry_lock);
+    if (thread_cached) {
+        size_t slot = 0;
+        while (slot < AC_POOL_MAX_CACHED_POOLS && ac_pool_cache_slots[slot] != NULL) {
+            slot++;
+        }
+        if (slot == AC_POOL_MAX_CACHED_POOLS) {
+            pthread_mutex_unlock(&ac_pool_registry_lock);
+            ac_log_error("Pool %s: no thread cache slot left\n", name);
+            pthread_mutex_destroy(&pool->lock);
+            ac_free(pool);
+            return NULL;
+        }
+        pool->cache_slot = slot;
+        pool->cache_generation = ++ac_pool_cache_generation;
+        ac_pool_cache_slots[slot] = pool;
+    }
+    pool->next = ac_pool_list;
+    ac_pool_list = pool;
+    pthread_mutex_unlock(&ac_pool_registry_lock);
+    return pool;
+}
+
+void ac_pool_destroy(ac_pool_t* pool) {
+    pthread_mutex_lock(&ac_pool_registry_lock);
+    for (ac_pool_t** it = &ac_pool_list; *it != NULL; it = &(*it)->next) {
+        if (*it == pool) {
+            *it = pool->next;
+            break;
+        }
+    }
+    if (pool->thread_cached) {
+        ac_pool_cache_slots[pool->cache_slot] = NULL;
+    }
+    pthread_mutex_unlock(&ac_pool_registry_lock);
+
+    ac_pool_slab_t* slab = pool->slabs;
+    while (slab != NULL) {
+        ac_pool_slab_t* next = slab->next;
+        ac_free(slab);
+        slab = next;
+    }
+    if (pool->thread_cached) {
+        pthread_mutex_destroy(&pool->lock);
+    }
+    ac_free(pool);
+}
+
+void* ac_pool_alloc(ac_pool_t* pool, size_t size) {
+    if (size > AC_POOL_MAX_SIZE) {
+        return ac_malloc(size, pool->mem_type);
+    }
+    size_t class_index = ac_pool_class_of(size);
+    if (!pool->thread_cached) {
+        return ac_pool_central_alloc(pool, class_index);
+    }
+
+    ac_pool_magazine_t* magazine = ac_pool_magazine(pool, class_index);
+    if (magazine->count == 0) {
+        pthread_mutex_lock(&pool->lock);
+        while (magazine->count < AC_POOL_REFILL_COUNT) {
+            void* block = ac_pool_central_alloc(pool, class_index);
+            if (block == NULL) {
+                break;
+            }
+            magazine->blocks[magazine->count++] = block;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (magazine->count == 0) {
+            return NULL;
+        }
+    }
+    return magazine->blocks[--magazine->count];
+}
+
+void ac_pool_free(ac_pool_t* pool, void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > AC_POOL_MAX_SIZE) {
+        ac_free(ptr);
+        return;
+    }
+    size_t class_index = ac_pool_class_of(size);
+    if (!pool->thread_cached) {
+        ac_pool_central_free(pool, class_index, ptr);
+        return;
+    }
+
+    ac_pool_magazine_t* magazine = ac_pool_magazine(pool, class_index);
+    if (magazine->count == AC_POOL_MAGAZINE_SIZE) {
+        pthread_mutex_lock(&pool->lock);
+        while (magazine->count > AC_POOL_MAGAZINE_SIZE - AC_POOL_REFILL_COUNT) {
+            ac_pool_central_free(pool, class_index, magazine->blocks[--magazine->count]);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    magazine->blocks[magazine->count++] = ptr;
+}
+
+void ac_pool_get_stats(ac_pool_t* pool, size_t class_index, ac_pool_stats_t* stats) {
+    if (pool->thread_cached) {
+        pthread_mutex_lock(&pool->lock);
+    }
+    *stats = pool->classes[class_index].stats;
+    if (pool->thread_cached) {
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void ac_pool_log_stats(ac_pool_t* pool) {
+    ac_log_info("Pool: %s\n", pool->name);
+    for (size_t i = 0; i < AC_POOL_CLASS_COUNT; i++) {
+        ac_pool_stats_t stats;
+        ac_pool_get_stats(pool, i, &stats);
+        if (stats.alloc_count == 0) {
+            continue;
+        }
+        ac_log_info("  %3zu bytes: live %zu, peak %zu, allocs %zu, frees %zu, slabs %zu\n", stats.block_size, stats.live,
+                    stats.peak_live, stats.alloc_count, stats.free_count, stats.slab_count);
+    }
+}
+
+void ac_pool_show_usage(void) {
+    pthread_mutex_lock(&ac_pool_registry_lock);
+    for (ac_pool_t* pool = ac_pool_list; pool != NULL; pool = pool->next) {
+        ac_pool_log_stats(pool);
+    }
+    pthread_mutex_unlock(&ac_pool_registry_lock);
+}
+
+ac_pool_t* ac_pool_ds(void) {
+    ac_pool_t* pool = atomic_load_explicit(&ac_pool_ds_instance, memory_order_acquire);
+    if (pool != NULL) {
+        return pool;
+    }
+    static pthread_mutex_t ds_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&ds_lock);
+    pool = atomic_load_explicit(&ac_pool_ds_instance, memory_order_relaxed);
+    if (pool == NULL) {
+        pool = ac_pool_create("ds", true, AC_MEM_ENTRY_DS);
+        if (pool == NULL) {
+            ac_log_fatal_exit("Failed to create the ds pool\n");
+        }
+        atomic_store_explicit(&ac_pool_ds_instance, pool, memory_order_release);
+    }
+    pthread_mutex_unlock(&ds_lock);
+    return pool;
+}
+
+void ac_pool_ds_shutdown(void) {
+    ac_pool_t* pool = atomic_exchange(&ac_pool_ds_instance, NULL);
+    if (pool == NULL) {
+        return;
+    }
+    // Blocks parked in the magazines of any thread are not leaks. The other
+    // threads must be done with the pool, their magazines are read unlocked.
+    pthread_mutex_lock(&ac_pool_registry_lock);
+    for (ac_pool_thread_t* thread = ac_pool_threads; thread != NULL; thread = thread->next) {
+        ac_pool_thread_drain(thread, pool);
+    }
+    pthread_mutex_unlock(&ac_pool_registry_lock);
+    for (size_t i = 0; i < AC_POOL_CLASS_COUNT; i++) {
+        ac_pool_stats_t stats;
+        ac_pool_get_stats(pool, i, &stats);
+        if (stats.live != 0) {
+            ac_log_warn("----------------------------\n");
+            ac_log_warn("Memory leak detected\n");
+            ac_log_warn("%zu blocks of %zu bytes never returned to pool %s\n", stats.live, stats.block_size, pool->name);
+            ac_log_warn("----------------------------\n");
+        }
+    }
+    ac_pool_destroy(pool);
+}
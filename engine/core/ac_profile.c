@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include "core/ac_profile.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/ac_log.h"
+#include "core/ac_time.h"
+
+// Profiler
+// Each thread appends events to its own ring and publishes them by bumping
+// head, the exporter copies a ring and drops whatever was overwritten while
+// it copied. Rings come from the system allocator so profiling doesn't
+// show up in the memory tracker, the ring of an exited thread is reused by
+// the next new one.
+
+#define AC_PROFILE_MAX_DEPTH 256
+
+// An event opens a zone, or closes the innermost one when name is NULL
+typedef struct ac_profile_event_t {
+    _Atomic uint64_t ticks;
+    _Atomic(const char*) name;
+} ac_profile_event_t;
+
+// A copy of an event taken by the exporter
+typedef struct ac_profile_record_t {
+    uint64_t ticks;
+    const char* name;
+} ac_profile_record_t;
+
+typedef struct ac_profile_ring_t {
+    struct ac_profile_ring_t* next;
+    _Atomic uint64_t head;
+    uint32_t tid;
+    bool exited;
+    char thread_name[32];
+    ac_profile_event_t events[AC_PROFILE_RING_SIZE];
+} ac_profile_ring_t;
+
+static pthread_mutex_t ac_profile_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_profile_ring_t* ac_profile_rings = NULL;
+static uint32_t ac_profile_next_tid = 1;
+static pthread_once_t ac_profile_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ac_profile_key;
+static _Thread_local ac_profile_ring_t* ac_profile_ring = NULL;
+static ac_profile_ring_t* ac_profile_gpu_ring = NULL;
+
+static uint64_t ac_profile_start_ticks = 0;
+static _Atomic uint64_t ac_profile_frame_count = 0;
+static _Atomic uint64_t ac_profile_frame_ticks[AC_PROFILE_FRAME_HISTORY];
+
+static void ac_profile_thread_exit(void* data) {
+    ac_profile_ring_t* ring = data;
+    pthread_mutex_lock(&ac_profile_rings_lock);
+    ring->exited = true;
+    pthread_mutex_unlock(&ac_profile_rings_lock);
+}
+
+static void ac_profile_key_create(void) {
+    pthread_key_create(&ac_profile_key, ac_profile_thread_exit);
+    ac_time_init();
+    ac_profile_start_ticks = ac_time_ticks();
+}
+
+// Takes the ring of an exited thread or a new one. Owned tracks belong to a
+// thread and are given back when it exits.
+static ac_profile_ring_t* ac_profile_ring_create(const char* name, bool owned) {
+    pthread_once(&ac_profile_key_once, ac_profile_key_create);
+    pthread_mutex_lock(&ac_profile_rings_lock);
+    ac_profile_ring_t* ring = ac_profile_rings;
+    while (ring != NULL && !ring->exited) {
+        ring = ring->next;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(ac_profile_ring_t));
+        if (ring == NULL) {
+            pthread_mutex_unlock(&ac_profile_rings_lock);
+            ac_log_fatal_exit("Failed to allocate a profiling ring\n");
+            return NULL;
+        }
+        ring->next = ac_profile_rings;
+        ac_profile_rings = ring;
+    }
+    // Events of the previous owner go with it
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    ring->exited = false;
+    ring->tid = ac_profile_next_tid++;
+    if (name != NULL) {
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+    } else if (pthread_getname_np(pthread_self(), ring->thread_name, sizeof(ring->thread_name)) != 0) {
+        ring->thread_name[0] = '\0';
+    }
+    pthread_mutex_unlock(&ac_profile_rings_lock);
+    if (owned) {
+        pthread_setspecific(ac_profile_key, ring);
+    }
+    return ring;
+}
+
+static inline void ac_profile_ring_push(ac_profile_ring_t* ring, const char* name, uint64_t ticks) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ac_profile_event_t* event = &ring->events[head & (AC_PROFILE_RING_SIZE - 1)];
+    atomic_store_explicit(&event->ticks, ticks, memory_order_relaxed);
+    atomic_store_explicit(&event->name, name, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static inline void ac_profile_push(const char* name) {
+    ac_profile_ring_t* ring = ac_profile_ring;
+    if (ring == NULL) {
+        ring = ac_profile_ring = ac_profile_ring_create(NULL, true);
+    }
+    ac_profile_ring_push(ring, name, ac_time_ticks());
+}
+
+void ac_profile_begin(const char* name) { ac_profile_push(name); }
+
+void ac_profile_end(void) { ac_profile_push(NULL); }
+
+void ac_profile_scope_end(int* scope) {
+    (void)scope;
+    ac_profile_push(NULL);
+}
+
+void ac_profile_gpu_zone(const char* name, uint64_t begin_ticks, uint64_t end_ticks) {
+    if (ac_profile_gpu_ring == NULL) {
+        ac_profile_gpu_ring = ac_profile_ring_create("GPU", false);
+    }
+    ac_profile_ring_push(ac_profile_gpu_ring, name, begin_ticks);
+    ac_profile_ring_push(ac_profile_gpu_ring, NULL, end_ticks);
+}
+
+void ac_profile_frame_mark(void) {
+    pthread_once(&ac_profile_key_once, ac_profile_key_create);
+    uint64_t frame = atomic_load_explicit(&ac_profile_frame_count, memory_order_relaxed) + 1;
+    atomic_store_explicit(&ac_profile_frame_ticks[frame % AC_PROFILE_FRAME_HISTORY], ac_time_ticks(),
+                          memory_order_relaxed);
+    atomic_store_explicit(&ac_profile_frame_count, frame, memory_order_release);
+}
+
+uint64_t ac_profile_frame(void) { return atomic_load_explicit(&ac_profile_frame_count, memory_order_acquire); }
+
+// Export
+
+typedef struct ac_profile_window_t {
+    uint64_t start;
+    uint64_t end;
+    uint64_t start_ns;
+} ac_profile_window_t;
+
+static void ac_profile_write_string(FILE* fp, const char* string) {
+    fputc('"', fp);
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', fp);
+            fputc(*c, fp);
+        } else if ((unsigned char)*c < 0x20) {
+            fprintf(fp, "\\u%04x", (unsigned char)*c);
+        } else {
+            fputc(*c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+static double ac_profile_us(const ac_profile_window_t* window, uint64_t ticks) {
+    return (double)(ac_time_ticks_to_ns(ticks) - window->start_ns) / 1000.0;
+}
+
+// Writes a zone cut to the window, if it overlaps it
+static void ac_profile_write_zone(FILE* fp, const ac_profile_ring_t* ring, const ac_profile_window_t* window,
+                                  const ac_profile_record_t* begin, uint64_t end, bool* first) {
+    uint64_t start = begin->ticks;
+    if (end < window->start || start > window->end) {
+        return;
+    }
+    start = start < window->start ? window->start : start;
+    end = end > window->end ? window->end : end;
+    fprintf(fp, "%s\n{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":", *first ? "" : ",", ring->tid);
+    ac_profile_write_string(fp, begin->name);
+    double ts = ac_profile_us(window, start);
+    fprintf(fp, ",\"ts\":%.3f,\"dur\":%.3f}", ts, ac_profile_us(window, end) - ts);
+    *first = false;
+}
+
+// Copies the ring and pairs its events into zones. Closes without a begin,
+// whose begin was overwritten, are dropped, zones still open are cut at the
+// end of the window.
+static void ac_profile_write_ring(FILE* fp, const ac_profile_ring_t* ring, const ac_profile_window_t* window,
+                                  ac_profile_record_t* records, bool* first) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = head > AC_PROFILE_RING_SIZE ? head - AC_PROFILE_RING_SIZE : 0;
+    for (uint64_t i = tail; i < head; i++) {
+        const ac_profile_event_t* event = &ring->events[i & (AC_PROFILE_RING_SIZE - 1)];
+        records[i - tail].ticks = atomic_load_explicit(&event->ticks, memory_order_relaxed);
+        records[i - tail].name = atomic_load_explicit(&event->name, memory_order_relaxed);
+    }
+    // The owner kept writing while we copied, drop what it overwrote. It may
+    // be writing the slot after new_head already.
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t new_head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+    uint64_t valid = new_head > AC_PROFILE_RING_SIZE ? new_head - AC_PROFILE_RING_SIZE : 0;
+    size_t skip = 0;
+    if (valid > tail) {
+        skip = valid < head ? valid - tail : head - tail;
+    }
+    size_t count = head - tail - skip;
+    records += skip;
+
+    fprintf(fp, "%s\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", *first ? "" : ",",
+            ring->tid);
+    *first = false;
+    if (ring->thread_name[0] != '\0') {
+        ac_profile_write_string(fp, ring->thread_name);
+    } else {
+        fprintf(fp, "\"Thread %u\"", ring->tid);
+    }
+    fprintf(fp, "}}");
+
+    const ac_profile_record_t* stack[AC_PROFILE_MAX_DEPTH];
+    size_t depth = 0;
+    size_t lost = 0;
+    for (size_t i = 0; i < count; i++) {
+        const ac_profile_record_t* event = &records[i];
+        if (event->name != NULL) {
+            if (depth < AC_PROFILE_MAX_DEPTH) {
+                stack[depth] = event;
+            }
+            depth++;
+        } else if (depth > 0) {
+            depth--;
+            if (depth < AC_PROFILE_MAX_DEPTH) {
+                ac_profile_write_zone(fp, ring, window, stack[depth], event->ticks, first);
+            }
+        } else {
+            lost++;
+        }
+        if (event->ticks > window->end && depth == 0) {
+            break;
+        }
+    }
+    while (depth > 0) {
+        depth--;
+        if (depth < AC_PROFILE_MAX_DEPTH) {
+            ac_profile_write_zone(fp, ring, window, stack[depth], window->end, first);
+        }
+    }
+    if (lost != 0) {
+        ac_log_debug("Profile thread %u: %zu zones lost to the ring buffer\n", ring->tid, lost);
+    }
+}
+
+bool ac_profile_export(const char* path, uint64_t first_frame, uint64_t last_frame) {
+    uint64_t current = ac_profile_frame();
+    if (first_frame > last_frame || last_frame > current || current - first_frame >= AC_PROFILE_FRAME_HISTORY) {
+        ac_log_error("Frames %llu to %llu are not available for export\n", (unsigned long long)first_frame,
+                     (unsigned long long)last_frame);
+        return false;
+    }
+    ac_profile_window_t window = {
+        .start = first_frame == 0 ? ac_profile_start_ticks
+                                  : atomic_load_explicit(&ac_profile_frame_ticks[first_frame % AC_PROFILE_FRAME_HISTORY],
+                                                         memory_order_relaxed),
+        .end = last_frame == current
+                   ? ac_time_ticks()
+                   : atomic_load_explicit(&ac_profile_frame_ticks[(last_frame + 1) % AC_PROFILE_FRAME_HISTORY],
+                                          memory_order_relaxed),
+    };
+    window.start_ns = ac_time_ticks_to_ns(window.start);
+
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s for the profile\n", path);
+        return false;
+    }
+    ac_profile_record_t* records = malloc(AC_PROFILE_RING_SIZE * sizeof(ac_profile_record_t));
+    if (records == NULL) {
+        fclose(fp);
+        ac_log_error("Failed to allocate the profile export buffer\n");
+        return false;
+    }
+
+    bool first = true;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint64_t frame = first_frame; frame <= last_frame; frame++) {
+        if (frame == 0) {
+            continue;
+        }
+        uint64_t ticks = atomic_load_explicit(&ac_profile_frame_ticks[frame % AC_PROFILE_FRAME_HISTORY], memory_order_relaxed);
+        fprintf(fp, "%s\n{\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"name\":\"Frame %llu\",\"ts\":%.3f}", first ? "" : ",",
+                (unsigned long long)frame, ac_profile_us(&window, ticks));
+        first = false;
+    }
+    pthread_mutex_lock(&ac_profile_rings_lock);
+    for (ac_profile_ring_t* ring = ac_profile_rings; ring != NULL; ring = ring->next) {
+        ac_profile_write_ring(fp, ring, &window, records, &first);
+    }
+    pthread_mutex_unlock(&ac_profile_rings_lock);
+    fprintf(fp, "\n]}\n");
+    free(records);
+
+    if (ferror(fp) | fclose(fp)) {
+        ac_log_error("Failed to write the profile %s\n", path);
+        return false;
+    }
+    ac_log_info("Profile of frames %llu to %llu written to %s\n", (unsigned long long)first_frame,
+                (unsigned long long)last_frame, path);
+    return true;
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include "core/ac_sampler.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "core/ac_log.h"
+#include "core/ac_symbol.h"
+
+// Sampler
+// The SIGPROF handler walks the frame pointers of the interrupted code and
+// appends the frames to a buffer mapped once, claiming room with a CAS so
+// samples of several threads never mix. A record is its depth followed by its
+// frames. Symbols are resolved when the samples are written out, never in the
+// handler.
+
+#define AC_SAMPLER_BUFFER_WORDS (AC_SAMPLER_BUFFER_SIZE / sizeof(uintptr_t))
+#define AC_SAMPLER_NAME_SIZE 256
+#define AC_SAMPLER_LINE_SIZE (AC_SAMPLER_MAX_DEPTH * AC_SAMPLER_NAME_SIZE)
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define AC_SAMPLER_SUPPORTED
+#endif
+
+typedef struct ac_sampler_stack_t {
+    char* line;
+    size_t count;
+} ac_sampler_stack_t;
+
+// A distinct stack of the buffer, found by the hash of its frames. Kept out
+// of the ac_trace table, which memory snapshots dump.
+typedef struct ac_sampler_slot_t {
+    uint64_t hash;
+    const uintptr_t* record;
+    size_t count;
+} ac_sampler_slot_t;
+
+static uintptr_t* ac_sampler_buffer = NULL;
+static _Atomic size_t ac_sampler_used = 0;
+static _Atomic size_t ac_sampler_count = 0;
+static _Atomic size_t ac_sampler_dropped = 0;
+static atomic_bool ac_sampler_running = false;
+static _Atomic int ac_sampler_in_handler = 0;
+static bool ac_sampler_installed = false;
+
+// Read by the handler, initial-exec so reading it never allocates
+static _Thread_local __attribute__((tls_model("initial-exec"))) uintptr_t ac_sampler_stack_high = 0;
+
+#ifdef AC_SAMPLER_SUPPORTED
+
+static void ac_sampler_record(const ucontext_t* context) {
+#if defined(__x86_64__)
+    uintptr_t pc = context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = context->uc_mcontext.gregs[REG_RBP];
+    uintptr_t sp = context->uc_mcontext.gregs[REG_RSP];
+#else
+    uintptr_t pc = context->uc_mcontext.pc;
+    uintptr_t fp = context->uc_mcontext.regs[29];
+    uintptr_t sp = context->uc_mcontext.sp;
+#endif
+    uintptr_t frames[AC_SAMPLER_MAX_DEPTH];
+    size_t depth = 0;
+    // Stored like the return addresses that follow, which resolve minus one
+    frames[depth++] = pc + 1;
+
+    // Same walk as the frame pointer unwinder of ac_trace, the stack of the
+    // interrupted code lies between its stack pointer and the top of the stack
+    uintptr_t high = ac_sampler_stack_high;
+    while (depth < AC_SAMPLER_MAX_DEPTH) {
+        if (fp < sp || high < 2 * sizeof(uintptr_t) || fp > high - 2 * sizeof(uintptr_t) ||
+            (fp & (sizeof(uintptr_t) - 1)) != 0) {
+            break;
+        }
+        const uintptr_t* frame = (const uintptr_t*)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        frames[depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+
+    size_t words = depth + 1;
+    size_t used = atomic_load_explicit(&ac_sampler_used, memory_order_relaxed);
+    do {
+        if (used + words > AC_SAMPLER_BUFFER_WORDS) {
+            atomic_fetch_add_explicit(&ac_sampler_dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ac_sampler_used, &used, used + words, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    uintptr_t* record = ac_sampler_buffer + used;
+    record[0] = depth;
+    for (size_t i = 0; i < depth; i++) {
+        record[i + 1] = frames[i];
+    }
+    atomic_fetch_add_explicit(&ac_sampler_count, 1, memory_order_relaxed);
+}
+
+static void ac_sampler_handler(int sig, siginfo_t* info, void* context) {
+    (void)sig;
+    (void)info;
+    int saved_errno = errno;
+    atomic_fetch_add(&ac_sampler_in_handler, 1);
+    if (atomic_load(&ac_sampler_running)) {
+        ac_sampler_record(context);
+    }
+    atomic_fetch_sub(&ac_sampler_in_handler, 1);
+    errno = saved_errno;
+}
+
+#endif  // AC_SAMPLER_SUPPORTED
+
+bool ac_sampler_start(uint32_t frequency) {
+#ifndef AC_SAMPLER_SUPPORTED
+    (void)frequency;
+    ac_log_error("Sampling is not supported on this architecture\n");
+    return false;
+#else
+    if (frequency == 0 || atomic_load(&ac_sampler_running)) {
+        return false;
+    }
+    if (ac_sampler_buffer == NULL) {
+        void* buffer = mmap(NULL, AC_SAMPLER_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED) {
+            ac_log_error("Failed to map the sample buffer\n");
+            return false;
+        }
+        ac_sampler_buffer = buffer;
+    }
+    // The handler stays installed, stray signals after a stop are ignored
+    if (!ac_sampler_installed) {
+        struct sigaction action = {0};
+        action.sa_sigaction = ac_sampler_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, NULL) != 0) {
+            ac_log_error("Failed to install the SIGPROF handler\n");
+            return false;
+        }
+        ac_sampler_installed = true;
+    }
+    ac_sampler_register_thread();
+
+    atomic_store(&ac_sampler_used, 0);
+    atomic_store(&ac_sampler_count, 0);
+    atomic_store(&ac_sampler_dropped, 0);
+    atomic_store(&ac_sampler_running, true);
+
+    uint64_t period_us = frequency > 1000000 ? 1 : 1000000 / frequency;
+    struct itimerval timer = {0};
+    timer.it_interval.tv_sec = period_us / 1000000;
+    timer.it_interval.tv_usec = period_us % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        atomic_store(&ac_sampler_running, false);
+        ac_log_error("Failed to start the SIGPROF timer\n");
+        return false;
+    }
+    ac_log_info("Sampling at %u Hz\n", frequency);
+    return true;
+#endif
+}
+
+void ac_sampler_stop(void) {
+    if (!atomic_load(&ac_sampler_running)) {
+        return;
+    }
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    atomic_store(&ac_sampler_running, false);
+    // A handler that saw the sampler running is counted in ac_sampler_in_handler
+    while (atomic_load(&ac_sampler_in_handler) != 0) {
+        sched_yield();
+    }
+    ac_log_info("Sampling stopped, %zu samples, %zu dropped\n", atomic_load(&ac_sampler_count),
+                atomic_load(&ac_sampler_dropped));
+}
+
+void ac_sampler_register_thread(void) {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return;
+    }
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        ac_sampler_stack_high = (uintptr_t)addr + size;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+size_t ac_sampler_samples(size_t* dropped) {
+    if (dropped != NULL) {
+        *dropped = atomic_load(&ac_sampler_dropped);
+    }
+    return atomic_load(&ac_sampler_count);
+}
+
+// Function of a frame, the module and offset when it has no symbol
+static void ac_sampler_frame_name(void* address, char* buffer, size_t size) {
+    ac_symbol_t symbol;
+    if (ac_symbol_resolve((char*)address - 1, &symbol)) {
+        snprintf(buffer, size, "%s", symbol.function);
+    } else if (symbol.module != NULL) {
+        const char* name = strrchr(symbol.module, '/');
+        snprintf(buffer, size, "[%s+0x%lx]", name != NULL ? name + 1 : symbol.module, (unsigned long)symbol.module_offset);
+    } else {
+        snprintf(buffer, size, "[%p]", (char*)address - 1);
+    }
+}
+
+// Frames from main, or the outermost one, to the innermost joined by ';'
+static char* ac_sampler_fold(void** frames, int size) {
+    char names[AC_SAMPLER_MAX_DEPTH][AC_SAMPLER_NAME_SIZE];
+    int count = 0;
+    while (count < size && count < AC_SAMPLER_MAX_DEPTH) {
+        ac_sampler_frame_name(frames[count], names[count], AC_SAMPLER_NAME_SIZE);
+        if (strcmp(names[count++], "main") == 0) {
+            break;
+        }
+    }
+    char line[AC_SAMPLER_LINE_SIZE];
+    size_t length = 0;
+    line[0] = '\0';
+    for (int i = count - 1; i >= 0 && length < sizeof(line); i--) {
+        length += snprintf(line + length, sizeof(line) - length, "%s%s", names[i], i > 0 ? ";" : "");
+    }
+    return strdup(line);
+}
+
+static int ac_sampler_compare_stacks(const void* a, const void* b) {
+    return strcmp(((const ac_sampler_stack_t*)a)->line, ((const ac_sampler_stack_t*)b)->line);
+}
+
+// FNV-1a over the frames, finished like ac_trace's
+static uint64_t ac_sampler_hash(const uintptr_t* frames, size_t depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < depth; i++) {
+        hash ^= (uint64_t)frames[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+bool ac_sampler_write_folded(const char* path) {
+    if (atomic_load(&ac_sampler_running)) {
+        ac_log_error("Stop sampling before writing the samples\n");
+        return false;
+    }
+    size_t used = atomic_load(&ac_sampler_used);
+    size_t samples = atomic_load(&ac_sampler_count);
+
+    // Identical stacks are folded first, only distinct ones get symbolized.
+    // At most half full, the table always has a free slot.
+    size_t capacity = 16;
+    while (capacity < 2 * samples) {
+        capacity *= 2;
+    }
+    ac_sampler_slot_t* slots = calloc(capacity, sizeof(ac_sampler_slot_t));
+    if (slots == NULL) {
+        ac_log_error("Failed to allocate the sample table\n");
+        return false;
+    }
+    size_t count = 0;
+    size_t distinct = 0;
+    for (size_t pos = 0; pos < used && count < samples; count++) {
+        const uintptr_t* record = &ac_sampler_buffer[pos];
+        size_t depth = record[0];
+        uint64_t hash = ac_sampler_hash(record + 1, depth);
+        size_t slot = hash & (capacity - 1);
+        while (slots[slot].record != NULL) {
+            const uintptr_t* other = slots[slot].record;
+            if (slots[slot].hash == hash && other[0] == depth && memcmp(other + 1, record + 1, depth * sizeof(uintptr_t)) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (slots[slot].record == NULL) {
+            slots[slot] = (ac_sampler_slot_t){hash, record, 0};
+            distinct++;
+        }
+        slots[slot].count++;
+        pos += depth + 1;
+    }
+    ac_sampler_stack_t* stacks = malloc((distinct + 1) * sizeof(ac_sampler_stack_t));
+    if (stacks == NULL) {
+        free(slots);
+        ac_log_error("Failed to allocate the sample stacks\n");
+        return false;
+    }
+
+    size_t stack_count = 0;
+    for (size_t slot = 0; slot < capacity; slot++) {
+        const uintptr_t* record = slots[slot].record;
+        if (record == NULL) {
+            continue;
+        }
+        char* line = ac_sampler_fold((void**)(record + 1), (int)record[0]);
+        if (line == NULL) {
+            continue;
+        }
+        stacks[stack_count++] = (ac_sampler_stack_t){line, slots[slot].count};
+    }
+    free(slots);
+
+    // Stacks differing only in offsets within the same functions fold to the same line
+    qsort(stacks, stack_count, sizeof(ac_sampler_stack_t), ac_sampler_compare_stacks);
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s for the samples\n", path);
+    }
+    size_t lines = 0;
+    for (size_t i = 0; i < stack_count; i++) {
+        size_t total = stacks[i].count;
+        while (i + 1 < stack_count && strcmp(stacks[i].line, stacks[i + 1].line) == 0) {
+            free(stacks[i].line);
+            total += stacks[++i].count;
+        }
+        if (fp != NULL) {
+            fprintf(fp, "%s %zu\n", stacks[i].line, total);
+        }
+        free(stacks[i].line);
+        lines++;
+    }
+    free(stacks);
+
+    if (fp == NULL) {
+        return false;
+    }
+    if (ferror(fp) | fclose(fp)) {
+        ac_log_error("Failed to write the samples %s\n", path);
+        return false;
+    }
+    ac_log_info("%zu samples written to %s as %zu stacks\n", count, path, lines);
+    return true;
+}
@@ -0,0 +1,1012 @@
+#define _GNU_SOURCE
+
+#include "core/ac_symbol.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/ac_log.h"
+
+// Symbolizer
+// Every module reported by dl_iterate_phdr gets a record, its ELF file is
+// mapped and its function symbols sorted by address on the first lookup
+// inside it. The DWARF line table is decoded into sorted rows the first time
+// a line is asked for. Tables come from the system malloc, the symbolizer
+// runs while ac_mem reports leaks and must not show up in them.
+//
+// Printed lines are kept in an open addressing table keyed by address. Slots
+// are claimed with a CAS and only ever filled once, so readers take no lock.
+
+typedef struct ac_symbol_entry_t {
+    uintptr_t address;
+    uintptr_t size;
+    const char* name;
+} ac_symbol_entry_t;
+
+// A row of the line table, line 0 marks the end of a sequence
+typedef struct ac_symbol_row_t {
+    uintptr_t address;
+    uint32_t file;
+    uint32_t line;
+} ac_symbol_row_t;
+
+typedef struct ac_symbol_file_t {
+    const char* directory;
+    const char* name;
+} ac_symbol_file_t;
+
+typedef struct ac_symbol_module_t {
+    char* path;
+    uintptr_t bias;
+    uintptr_t start;
+    uintptr_t end;
+    bool loaded;
+    bool lines_loaded;
+    const uint8_t* image;
+    size_t image_size;
+    ac_symbol_entry_t* entries;
+    size_t entry_count;
+    ac_symbol_row_t* rows;
+    size_t row_count;
+    ac_symbol_file_t* files;
+    size_t file_count;
+    size_t file_capacity;
+} ac_symbol_module_t;
+
+static pthread_mutex_t ac_symbol_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_symbol_module_t* ac_symbol_modules = NULL;
+static size_t ac_symbol_module_count = 0;
+static size_t ac_symbol_module_capacity = 0;
+static unsigned long long ac_symbol_module_adds = 0;
+static bool ac_symbol_line_info = true;
+
+typedef struct ac_symbol_cache_entry_t {
+    _Atomic uintptr_t address;
+    _Atomic(const char*) line;
+} ac_symbol_cache_entry_t;
+
+static ac_symbol_cache_entry_t ac_symbol_cache[AC_SYMBOL_CACHE_SIZE];
+static atomic_size_t ac_symbol_cache_count = 0;
+
+void ac_symbol_set_line_info(bool enable) {
+    pthread_mutex_lock(&ac_symbol_lock);
+    ac_symbol_line_info = enable;
+    pthread_mutex_unlock(&ac_symbol_lock);
+}
+
+// Module list
+
+static int ac_symbol_add_module(struct dl_phdr_info* info, size_t size, void* data) {
+    (void)size;
+    (void)data;
+    uintptr_t start = UINTPTR_MAX;
+    uintptr_t end = 0;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD) {
+            continue;
+        }
+        uintptr_t segment = info->dlpi_addr + phdr->p_vaddr;
+        if (segment < start) {
+            start = segment;
+        }
+        if (segment + phdr->p_memsz > end) {
+            end = segment + phdr->p_memsz;
+        }
+    }
+    if (start >= end) {
+        return 0;
+    }
+    for (size_t i = 0; i < ac_symbol_module_count; i++) {
+        if (ac_symbol_modules[i].start == start && ac_symbol_modules[i].bias == info->dlpi_addr) {
+            return 0;
+        }
+    }
+
+    char exe[1024];
+    const char* path = info->dlpi_name;
+    if (path == NULL || path[0] == '\0') {
+        // The main executable has no name
+        ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len < 0) {
+            return 0;
+        }
+        exe[len] = '\0';
+        path = exe;
+    }
+    if (ac_symbol_module_count == ac_symbol_module_capacity) {
+        size_t capacity = ac_symbol_module_capacity == 0 ? 32 : ac_symbol_module_capacity * 2;
+        ac_symbol_module_t* modules = realloc(ac_symbol_modules, capacity * sizeof(ac_symbol_module_t));
+        if (modules == NULL) {
+            return 1;
+        }
+        ac_symbol_modules = modules;
+        ac_symbol_module_capacity = capacity;
+    }
+    ac_symbol_module_t* module = &ac_symbol_modules[ac_symbol_module_count];
+    memset(module, 0, sizeof(ac_symbol_module_t));
+    module->path = strdup(path);
+    if (module->path == NULL) {
+        return 1;
+    }
+    module->bias = info->dlpi_addr;
+    module->start = start;
+    module->end = end;
+    ac_symbol_module_count++;
+    return 0;
+}
+
+static int ac_symbol_read_adds(struct dl_phdr_info* info, size_t size, void* data) {
+    if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds)) {
+        *(unsigned long long*)data = info->dlpi_adds;
+    }
+    return 1;
+}
+
+static int ac_symbol_module_compare(const void* a, const void* b) {
+    const ac_symbol_module_t* module_a = a;
+    const ac_symbol_module_t* module_b = b;
+    return (module_a->start > module_b->start) - (module_a->start < module_b->start);
+}
+
+// Rescans the loaded modules, only when a module was loaded since last time
+static bool ac_symbol_refresh_modules(void) {
+    unsigned long long adds = 0;
+    dl_iterate_phdr(ac_symbol_read_adds, &adds);
+    if (adds == ac_symbol_module_adds && ac_symbol_module_count != 0) {
+        return false;
+    }
+    ac_symbol_module_adds = adds;
+    size_t count = ac_symbol_module_count;
+    dl_iterate_phdr(ac_symbol_add_module, NULL);
+    qsort(ac_symbol_modules, ac_symbol_module_count, sizeof(ac_symbol_module_t), ac_symbol_module_compare);
+    return ac_symbol_module_count != count;
+}
+
+static ac_symbol_module_t* ac_symbol_find_module(uintptr_t address) {
+    size_t low = 0;
+    size_t high = ac_symbol_module_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ac_symbol_modules[mid].start <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || address >= ac_symbol_modules[low - 1].end) {
+        return NULL;
+    }
+    return &ac_symbol_modules[low - 1];
+}
+
+// ELF sections
+
+static const ElfW(Shdr) * ac_symbol_sections(const ac_symbol_module_t* module, size_t* count) {
+    const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)module->image;
+    size_t shnum = ehdr->e_shnum;
+    if (ehdr->e_shoff == 0 || ehdr->e_shentsize != sizeof(ElfW(Shdr)) || ehdr->e_shoff > module->image_size) {
+        return NULL;
+    }
+    const ElfW(Shdr)* sections = (const ElfW(Shdr)*)(module->image + ehdr->e_shoff);
+    if (shnum == 0 && ehdr->e_shoff + sizeof(ElfW(Shdr)) <= module->image_size) {
+        // More sections than fit e_shnum, the count is in the first one
+        shnum = sections[0].sh_size;
+    }
+    if (shnum > (module->image_size - ehdr->e_shoff) / sizeof(ElfW(Shdr))) {
+        return NULL;
+    }
+    *count = shnum;
+    return sections;
+}
+
+static const uint8_t* ac_symbol_section_data(const ac_symbol_module_t* module, const ElfW(Shdr) * section,
+                                             size_t* size) {
+    if (section->sh_type == SHT_NOBITS || section->sh_offset > module->image_size ||
+        section->sh_size > module->image_size - section->sh_offset) {
+        return NULL;
+    }
+    *size = section->sh_size;
+    return module->image + section->sh_offset;
+}
+
+static const ElfW(Shdr) * ac_symbol_find_section(const ac_symbol_module_t* module, const char* name) {
+    size_t count = 0;
+    const ElfW(Shdr)* sections = ac_symbol_sections(module, &count);
+    if (sections == NULL) {
+        return NULL;
+    }
+    const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)module->image;
+    size_t strndx = ehdr->e_shstrndx == SHN_XINDEX ? sections[0].sh_link : ehdr->e_shstrndx;
+    size_t names_size = 0;
+    if (strndx >= count) {
+        return NULL;
+    }
+    const char* names = (const char*)ac_symbol_section_data(module, &sections[strndx], &names_size);
+    if (names == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (sections[i].sh_name < names_size && strcmp(names + sections[i].sh_name, name) == 0) {
+            return &sections[i];
+        }
+    }
+    return NULL;
+}
+
+// Symbol table
+
+static int ac_symbol_entry_compare(const void* a, const void* b) {
+    const ac_symbol_entry_t* entry_a = a;
+    const ac_symbol_entry_t* entry_b = b;
+    if (entry_a->address != entry_b->address) {
+        return entry_a->address > entry_b->address ? 1 : -1;
+    }
+    // Among aliases prefer the one that knows its size
+    return (entry_a->size == 0) - (entry_b->size == 0);
+}
+
+static void ac_symbol_load_symbols(ac_symbol_module_t* module) {
+    size_t count = 0;
+    const ElfW(Shdr)* sections = ac_symbol_sections(module, &count);
+    if (sections == NULL) {
+        return;
+    }
+    // The full symbol table when not stripped, the dynamic one otherwise
+    const ElfW(Shdr)* symtab = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (sections[i].sh_type == SHT_SYMTAB) {
+            symtab = &sections[i];
+            break;
+        }
+        if (sections[i].sh_type == SHT_DYNSYM) {
+            symtab = &sections[i];
+        }
+    }
+    if (symtab == NULL || symtab->sh_link >= count || symtab->sh_entsize != sizeof(ElfW(Sym))) {
+        return;
+    }
+    size_t symbols_size = 0;
+    size_t strings_size = 0;
+    const ElfW(Sym)* symbols = (const ElfW(Sym)*)ac_symbol_section_data(module, symtab, &symbols_size);
+    const char* strings = (const char*)ac_symbol_section_data(module, &sections[symtab->sh_link], &strings_size);
+    if (symbols == NULL || strings == NULL) {
+        return;
+    }
+
+    size_t symbol_count = symbols_size / sizeof(ElfW(Sym));
+    module->entries = malloc(symbol_count * sizeof(ac_symbol_entry_t));
+    if (module->entries == NULL) {
+        return;
+    }
+    size_t entry_count = 0;
+    for (size_t i = 0; i < symbol_count; i++) {
+        const ElfW(Sym)* symbol = &symbols[i];
+        int type = ELF64_ST_TYPE(symbol->st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol->st_shndx == SHN_UNDEF || symbol->st_value == 0 ||
+            symbol->st_name >= strings_size) {
+            continue;
+        }
+        module->entries[entry_count++] = (ac_symbol_entry_t){
+            .address = symbol->st_value,
+            .size = symbol->st_size,
+            .name = strings + symbol->st_name,
+        };
+    }
+    qsort(module->entries, entry_count, sizeof(ac_symbol_entry_t), ac_symbol_entry_compare);
+
+    // Keep one symbol per address
+    size_t unique = 0;
+    for (size_t i = 0; i < entry_count; i++) {
+        if (unique == 0 || module->entries[unique - 1].address != module->entries[i].address) {
+            module->entries[unique++] = module->entries[i];
+        }
+    }
+    module->entry_count = unique;
+}
+
+static void ac_symbol_load_module(ac_symbol_module_t* module) {
+    module->loaded = true;
+    int fd = open(module->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // The vdso and deleted files
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return;
+    }
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return;
+    }
+    const ElfW(Ehdr)* ehdr = image;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)) {
+        munmap(image, st.st_size);
+        return;
+    }
+    module->image = image;
+    module->image_size = st.st_size;
+    ac_symbol_load_symbols(module);
+}
+
+// DWARF line table
+
+// The subset of the DWARF 5 constants used by line tables
+enum {
+    DW_FORM_block = 0x09,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_string = 0x08,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_LNCT_path = 0x1,
+    DW_LNCT_directory_index = 0x2,
+    DW_LNS_copy = 0x01,
+    DW_LNS_advance_pc = 0x02,
+    DW_LNS_advance_line = 0x03,
+    DW_LNS_set_file = 0x04,
+    DW_LNS_const_add_pc = 0x08,
+    DW_LNS_fixed_advance_pc = 0x09,
+    DW_LNE_end_sequence = 0x01,
+    DW_LNE_set_address = 0x02,
+};
+
+typedef struct ac_symbol_reader_t {
+    const uint8_t* pos;
+    const uint8_t* end;
+    bool overflow;
+} ac_symbol_reader_t;
+
+static bool ac_symbol_read(ac_symbol_reader_t* reader, void* out, size_t size) {
+    if (reader->overflow || (size_t)(reader->end - reader->pos) < size) {
+        reader->overflow = true;
+        if (out != NULL) {
+            memset(out, 0, size);
+        }
+        return false;
+    }
+    if (out != NULL) {
+        memcpy(out, reader->pos, size);
+    }
+    reader->pos += size;
+    return true;
+}
+
+static uint8_t ac_symbol_read_u8(ac_symbol_reader_t* reader) {
+    uint8_t value;
+    ac_symbol_read(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint16_t ac_symbol_read_u16(ac_symbol_reader_t* reader) {
+    uint16_t value;
+    ac_symbol_read(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t ac_symbol_read_u32(ac_symbol_reader_t* reader) {
+    uint32_t value;
+    ac_symbol_read(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t ac_symbol_read_u64(ac_symbol_reader_t* reader) {
+    uint64_t value;
+    ac_symbol_read(reader, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t ac_symbol_read_offset(ac_symbol_reader_t* reader, size_t offset_size) {
+    return offset_size == 8 ? ac_symbol_read_u64(reader) : ac_symbol_read_u32(reader);
+}
+
+static uint64_t ac_symbol_read_uleb(ac_symbol_reader_t* reader) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = ac_symbol_read_u8(reader);
+        if (shift < 64) {
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while ((byte & 0x80) && !reader->overflow);
+    return value;
+}
+
+static int64_t ac_symbol_read_sleb(ac_symbol_reader_t* reader) {
+    int64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = ac_symbol_read_u8(reader);
+        if (shift < 64) {
+            value |= (int64_t)((uint64_t)(byte & 0x7f) << shift);
+        }
+        shift += 7;
+    } while ((byte & 0x80) && !reader->overflow);
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((int64_t)1 << shift);
+    }
+    return value;
+}
+
+static const char* ac_symbol_read_string(ac_symbol_reader_t* reader) {
+    const uint8_t* nul = reader->overflow ? NULL : memchr(reader->pos, '\0', reader->end - reader->pos);
+    if (nul == NULL) {
+        reader->overflow = true;
+        return NULL;
+    }
+    const char* string = (const char*)reader->pos;
+    reader->pos = nul + 1;
+    return string;
+}
+
+typedef struct ac_symbol_line_sections_t {
+    const char* line_str;
+    size_t line_str_size;
+    const char* str;
+    size_t str_size;
+} ac_symbol_line_sections_t;
+
+// Reads an attribute of a DWARF 5 directory or file entry, either a string or
+// a number. Returns false for forms that can't be read without .debug_info.
+static bool ac_symbol_read_form(ac_symbol_reader_t* reader, uint64_t form, size_t offset_size,
+                                const ac_symbol_line_sections_t* sections, const char** string, uint64_t* value) {
+    *string = NULL;
+    *value = 0;
+    switch (form) {
+        case DW_FORM_string:
+            *string = ac_symbol_read_string(reader);
+            break;
+        case DW_FORM_line_strp:
+        case DW_FORM_strp: {
+            uint64_t offset = ac_symbol_read_offset(reader, offset_size);
+            const char* strings = form == DW_FORM_strp ? sections->str : sections->line_str;
+            size_t size = form == DW_FORM_strp ? sections->str_size : sections->line_str_size;
+            if (strings != NULL && offset < size) {
+                *string = strings + offset;
+            }
+            break;
+        }
+        case DW_FORM_udata:
+            *value = ac_symbol_read_uleb(reader);
+            break;
+        case DW_FORM_data1:
+            *value = ac_symbol_read_u8(reader);
+            break;
+        case DW_FORM_data2:
+            *value = ac_symbol_read_u16(reader);
+            break;
+        case DW_FORM_data4:
+            *value = ac_symbol_read_u32(reader);
+            break;
+        case DW_FORM_data8:
+            *value = ac_symbol_read_u64(reader);
+            break;
+        case DW_FORM_data16:
+            ac_symbol_read(reader, NULL, 16);
+            break;
+        case DW_FORM_block:
+            ac_symbol_read(reader, NULL, ac_symbol_read_uleb(reader));
+            break;
+        default:
+            return false;
+    }
+    return !reader->overflow;
+}
+
+static bool ac_symbol_add_file(ac_symbol_module_t* module, const char* directory, const char* name) {
+    if (module->file_count == module->file_capacity) {
+        size_t capacity = module->file_capacity == 0 ? 256 : module->file_capacity * 2;
+        ac_symbol_file_t* files = realloc(module->files, capacity * sizeof(ac_symbol_file_t));
+        if (files == NULL) {
+            return false;
+        }
+        module->files = files;
+        module->file_capacity = capacity;
+    }
+    module->files[module->file_count++] = (ac_symbol_file_t){
+        .directory = name != NULL && name[0] == '/' ? NULL : directory,
+        .name = name != NULL ? name : "??",
+    };
+    return true;
+}
+
+// Reads the directory and file tables of a unit header, files are appended
+// to the module table
+static bool ac_symbol_read_files(ac_symbol_module_t* module, ac_symbol_reader_t* reader, uint16_t version,
+                                 size_t offset_size, const ac_symbol_line_sections_t* sections) {
+    const char* directories[256];
+    size_t directory_count = 0;
+    if (version < 5) {
+        // Directory 0 is the compilation directory, left implicit
+        directories[directory_count++] = NULL;
+        for (const char* directory = ac_symbol_read_string(reader); directory != NULL && directory[0] != '\0';
+             directory = ac_symbol_read_string(reader)) {
+            if (directory_count < sizeof(directories) / sizeof(directories[0])) {
+                directories[directory_count++] = directory;
+            }
+        }
+        for (const char* name = ac_symbol_read_string(reader); name != NULL && name[0] != '\0';
+             name = ac_symbol_read_string(reader)) {
+            uint64_t directory = ac_symbol_read_uleb(reader);
+            ac_symbol_read_uleb(reader);  // Modification time
+            ac_symbol_read_uleb(reader);  // Length
+            if (!ac_symbol_add_file(module, directory < directory_count ? directories[directory] : NULL, name)) {
+                return false;
+            }
+        }
+        return !reader->overflow;
+    }
+
+    uint64_t formats[2][32];
+    uint8_t format_count = ac_symbol_read_u8(reader);
+    if (format_count > 16) {
+        return false;
+    }
+    for (uint8_t i = 0; i < format_count; i++) {
+        formats[0][i] = ac_symbol_read_uleb(reader);
+        formats[1][i] = ac_symbol_read_uleb(reader);
+    }
+    uint64_t count = ac_symbol_read_uleb(reader);
+    for (uint64_t i = 0; i < count && !reader->overflow; i++) {
+        const char* path = NULL;
+        for (uint8_t j = 0; j < format_count; j++) {
+            const char* string;
+            uint64_t value;
+            if (!ac_symbol_read_form(reader, formats[1][j], offset_size, sections, &string, &value)) {
+                return false;
+            }
+            if (formats[0][j] == DW_LNCT_path) {
+                path = string;
+            }
+        }
+        if (directory_count < sizeof(directories) / sizeof(directories[0])) {
+            directories[directory_count++] = path;
+        }
+    }
+
+    format_count = ac_symbol_read_u8(reader);
+    if (format_count > 16) {
+        return false;
+    }
+    for (uint8_t i = 0; i < format_count; i++) {
+        formats[0][i] = ac_symbol_read_uleb(reader);
+        formats[1][i] = ac_symbol_read_uleb(reader);
+    }
+    count = ac_symbol_read_uleb(reader);
+    for (uint64_t i = 0; i < count && !reader->overflow; i++) {
+        const char* path = NULL;
+        uint64_t directory = 0;
+        for (uint8_t j = 0; j < format_count; j++) {
+            const char* string;
+            uint64_t value;
+            if (!ac_symbol_read_form(reader, formats[1][j], offset_size, sections, &string, &value)) {
+                return false;
+            }
+            if (formats[0][j] == DW_LNCT_path) {
+                path = string;
+            } else if (formats[0][j] == DW_LNCT_directory_index) {
+                directory = value;
+            }
+        }
+        if (!ac_symbol_add_file(module, directory < directory_count ? directories[directory] : NULL, path)) {
+            return false;
+        }
+    }
+    return !reader->overflow;
+}
+
+static bool ac_symbol_add_row(ac_symbol_module_t* module, size_t* capacity, uintptr_t address, uint32_t file,
+                              uint32_t line) {
+    if (module->row_count == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 4096 : *capacity * 2;
+        ac_symbol_row_t* rows = realloc(module->rows, new_capacity * sizeof(ac_symbol_row_t));
+        if (rows == NULL) {
+            return false;
+        }
+        module->rows = rows;
+        *capacity = new_capacity;
+    }
+    module->rows[module->row_count++] = (ac_symbol_row_t){.address = address, .file = file, .line = line};
+    return true;
+}
+
+// Decodes one unit of .debug_line, returns false on malformed or unsupported
+// data, the rows read so far are kept
+static bool ac_symbol_read_unit(ac_symbol_module_t* module, ac_symbol_reader_t* reader, size_t* row_capacity,
+                                const ac_symbol_line_sections_t* sections) {
+    size_t offset_size = 4;
+    uint64_t unit_length = ac_symbol_read_u32(reader);
+    if (unit_length == 0xffffffff) {
+        offset_size = 8;
+        unit_length = ac_symbol_read_u64(reader);
+    }
+    if (reader->overflow || unit_length > (uint64_t)(reader->end - reader->pos)) {
+        return false;
+    }
+    ac_symbol_reader_t unit = {.pos = reader->pos, .end = reader->pos + unit_length};
+    reader->pos = unit.end;
+
+    uint16_t version = ac_symbol_read_u16(&unit);
+    if (version < 2 || version > 5) {
+        return true;
+    }
+    if (version == 5) {
+        ac_symbol_read_u8(&unit);  // Address size
+        ac_symbol_read_u8(&unit);  // Segment selector size
+    }
+    uint64_t header_length = ac_symbol_read_offset(&unit, offset_size);
+    if (unit.overflow || header_length > (uint64_t)(unit.end - unit.pos)) {
+        return false;
+    }
+    const uint8_t* program = unit.pos + header_length;
+    uint8_t min_instruction_length = ac_symbol_read_u8(&unit);
+    if (version >= 4) {
+        ac_symbol_read_u8(&unit);  // Max ops per instruction, only for VLIW
+    }
+    ac_symbol_read_u8(&unit);  // Default is_stmt, every row is kept
+    int8_t line_base = (int8_t)ac_symbol_read_u8(&unit);
+    uint8_t line_range = ac_symbol_read_u8(&unit);
+    uint8_t opcode_base = ac_symbol_read_u8(&unit);
+    const uint8_t* opcode_lengths = unit.pos;
+    if (line_range == 0 || opcode_base == 0 || !ac_symbol_read(&unit, NULL, opcode_base - 1)) {
+        return false;
+    }
+
+    // DWARF 5 counts files from 0, earlier versions from 1
+    size_t file_base = module->file_count;
+    if (version < 5) {
+        file_base--;
+    }
+    if (!ac_symbol_read_files(module, &unit, version, offset_size, sections)) {
+        return false;
+    }
+    unit.pos = program;
+
+    uintptr_t address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    while (unit.pos < unit.end && !unit.overflow) {
+        uint8_t opcode = ac_symbol_read_u8(&unit);
+        bool emit = false;
+        bool end_sequence = false;
+        if (opcode >= opcode_base) {
+            uint8_t adjusted = opcode - opcode_base;
+            address += (adjusted / line_range) * min_instruction_length;
+            line += line_base + adjusted % line_range;
+            emit = true;
+        } else if (opcode == 0) {
+            uint64_t length = ac_symbol_read_uleb(&unit);
+            if (length == 0 || length > (uint64_t)(unit.end - unit.pos)) {
+                return false;
+            }
+            const uint8_t* next = unit.pos + length;
+            uint8_t extended = ac_symbol_read_u8(&unit);
+            if (extended == DW_LNE_end_sequence) {
+                emit = true;
+                end_sequence = true;
+            } else if (extended == DW_LNE_set_address) {
+                address = length - 1 == 8 ? ac_symbol_read_u64(&unit) : ac_symbol_read_u32(&unit);
+            }
+            unit.pos = next;
+        } else {
+            switch (opcode) {
+                case DW_LNS_copy:
+                    emit = true;
+                    break;
+                case DW_LNS_advance_pc:
+                    address += ac_symbol_read_uleb(&unit) * min_instruction_length;
+                    break;
+                case DW_LNS_advance_line:
+                    line += ac_symbol_read_sleb(&unit);
+                    break;
+                case DW_LNS_set_file:
+                    file = ac_symbol_read_uleb(&unit);
+                    break;
+                case DW_LNS_const_add_pc:
+                    address += ((255 - opcode_base) / line_range) * min_instruction_length;
+                    break;
+                case DW_LNS_fixed_advance_pc:
+                    address += ac_symbol_read_u16(&unit);
+                    break;
+                default:
+                    // Operands of the other standard opcodes are skipped
+                    for (uint8_t i = 0; i < opcode_lengths[opcode - 1]; i++) {
+                        ac_symbol_read_uleb(&unit);
+                    }
+                    break;
+            }
+        }
+        if (!emit) {
+            continue;
+        }
+        uint32_t row_file = file_base + file < module->file_count ? (uint32_t)(file_base + file) : UINT32_MAX;
+        uint32_t row_line = end_sequence ? 0 : (line > 0 ? (uint32_t)line : 1);
+        if (!ac_symbol_add_row(module, row_capacity, address, row_file, row_line)) {
+            return false;
+        }
+        if (end_sequence) {
+            address = 0;
+            file = 1;
+            line = 1;
+        }
+    }
+    return !unit.overflow;
+}
+
+static int ac_symbol_row_compare(const void* a, const void* b) {
+    const ac_symbol_row_t* row_a = a;
+    const ac_symbol_row_t* row_b = b;
+    if (row_a->address != row_b->address) {
+        return row_a->address > row_b->address ? 1 : -1;
+    }
+    // A sequence ending where another starts must not hide it
+    return (row_a->line != 0) - (row_b->line != 0);
+}
+
+static void ac_symbol_load_lines(ac_symbol_module_t* module) {
+    module->lines_loaded = true;
+    if (module->image == NULL) {
+        return;
+    }
+    const ElfW(Shdr)* debug_line = ac_symbol_find_section(module, ".debug_line");
+    if (debug_line == NULL) {
+        return;
+    }
+    if (debug_line->sh_flags & SHF_COMPRESSED) {
+        ac_log_debug("Compressed line table in %s, no line info\n", module->path);
+        return;
+    }
+    size_t size = 0;
+    const uint8_t* data = ac_symbol_section_data(module, debug_line, &size);
+    if (data == NULL) {
+        return;
+    }
+    ac_symbol_line_sections_t sections = {0};
+    const ElfW(Shdr)* line_str = ac_symbol_find_section(module, ".debug_line_str");
+    if (line_str != NULL && !(line_str->sh_flags & SHF_COMPRESSED)) {
+        sections.line_str = (const char*)ac_symbol_section_data(module, line_str, &sections.line_str_size);
+    }
+    const ElfW(Shdr)* str = ac_symbol_find_section(module, ".debug_str");
+    if (str != NULL && !(str->sh_flags & SHF_COMPRESSED)) {
+        sections.str = (const char*)ac_symbol_section_data(module, str, &sections.str_size);
+    }
+
+    ac_symbol_reader_t reader = {.pos = data, .end = data + size};
+    size_t row_capacity = 0;
+    while (reader.pos < reader.end) {
+        if (!ac_symbol_read_unit(module, &reader, &row_capacity, &sections)) {
+            ac_log_debug("Malformed line table in %s, line info is partial\n", module->path);
+            break;
+        }
+    }
+    qsort(module->rows, module->row_count, sizeof(ac_symbol_row_t), ac_symbol_row_compare);
+}
+
+// Lookup
+
+static const ac_symbol_entry_t* ac_symbol_find_entry(const ac_symbol_module_t* module, uintptr_t address) {
+    size_t low = 0;
+    size_t high = module->entry_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (module->entries[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    const ac_symbol_entry_t* entry = &module->entries[low - 1];
+    if (entry->size != 0 && address - entry->address >= entry->size) {
+        return NULL;
+    }
+    return entry;
+}
+
+static const ac_symbol_row_t* ac_symbol_find_row(const ac_symbol_module_t* module, uintptr_t address) {
+    size_t low = 0;
+    size_t high = module->row_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (module->rows[mid].address <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0 || module->rows[low - 1].line == 0 || module->rows[low - 1].file == UINT32_MAX) {
+        return NULL;
+    }
+    return &module->rows[low - 1];
+}
+
+bool ac_symbol_resolve(const void* addr, ac_symbol_t* symbol) {
+    memset(symbol, 0, sizeof(ac_symbol_t));
+    uintptr_t address = (uintptr_t)addr;
+
+    pthread_mutex_lock(&ac_symbol_lock);
+    ac_symbol_module_t* module = ac_symbol_find_module(address);
+    if (module == NULL && ac_symbol_refresh_modules()) {
+        module = ac_symbol_find_module(address);
+    }
+    if (module == NULL) {
+        pthread_mutex_unlock(&ac_symbol_lock);
+        return false;
+    }
+    if (!module->loaded) {
+        ac_symbol_load_module(module);
+    }
+    uintptr_t module_address = address - module->bias;
+    symbol->module = module->path;
+    symbol->module_offset = module_address;
+
+    const ac_symbol_entry_t* entry = ac_symbol_find_entry(module, module_address);
+    if (entry != NULL) {
+        symbol->function = entry->name;
+        symbol->offset = module_address - entry->address;
+    }
+    if (ac_symbol_line_info) {
+        if (!module->lines_loaded) {
+            ac_symbol_load_lines(module);
+        }
+        const ac_symbol_row_t* row = ac_symbol_find_row(module, module_address);
+        if (row != NULL) {
+            symbol->file = module->files[row->file].name;
+            symbol->directory = module->files[row->file].directory;
+            symbol->line = row->line;
+        }
+    }
+    pthread_mutex_unlock(&ac_symbol_lock);
+    return symbol->function != NULL;
+}
+
+static const char* ac_symbol_strip_pwd(const char* path) {
+    const char* pwd = getenv("PWD");
+    if (pwd == NULL || pwd[0] == '\0') {
+        return path;
+    }
+    size_t len = strlen(pwd);
+    if (strncmp(path, pwd, len) == 0 && path[len] == '/') {
+        return path + len + 1;
+    }
+    return path;
+}
+
+int ac_symbol_sprint(const ac_symbol_t* symbol, char* buffer, size_t size) {
+    int len;
+    if (symbol->function != NULL && symbol->file != NULL) {
+        char path[1024];
+        if (symbol->directory != NULL) {
+            snprintf(path, sizeof(path), "%s/%s", symbol->directory, symbol->file);
+        } else {
+            snprintf(path, sizeof(path), "%s", symbol->file);
+        }
+        len = snprintf(buffer, size, "%s at %s:%u", symbol->function, ac_symbol_strip_pwd(path), symbol->line);
+    } else if (symbol->module != NULL) {
+        const char* module = strrchr(symbol->module, '/');
+        module = module != NULL ? module + 1 : symbol->module;
+        if (symbol->function != NULL) {
+            len = snprintf(buffer, size, "%s+0x%zx (%s)", symbol->function, (size_t)symbol->offset, module);
+        } else {
+            len = snprintf(buffer, size, "?? (%s+0x%zx)", module, (size_t)symbol->module_offset);
+        }
+    } else {
+        len = snprintf(buffer, size, "??");
+    }
+    if (len < 0) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return (size_t)len < size ? len : (int)(size - 1);
+}
+
+// Cache
+
+static size_t ac_symbol_cache_slot(uintptr_t address) {
+    uint64_t hash = (uint64_t)address * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(hash >> 32) & (AC_SYMBOL_CACHE_SIZE - 1);
+}
+
+// Returns the slot of address, claiming a free one when insert is set, NULL if
+// the address isn't there or the table is full
+static ac_symbol_cache_entry_t* ac_symbol_cache_find(uintptr_t address, bool insert) {
+    size_t slot = ac_symbol_cache_slot(address);
+    for (size_t probe = 0; probe < AC_SYMBOL_CACHE_SIZE; probe++) {
+        ac_symbol_cache_entry_t* entry = &ac_symbol_cache[(slot + probe) & (AC_SYMBOL_CACHE_SIZE - 1)];
+        uintptr_t current = atomic_load_explicit(&entry->address, memory_order_acquire);
+        if (current == address) {
+            return entry;
+        }
+        if (current != 0) {
+            continue;
+        }
+        if (!insert) {
+            return NULL;
+        }
+        // Kept under three quarters full so probes stay short
+        if (atomic_fetch_add_explicit(&ac_symbol_cache_count, 1, memory_order_relaxed) >= AC_SYMBOL_CACHE_SIZE / 4 * 3) {
+            atomic_fetch_sub_explicit(&ac_symbol_cache_count, 1, memory_order_relaxed);
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong_explicit(&entry->address, &current, address, memory_order_acq_rel,
+                                                    memory_order_acquire)) {
+            return entry;
+        }
+        atomic_fetch_sub_explicit(&ac_symbol_cache_count, 1, memory_order_relaxed);
+        if (current == address) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int ac_symbol_copy_line(const char* line, char* buffer, size_t size) {
+    size_t len = strlen(line);
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(buffer, line, len);
+    buffer[len] = '\0';
+    return (int)len;
+}
+
+int ac_symbol_sprint_address(const void* addr, char* buffer, size_t size) {
+    uintptr_t address = (uintptr_t)addr;
+    ac_symbol_cache_entry_t* entry = ac_symbol_cache_find(address, true);
+    if (entry != NULL) {
+        const char* line = atomic_load_explicit(&entry->line, memory_order_acquire);
+        if (line != NULL) {
+            return ac_symbol_copy_line(line, buffer, size);
+        }
+    }
+
+    ac_symbol_t symbol;
+    ac_symbol_resolve(addr, &symbol);
+    char line[1024];
+    ac_symbol_sprint(&symbol, line, sizeof(line));
+    if (entry != NULL) {
+        // Racing threads resolve the same line, the first one is kept
+        char* copy = strdup(line);
+        const char* expected = NULL;
+        if (copy != NULL && !atomic_compare_exchange_strong_explicit(&entry->line, &expected, copy,
+                                                                     memory_order_acq_rel, memory_order_acquire)) {
+            free(copy);
+        }
+    }
+    return ac_symbol_copy_line(line, buffer, size);
+}
+
+int ac_symbol_sprint_cached(const void* addr, char* buffer, size_t size) {
+    ac_symbol_cache_entry_t* entry = ac_symbol_cache_find((uintptr_t)addr, false);
+    const char* line = entry != NULL ? atomic_load_explicit(&entry->line, memory_order_acquire) : NULL;
+    if (line != NULL) {
+        return ac_symbol_copy_line(line, buffer, size);
+    }
+    int len = snprintf(buffer, size, "%p", addr);
+    if (len < 0) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return (size_t)len < size ? len : (int)(size - 1);
+}
@@ -0,0 +1,349 @@
+#include "core/ac_tcache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core/ac_log.h"
+#include "core/ac_mem.h"
+
+// Written in front of every block. next links free blocks in the caches and
+// the central heap, size is the requested size of a live block.
+typedef struct ac_tcache_prefix_t {
+    union {
+        struct ac_tcache_prefix_t* next;
+        size_t size;
+    };
+    uint32_t class_index;
+    uint32_t padding;
+} ac_tcache_prefix_t;
+
+_Static_assert(sizeof(ac_tcache_prefix_t) == 16, "ac_tcache_prefix_t must keep blocks 16 byte aligned");
+
+// Class of blocks too large for the size classes
+#define AC_TCACHE_LARGE AC_TCACHE_CLASS_COUNT
+
+// Smallest span carved into blocks of a class
+#define AC_TCACHE_SPAN_SIZE (64 * 1024)
+
+typedef struct ac_tcache_central_t {
+    pthread_mutex_t lock;
+    ac_tcache_prefix_t* free_list;
+    uint8_t* bump;
+    uint8_t* bump_end;
+    size_t span_bytes;
+} ac_tcache_central_t;
+
+typedef struct ac_tcache_bin_t {
+    ac_tcache_prefix_t* head;
+    uint32_t count;
+} ac_tcache_bin_t;
+
+// Cache of one thread. The counters are only written by the owning thread.
+// Records of exited threads are drained and stay registered to be reused.
+typedef struct ac_tcache_thread_t {
+    ac_tcache_bin_t bins[AC_TCACHE_CLASS_COUNT];
+    atomic_size_t alloc_count;
+    atomic_size_t free_count;
+    atomic_size_t large_count;
+    atomic_size_t refill_count;
+    atomic_size_t flush_count;
+    atomic_size_t cached_bytes;
+    bool exited;
+    struct ac_tcache_thread_t* next;
+} ac_tcache_thread_t;
+
+static ac_tcache_central_t ac_tcache_centrals[AC_TCACHE_CLASS_COUNT];
+static pthread_once_t ac_tcache_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t ac_tcache_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_tcache_thread_t* ac_tcache_threads = NULL;
+static pthread_key_t ac_tcache_thread_key;
+static _Thread_local ac_tcache_thread_t* ac_tcache_thread_local = NULL;
+
+// 16 byte steps up to 128, then 4 classes per power of two up to 32K
+static inline size_t ac_tcache_class_of(size_t total) {
+    if (total <= 128) {
+        return (total + 15) / 16 - 1;
+    }
+    size_t shift = 63 - (size_t)__builtin_clzll((unsigned long long)(total - 1));
+    return 8 + (shift - 7) * 4 + ((total - 1) >> (shift - 2)) - 4;
+}
+
+static inline size_t ac_tcache_class_size(size_t class_index) {
+    if (class_index < 8) {
+        return (class_index + 1) * 16;
+    }
+    size_t shift = 7 + (class_index - 8) / 4;
+    return (5 + (class_index - 8) % 4) << (shift - 2);
+}
+
+// Blocks a thread keeps per class, about 64K worth, between 4 and 64
+static inline uint32_t ac_tcache_bin_limit(size_t class_index) {
+    size_t limit = AC_TCACHE_SPAN_SIZE / ac_tcache_class_size(class_index);
+    return limit < 4 ? 4 : limit > 64 ? 64 : (uint32_t)limit;
+}
+
+// Single writer counter bump
+static inline void ac_tcache_counter_add(atomic_size_t* counter, size_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void ac_tcache_counter_sub(atomic_size_t* counter, size_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - value, memory_order_relaxed);
+}
+
+// Gives count blocks of a bin back to the central heap
+static void ac_tcache_flush(ac_tcache_thread_t* thread, size_t class_index, uint32_t count) {
+    ac_tcache_bin_t* bin = &thread->bins[class_index];
+    ac_tcache_prefix_t* first = bin->head;
+    ac_tcache_prefix_t* last = first;
+    for (uint32_t i = 1; i < count; i++) {
+        last = last->next;
+    }
+    bin->head = last->next;
+    bin->count -= count;
+    ac_tcache_counter_sub(&thread->cached_bytes, count * ac_tcache_class_size(class_index));
+    ac_tcache_counter_add(&thread->flush_count, 1);
+
+    ac_tcache_central_t* central = &ac_tcache_centrals[class_index];
+    pthread_mutex_lock(&central->lock);
+    last->next = central->free_list;
+    central->free_list = first;
+    pthread_mutex_unlock(&central->lock);
+}
+
+static void ac_tcache_thread_exit(void* value) {
+    ac_tcache_thread_t* thread = value;
+    for (size_t i = 0; i < AC_TCACHE_CLASS_COUNT; i++) {
+        if (thread->bins[i].count != 0) {
+            ac_tcache_flush(thread, i, thread->bins[i].count);
+        }
+    }
+    // Frees made by later destructors get a record of their own
+    ac_tcache_thread_local = NULL;
+    pthread_mutex_lock(&ac_tcache_threads_lock);
+    thread->exited = true;
+    pthread_mutex_unlock(&ac_tcache_threads_lock);
+}
+
+static void ac_tcache_init(void) {
+    for (size_t i = 0; i < AC_TCACHE_CLASS_COUNT; i++) {
+        pthread_mutex_init(&ac_tcache_centrals[i].lock, NULL);
+    }
+    pthread_key_create(&ac_tcache_thread_key, ac_tcache_thread_exit);
+}
+
+static __attribute__((noinline)) ac_tcache_thread_t* ac_tcache_thread_new(void) {
+    pthread_once(&ac_tcache_once, ac_tcache_init);
+    pthread_mutex_lock(&ac_tcache_threads_lock);
+    ac_tcache_thread_t* thread = ac_tcache_threads;
+    while (thread != NULL && !thread->exited) {
+        thread = thread->next;
+    }
+    if (thread != NULL) {
+        thread->exited = false;
+    } else {
+        // The allocator can be ac_malloc itself, its own state comes from the system
+        thread = calloc(1, sizeof(ac_tcache_thread_t));
+        if (thread == NULL) {
+            pthread_mutex_unlock(&ac_tcache_threads_lock);
+            ac_log_fatal_exit("Failed to allocate thread cache\n");
+        }
+        thread->next = ac_tcache_threads;
+        ac_tcache_threads = thread;
+    }
+    pthread_mutex_unlock(&ac_tcache_threads_lock);
+    pthread_setspecific(ac_tcache_thread_key, thread);
+    ac_tcache_thread_local = thread;
+    return thread;
+}
+
+static inline ac_tcache_thread_t* ac_tcache_thread_get(void) {
+    ac_tcache_thread_t* thread = ac_tcache_thread_local;
+    return thread != NULL ? thread : ac_tcache_thread_new();
+}
+
+// Moves half a bin worth of blocks from the central heap, carving a new span
+// when its free list runs dry
+static bool ac_tcache_refill(ac_tcache_thread_t* thread, size_t class_index) {
+    ac_tcache_central_t* central = &ac_tcache_centrals[class_index];
+    ac_tcache_bin_t* bin = &thread->bins[class_index];
+    size_t block_size = ac_tcache_class_size(class_index);
+    uint32_t want = ac_tcache_bin_limit(class_index) / 2;
+
+    pthread_mutex_lock(&central->lock);
+    uint32_t count = 0;
+    while (count < want) {
+        ac_tcache_prefix_t* block = central->free_list;
+        if (block != NULL) {
+            central->free_list = block->next;
+        } else {
+            if (central->bump == NULL || central->bump + block_size > central->bump_end) {
+                size_t span_size = block_size * 8 > AC_TCACHE_SPAN_SIZE ? block_size * 8 : AC_TCACHE_SPAN_SIZE;
+                uint8_t* span = malloc(span_size);
+                if (span == NULL) {
+                    break;
+                }
+                central->bump = span;
+                central->bump_end = span + span_size;
+                central->span_bytes += span_size;
+            }
+            block = (ac_tcache_prefix_t*)central->bump;
+            block->class_index = (uint32_t)class_index;
+            central->bump += block_size;
+        }
+        block->next = bin->head;
+        bin->head = block;
+        count++;
+    }
+    pthread_mutex_unlock(&central->lock);
+
+    bin->count += count;
+    ac_tcache_counter_add(&thread->cached_bytes, count * block_size);
+    ac_tcache_counter_add(&thread->refill_count, 1);
+    return count != 0;
+}
+
+void* ac_tcache_malloc(size_t size) {
+    ac_tcache_thread_t* thread = ac_tcache_thread_get();
+    ac_tcache_counter_add(&thread->alloc_count, 1);
+    if (size > AC_TCACHE_MAX_SIZE - sizeof(ac_tcache_prefix_t)) {
+        if (size > SIZE_MAX - sizeof(ac_tcache_prefix_t)) {
+            return NULL;
+        }
+        ac_tcache_prefix_t* block = malloc(sizeof(ac_tcache_prefix_t) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = size;
+        block->class_index = AC_TCACHE_LARGE;
+        ac_tcache_counter_add(&thread->large_count, 1);
+        return block + 1;
+    }
+
+    size_t class_index = ac_tcache_class_of(sizeof(ac_tcache_prefix_t) + size);
+    ac_tcache_bin_t* bin = &thread->bins[class_index];
+    if (bin->count == 0 && !ac_tcache_refill(thread, class_index)) {
+        return NULL;
+    }
+    ac_tcache_prefix_t* block = bin->head;
+    bin->head = block->next;
+    bin->count--;
+    ac_tcache_counter_sub(&thread->cached_bytes, ac_tcache_class_size(class_index));
+    block->size = size;
+    return block + 1;
+}
+
+void ac_tcache_free(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    ac_tcache_thread_t* thread = ac_tcache_thread_get();
+    ac_tcache_counter_add(&thread->free_count, 1);
+    ac_tcache_prefix_t* block = (ac_tcache_prefix_t*)ptr - 1;
+    size_t class_index = block->class_index;
+    if (class_index == AC_TCACHE_LARGE) {
+        free(block);
+        return;
+    }
+
+    ac_tcache_bin_t* bin = &thread->bins[class_index];
+    uint32_t limit = ac_tcache_bin_limit(class_index);
+    if (bin->count == limit) {
+        ac_tcache_flush(thread, class_index, limit / 2);
+    }
+    block->next = bin->head;
+    bin->head = block;
+    bin->count++;
+    ac_tcache_counter_add(&thread->cached_bytes, ac_tcache_class_size(class_index));
+}
+
+void* ac_tcache_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    void* ptr = ac_tcache_malloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+void* ac_tcache_realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return ac_tcache_malloc(size);
+    }
+    ac_tcache_prefix_t* block = (ac_tcache_prefix_t*)ptr - 1;
+    size_t class_index = block->class_index;
+    if (class_index == AC_TCACHE_LARGE) {
+        if (size > AC_TCACHE_MAX_SIZE - sizeof(ac_tcache_prefix_t)) {
+            if (size > SIZE_MAX - sizeof(ac_tcache_prefix_t)) {
+                return NULL;
+            }
+            block = realloc(block, sizeof(ac_tcache_prefix_t) + size);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->size = size;
+            return block + 1;
+        }
+    } else if (sizeof(ac_tcache_prefix_t) + size <= ac_tcache_class_size(class_index)) {
+        block->size = size;
+        return ptr;
+    }
+
+    void* new_ptr = ac_tcache_malloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, block->size < size ? block->size : size);
+    ac_tcache_free(ptr);
+    return new_ptr;
+}
+
+void ac_tcache_install(void) {
+    set_custom_malloc(ac_tcache_malloc);
+    set_custom_free(ac_tcache_free);
+    set_custom_calloc(ac_tcache_calloc);
+    set_custom_realloc(ac_tcache_realloc);
+}
+
+static void ac_tcache_read_stats(ac_tcache_thread_t* thread, ac_tcache_stats_t* stats) {
+    stats->alloc_count = atomic_load_explicit(&thread->alloc_count, memory_order_relaxed);
+    stats->free_count = atomic_load_explicit(&thread->free_count, memory_order_relaxed);
+    stats->large_count = atomic_load_explicit(&thread->large_count, memory_order_relaxed);
+    stats->refill_count = atomic_load_explicit(&thread->refill_count, memory_order_relaxed);
+    stats->flush_count = atomic_load_explicit(&thread->flush_count, memory_order_relaxed);
+    stats->cached_bytes = atomic_load_explicit(&thread->cached_bytes, memory_order_relaxed);
+}
+
+void ac_tcache_get_stats(ac_tcache_stats_t* stats) { ac_tcache_read_stats(ac_tcache_thread_get(), stats); }
+
+void ac_tcache_show_usage(void) {
+    pthread_mutex_lock(&ac_tcache_threads_lock);
+    if (ac_tcache_threads == NULL) {
+        pthread_mutex_unlock(&ac_tcache_threads_lock);
+        return;
+    }
+    size_t index = 0;
+    for (ac_tcache_thread_t* thread = ac_tcache_threads; thread != NULL; thread = thread->next, index++) {
+        ac_tcache_stats_t stats;
+        ac_tcache_read_stats(thread, &stats);
+        ac_log_info("Thread cache %zu%s: allocs %zu (%zu large), frees %zu, refills %zu, flushes %zu, cached %zu bytes\n", index,
+                    thread->exited ? " (exited)" : "", stats.alloc_count, stats.large_count, stats.free_count,
+                    stats.refill_count, stats.flush_count, stats.cached_bytes);
+    }
+    pthread_mutex_unlock(&ac_tcache_threads_lock);
+
+    size_t span_bytes = 0;
+    for (size_t i = 0; i < AC_TCACHE_CLASS_COUNT; i++) {
+        pthread_mutex_lock(&ac_tcache_centrals[i].lock);
+        span_bytes += ac_tcache_centrals[i].span_bytes;
+        pthread_mutex_unlock(&ac_tcache_centrals[i].lock);
+    }
+    ac_log_info("Thread cache central heap: %zu bytes of spans\n", span_bytes);
+}
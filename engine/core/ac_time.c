@@ -0,0 +1,53 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "core/ac_time.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define AC_TIME_CALIBRATION_NS 10000000ull
+
+// Pairs of ticks and nanoseconds read back to back, the rate of the tick
+// counter is the slope between the two
+static pthread_once_t ac_time_init_once = PTHREAD_ONCE_INIT;
+static pthread_once_t ac_time_rate_once = PTHREAD_ONCE_INIT;
+static uint64_t ac_time_base_ticks;
+static uint64_t ac_time_base_ns;
+static double ac_time_ns_per_tick = 1.0;
+
+uint64_t ac_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void ac_time_set_base(void) {
+    ac_time_base_ns = ac_time_ns();
+    ac_time_base_ticks = ac_time_ticks();
+}
+
+void ac_time_init(void) { pthread_once(&ac_time_init_once, ac_time_set_base); }
+
+static void ac_time_measure_rate(void) {
+    ac_time_init();
+    uint64_t ns = ac_time_ns();
+    while (ns - ac_time_base_ns < AC_TIME_CALIBRATION_NS) {
+        ns = ac_time_ns();
+    }
+    uint64_t ticks = ac_time_ticks();
+    if (ticks > ac_time_base_ticks) {
+        ac_time_ns_per_tick = (double)(ns - ac_time_base_ns) / (double)(ticks - ac_time_base_ticks);
+    }
+}
+
+uint64_t ac_time_ticks_to_ns(uint64_t ticks) {
+    pthread_once(&ac_time_rate_once, ac_time_measure_rate);
+    double delta = ((double)ticks - (double)ac_time_base_ticks) * ac_time_ns_per_tick;
+    return (uint64_t)((double)ac_time_base_ns + delta);
+}
+
+uint64_t ac_time_ns_to_ticks(uint64_t ns) {
+    pthread_once(&ac_time_rate_once, ac_time_measure_rate);
+    double ticks = (double)ac_time_base_ticks + ((double)ns - (double)ac_time_base_ns) / ac_time_ns_per_tick;
+    return ticks > 0.0 ? (uint64_t)ticks : 0;
+}
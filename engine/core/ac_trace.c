@@ -4,21 +4,150 @@
 #include <stdlib.h>
 #include <string.h>
 #include <execinfo.h>
-#include <sys/wait.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <dlfcn.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include "core/ac_trace.h"
+#include "core/ac_symbol.h"
 
-static char prg_name[1024];
+#define MAX_STACK_FRAMES 64
 
-void ac_print_trace(size_t offset) { ac_fprint_trace(stdout, offset); }
+#ifdef AC_TRACE_FRAME_POINTERS
+static _Atomic int ac_trace_unwinder = AC_TRACE_UNWINDER_FRAME_POINTER;
+#else
+static _Atomic int ac_trace_unwinder = AC_TRACE_UNWINDER_BACKTRACE;
+#endif
+static atomic_size_t ac_trace_depth = 0;
 
-int ac_fprint_trace(FILE *fp, size_t offset) {
-    char buffer[1024];
-    int len = ac_sprint_trace(buffer, offset);
+// Bounds of the stack of the thread, frame pointers outside are garbage
+static _Thread_local uintptr_t ac_trace_stack_low = 0;
+static _Thread_local uintptr_t ac_trace_stack_high = 0;
+
+void ac_trace_set_unwinder(ac_trace_unwinder_t unwinder, size_t depth) {
+    atomic_store_explicit(&ac_trace_depth, depth, memory_order_relaxed);
+    atomic_store_explicit(&ac_trace_unwinder, unwinder, memory_order_relaxed);
+}
+
+ac_trace_unwinder_t ac_trace_get_unwinder(void) { return atomic_load_explicit(&ac_trace_unwinder, memory_order_relaxed); }
+
+__attribute__((noinline)) void *ac_trace_pc(void) { return __builtin_return_address(0); }
+
+static void ac_trace_stack_bounds(void) {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        void *addr;
+        size_t size;
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            ac_trace_stack_low = (uintptr_t)addr;
+            ac_trace_stack_high = (uintptr_t)addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (ac_trace_stack_high == 0) {
+        // Only trust frames above the current one
+        ac_trace_stack_low = (uintptr_t)__builtin_frame_address(0);
+        ac_trace_stack_high = UINTPTR_MAX;
+    }
+}
+
+// The first frame is the one of the caller, as with backtrace. Each frame
+// starts with the saved frame pointer of its caller followed by the return
+// address. Frames only go up the stack, anything else ends the walk.
+static __attribute__((noinline)) int ac_trace_walk_frames(void **stack, size_t size) {
+    if (ac_trace_stack_high == 0) {
+        ac_trace_stack_bounds();
+    }
+    uintptr_t *frame = __builtin_frame_address(0);
+    size_t count = 0;
+    while (count < size) {
+        uintptr_t address = (uintptr_t)frame;
+        if (address < ac_trace_stack_low || address > ac_trace_stack_high - 2 * sizeof(uintptr_t) ||
+            (address & (sizeof(uintptr_t) - 1)) != 0) {
+            break;
+        }
+        void *ret = (void *)frame[1];
+        if (ret == NULL) {
+            break;
+        }
+        stack[count++] = ret;
+        uintptr_t *next = (uintptr_t *)frame[0];
+        if (next <= frame) {
+            break;
+        }
+        frame = next;
+    }
+    return (int)count;
+}
+
+// Never inlined nor turned into tail calls, the first frame is always in this
+// function whatever the optimization level, which the fixed frame skips of the
+// callers rely on
+__attribute__((noinline)) int ac_get_intermediate_trace(void **stack, size_t size) {
+    size_t depth = atomic_load_explicit(&ac_trace_depth, memory_order_relaxed);
+    if (depth != 0 && depth < size) {
+        size = depth;
+    }
+    int count;
+    switch (ac_trace_get_unwinder()) {
+        case AC_TRACE_UNWINDER_FRAME_POINTER:
+            count = ac_trace_walk_frames(stack, size);
+            break;
+        case AC_TRACE_UNWINDER_CALLER:
+            if (size < 2) {
+                return 0;
+            }
+            stack[0] = ac_trace_pc();
+            stack[1] = __builtin_return_address(0);
+            count = 2;
+            break;
+        default:
+            count = backtrace(stack, size);
+            break;
+    }
+    // Keeps the calls above from being tail calls
+    __asm__ volatile("" ::: "memory");
+    return count;
+}
+
+static bool ac_trace_is_main(const char *line) { return strncmp(line, "main ", 5) == 0 || strncmp(line, "main+", 5) == 0; }
+
+// Prints one frame per line, up to main. Cached only prints from the symbol
+// cache and raw addresses, for the fatal paths.
+static int ac_sprint_frames(void **stack, size_t start, size_t size, char *buffer, bool cached_only) {
+    size_t len = 0;
+    buffer[0] = '\0';
+    for (size_t i = start; i < size && len + 1 < AC_TRACE_BUFFER_SIZE; i++) {
+        if (len != 0) {
+            buffer[len++] = '\n';
+        }
+        // Return addresses point after the call
+        void *addr = (char *)stack[i] - 1;
+        char *line = buffer + len;
+        if (cached_only) {
+            len += ac_symbol_sprint_cached(addr, line, AC_TRACE_BUFFER_SIZE - len);
+        } else {
+            len += ac_symbol_sprint_address(addr, line, AC_TRACE_BUFFER_SIZE - len);
+        }
+        // Stop at main
+        if (ac_trace_is_main(line)) {
+            break;
+        }
+    }
+    buffer[len] = '\0';
+    return len;
+}
+
+// Inlined so the frames skipped by offset are the same for every variant
+static inline __attribute__((always_inline)) int ac_sprint_trace_impl(char *buffer, size_t offset, bool cached_only) {
+    void *stack[MAX_STACK_FRAMES];
+    int size = backtrace(stack, MAX_STACK_FRAMES);
+    return ac_sprint_frames(stack, offset, size, buffer, cached_only);
+}
+
+static inline __attribute__((always_inline)) int ac_fprint_trace_impl(FILE *fp, char *buffer, int len) {
     if (len < 0) {
         return -1;
     }
@@ -26,120 +155,342 @@ int ac_fprint_trace(FILE *fp, size_t offset) {
     return len;
 }
 
-#define MAX_STACK_FRAMES 64
-void *buffer[MAX_STACK_FRAMES];
+void ac_print_trace(size_t offset) { ac_fprint_trace(stdout, offset); }
 
-int ac_get_intermediate_trace(void **stack, size_t size) { return backtrace(stack, size); }
+int ac_fprint_trace(FILE *fp, size_t offset) {
+    char buffer[AC_TRACE_BUFFER_SIZE];
+    return ac_fprint_trace_impl(fp, buffer, ac_sprint_trace(buffer, offset));
+}
 
 int ac_sprint_intermediate_trace(void **stack, char *buffer, size_t offset, size_t size) {
-    size_t prg_len = readlink("/proc/self/exe", prg_name, 1024);
-    prg_name[prg_len] = '\0';
-    buffer[0] = '\0';
-    char tmp[1024];
-    for (size_t i = offset + 1; i < size; i++) {
-        // Execute addr2line and get prettified names
-        char addr2line_cmd[512];
-        void *addr = stack[i] - 1;
-        Dl_info info;
-        if (dladdr(addr, &info) != 0) {
-            void *offset = (void *)((char *)addr - (char *)info.dli_fbase);
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", info.dli_fname, offset);
-        } else {
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", prg_name, addr);
-        }
-        char line[512];
-        FILE *addr2line = popen(addr2line_cmd, "r");
-        fgets(line, 512, addr2line);
-        pclose(addr2line);
-        if (line[0] == '?') {
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", prg_name, addr);
-            FILE *addr2line = popen(addr2line_cmd, "r");
-            fgets(line, 512, addr2line);
-            pclose(addr2line);
-        }
-        // Remove pwd from path
-        char *pwd = getenv("PWD");
-        char *pwd_pos = strstr(line, pwd);
-        if (pwd_pos != NULL) {
-            // Preserve text before pwd
-            char *line_pos = line;
-            char *pwd_pos = strstr(line, pwd);
-            while (line_pos != pwd_pos) {
-                strncat(buffer, line_pos, 1);
-                line_pos++;
-            }
-            // Skip pwd
-            line_pos += strlen(pwd);
-            // Skip slash
-            line_pos++;
-            // Print rest of line
-            sprintf(tmp, "%s", line_pos);
-        } else {
-            sprintf(tmp, "%s", line);
+    return ac_sprint_frames(stack, offset + 1, size, buffer, false);
+}
+
+int ac_sprint_trace(char *buff, size_t offset) { return ac_sprint_trace_impl(buff, offset, false); }
+
+void ac_print_trace_cached(size_t offset) { ac_fprint_trace_cached(stdout, offset); }
+
+int ac_fprint_trace_cached(FILE *fp, size_t offset) {
+    char buffer[AC_TRACE_BUFFER_SIZE];
+    return ac_fprint_trace_impl(fp, buffer, ac_sprint_trace_cached(buffer, offset));
+}
+
+int ac_sprint_intermediate_trace_cached(void **stack, char *buffer, size_t offset, size_t size) {
+    return ac_sprint_frames(stack, offset + 1, size, buffer, true);
+}
+
+int ac_sprint_trace_cached(char *buff, size_t offset) { return ac_sprint_trace_impl(buff, offset, true); }
+
+// Deferred symbolizer
+// Traces are copied to a FIFO of jobs drained by a thread started on first
+// use. The thread symbolizes through the symbol cache, so once it's done the
+// fatal paths find the lines too.
+
+typedef struct ac_trace_job_t {
+    struct ac_trace_job_t *next;
+    FILE *fp;
+    size_t size;
+    void *frames[];
+} ac_trace_job_t;
+
+static pthread_once_t ac_trace_worker_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ac_trace_worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ac_trace_worker_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ac_trace_worker_idle = PTHREAD_COND_INITIALIZER;
+static ac_trace_job_t *ac_trace_jobs_head = NULL;
+static ac_trace_job_t *ac_trace_jobs_tail = NULL;
+static size_t ac_trace_jobs_pending = 0;
+static bool ac_trace_worker_running = false;
+
+static void *ac_trace_worker(void *arg) {
+    (void)arg;
+    char buffer[AC_TRACE_BUFFER_SIZE];
+    pthread_mutex_lock(&ac_trace_worker_lock);
+    for (;;) {
+        while (ac_trace_jobs_head == NULL) {
+            pthread_cond_wait(&ac_trace_worker_wake, &ac_trace_worker_lock);
         }
-        strcat(buffer, tmp);
-        // Stop at main
-        if (strstr(line, "main at") != NULL) {
-            break;
+        ac_trace_job_t *job = ac_trace_jobs_head;
+        ac_trace_jobs_head = job->next;
+        if (ac_trace_jobs_head == NULL) {
+            ac_trace_jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&ac_trace_worker_lock);
+
+        ac_sprint_frames(job->frames, 0, job->size, buffer, false);
+        if (job->fp != NULL) {
+            fprintf(job->fp, "%s\n", buffer);
+        }
+        free(job);
+
+        pthread_mutex_lock(&ac_trace_worker_lock);
+        if (--ac_trace_jobs_pending == 0) {
+            pthread_cond_broadcast(&ac_trace_worker_idle);
         }
     }
-    buffer[strlen(buffer) - 1] = '\0';
-    return strlen(buffer);
-}
-
-int ac_sprint_trace(char *buff, size_t offset) {
-    size_t prg_len = readlink("/proc/self/exe", prg_name, 1024);
-    prg_name[prg_len] = '\0';
-    buff[0] = '\0';
-    int size = backtrace(buffer, MAX_STACK_FRAMES);
-    char tmp[1024];
-    for (int i = offset; i < size; i++) {
-        // Execute addr2line and get prettified names
-        char addr2line_cmd[512];
-        void *addr = buffer[i] - 1;
-        Dl_info info;
-        if (dladdr(addr, &info) != 0) {
-            void *offset = (void *)((char *)addr - (char *)info.dli_fbase);
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", info.dli_fname, offset);
-        } else {
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", prg_name, addr);
-        }
-        char line[512];
-        FILE *addr2line = popen(addr2line_cmd, "r");
-        fgets(line, 512, addr2line);
-        pclose(addr2line);
-        if (line[0] == '?') {
-            sprintf(addr2line_cmd, "addr2line -p -f -e %s %p", prg_name, addr);
-            FILE *addr2line = popen(addr2line_cmd, "r");
-            fgets(line, 512, addr2line);
-            pclose(addr2line);
-        }
-        // Remove pwd from path
-        char *pwd = getenv("PWD");
-        char *pwd_pos = strstr(line, pwd);
-        if (pwd_pos != NULL) {
-            // Preserve text before pwd
-            char *line_pos = line;
-            char *pwd_pos = strstr(line, pwd);
-            while (line_pos != pwd_pos) {
-                strncat(buff, line_pos, 1);
-                line_pos++;
-            }
-            // Skip pwd
-            line_pos += strlen(pwd);
-            // Skip slash
-            line_pos++;
-            // Print rest of line
-            sprintf(tmp, "%s", line_pos);
-        } else {
-            sprintf(tmp, "%s", line);
+    return NULL;
+}
+
+static void ac_trace_worker_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ac_trace_worker, NULL) == 0) {
+        pthread_detach(thread);
+        ac_trace_worker_running = true;
+    }
+}
+
+static void ac_trace_defer(FILE *fp, void **stack, size_t start, size_t size) {
+    if (start >= size) {
+        return;
+    }
+    pthread_once(&ac_trace_worker_once, ac_trace_worker_start);
+    ac_trace_job_t *job = ac_trace_worker_running ? malloc(sizeof(ac_trace_job_t) + (size - start) * sizeof(void *)) : NULL;
+    if (job == NULL) {
+        // No thread to hand it to, do it here
+        if (fp != NULL) {
+            char buffer[AC_TRACE_BUFFER_SIZE];
+            ac_sprint_frames(stack, start, size, buffer, false);
+            fprintf(fp, "%s\n", buffer);
         }
-        strcat(buff, tmp);
-        // Stop at main
-        if (strstr(line, "main at") != NULL) {
-            break;
+        return;
+    }
+    job->next = NULL;
+    job->fp = fp;
+    job->size = size - start;
+    memcpy(job->frames, stack + start, job->size * sizeof(void *));
+
+    pthread_mutex_lock(&ac_trace_worker_lock);
+    if (ac_trace_jobs_tail != NULL) {
+        ac_trace_jobs_tail->next = job;
+    } else {
+        ac_trace_jobs_head = job;
+    }
+    ac_trace_jobs_tail = job;
+    ac_trace_jobs_pending++;
+    pthread_cond_signal(&ac_trace_worker_wake);
+    pthread_mutex_unlock(&ac_trace_worker_lock);
+}
+
+void ac_fprint_intermediate_trace_deferred(FILE *fp, void **stack, size_t offset, size_t size) {
+    ac_trace_defer(fp, stack, offset + 1, size);
+}
+
+void ac_trace_symbolize_deferred(void **stack, size_t size) { ac_trace_defer(NULL, stack, 0, size); }
+
+void ac_trace_flush(void) {
+    pthread_mutex_lock(&ac_trace_worker_lock);
+    while (ac_trace_jobs_pending != 0) {
+        pthread_cond_wait(&ac_trace_worker_idle, &ac_trace_worker_lock);
+    }
+    pthread_mutex_unlock(&ac_trace_worker_lock);
+}
+
+// Interned trace table
+// Traces are appended to fixed size record blocks so a record never moves
+// once published, and looked up through an open addressing index of ids.
+// Inserts and index lookups happen under ac_trace_lock, but every thread
+// first checks a small direct mapped cache of the traces it interned, so
+// known callsites never take the lock.
+
+#define AC_TRACE_RECORD_BLOCK_SIZE 256
+#define AC_TRACE_MAX_RECORD_BLOCKS 4096
+#define AC_TRACE_FRAME_CHUNK_SIZE 4096
+#define AC_TRACE_CACHE_SIZE 256
+
+typedef struct ac_trace_record_t {
+    uint64_t hash;
+    void **frames;
+    int32_t size;
+} ac_trace_record_t;
+
+typedef struct ac_trace_cache_entry_t {
+    uint64_t hash;
+    ac_trace_id_t id;
+} ac_trace_cache_entry_t;
+
+static pthread_mutex_t ac_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static ac_trace_record_t *ac_trace_blocks[AC_TRACE_MAX_RECORD_BLOCKS];
+static _Atomic uint32_t ac_trace_count = 0;
+static _Thread_local ac_trace_cache_entry_t ac_trace_cache[AC_TRACE_CACHE_SIZE];
+
+static uint32_t *ac_trace_index = NULL;
+static size_t ac_trace_index_capacity = 0;
+
+static atomic_bool ac_trace_prefetch = false;
+
+static void **ac_trace_frame_chunk = NULL;
+static size_t ac_trace_frame_chunk_used = AC_TRACE_FRAME_CHUNK_SIZE;
+static size_t ac_trace_bytes = 0;
+
+static uint64_t ac_trace_hash(void **stack, int size) {
+    // FNV-1a over the frame words, finished with a murmur style avalanche
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < size; i++) {
+        hash ^= (uint64_t)(uintptr_t)stack[i];
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline ac_trace_record_t *ac_trace_record(ac_trace_id_t id) {
+    uint32_t index = id - 1;
+    return &ac_trace_blocks[index / AC_TRACE_RECORD_BLOCK_SIZE][index % AC_TRACE_RECORD_BLOCK_SIZE];
+}
+
+static bool ac_trace_index_grow(void) {
+    size_t new_capacity = ac_trace_index_capacity == 0 ? 1024 : ac_trace_index_capacity * 2;
+    uint32_t *new_index = calloc(new_capacity, sizeof(uint32_t));
+    if (new_index == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < ac_trace_index_capacity; i++) {
+        ac_trace_id_t id = ac_trace_index[i];
+        if (id == AC_TRACE_ID_NONE) {
+            continue;
         }
+        size_t slot = ac_trace_record(id)->hash & (new_capacity - 1);
+        while (new_index[slot] != AC_TRACE_ID_NONE) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        new_index[slot] = id;
     }
-    buff[strlen(buff) - 1] = '\0';
-    return strlen(buff);
+    ac_trace_bytes += (new_capacity - ac_trace_index_capacity) * sizeof(uint32_t);
+    free(ac_trace_index);
+    ac_trace_index = new_index;
+    ac_trace_index_capacity = new_capacity;
+    return true;
+}
+
+static void **ac_trace_store_frames(void **stack, int size) {
+    if (ac_trace_frame_chunk_used + size > AC_TRACE_FRAME_CHUNK_SIZE) {
+        ac_trace_frame_chunk = malloc(AC_TRACE_FRAME_CHUNK_SIZE * sizeof(void *));
+        if (ac_trace_frame_chunk == NULL) {
+            ac_trace_frame_chunk_used = AC_TRACE_FRAME_CHUNK_SIZE;
+            return NULL;
+        }
+        ac_trace_frame_chunk_used = 0;
+        ac_trace_bytes += AC_TRACE_FRAME_CHUNK_SIZE * sizeof(void *);
+    }
+    void **frames = ac_trace_frame_chunk + ac_trace_frame_chunk_used;
+    memcpy(frames, stack, size * sizeof(void *));
+    ac_trace_frame_chunk_used += size;
+    return frames;
+}
+
+static ac_trace_id_t ac_trace_intern_locked(void **stack, int size, uint64_t hash, bool *created) {
+    uint32_t count = atomic_load_explicit(&ac_trace_count, memory_order_relaxed);
+    if ((count + 1) * 2 > ac_trace_index_capacity && !ac_trace_index_grow()) {
+        return AC_TRACE_ID_NONE;
+    }
+
+    size_t slot = hash & (ac_trace_index_capacity - 1);
+    while (ac_trace_index[slot] != AC_TRACE_ID_NONE) {
+        ac_trace_record_t *record = ac_trace_record(ac_trace_index[slot]);
+        if (record->hash == hash && record->size == size && memcmp(record->frames, stack, size * sizeof(void *)) == 0) {
+            return ac_trace_index[slot];
+        }
+        slot = (slot + 1) & (ac_trace_index_capacity - 1);
+    }
+
+    uint32_t block = count / AC_TRACE_RECORD_BLOCK_SIZE;
+    if (block >= AC_TRACE_MAX_RECORD_BLOCKS) {
+        return AC_TRACE_ID_NONE;
+    }
+    if (ac_trace_blocks[block] == NULL) {
+        ac_trace_blocks[block] = malloc(AC_TRACE_RECORD_BLOCK_SIZE * sizeof(ac_trace_record_t));
+        if (ac_trace_blocks[block] == NULL) {
+            return AC_TRACE_ID_NONE;
+        }
+        ac_trace_bytes += AC_TRACE_RECORD_BLOCK_SIZE * sizeof(ac_trace_record_t);
+    }
+    void **frames = ac_trace_store_frames(stack, size);
+    if (frames == NULL) {
+        return AC_TRACE_ID_NONE;
+    }
+
+    ac_trace_id_t id = count + 1;
+    ac_trace_record_t *record = ac_trace_record(id);
+    record->hash = hash;
+    record->frames = frames;
+    record->size = size;
+    ac_trace_index[slot] = id;
+    *created = true;
+    // Publishes the record to threads reading the table without the lock
+    atomic_store_explicit(&ac_trace_count, id, memory_order_release);
+    return id;
+}
+
+ac_trace_id_t ac_trace_intern(void **stack, int size) {
+    if (size <= 0) {
+        return AC_TRACE_ID_NONE;
+    }
+    if (size > AC_TRACE_FRAME_CHUNK_SIZE) {
+        size = AC_TRACE_FRAME_CHUNK_SIZE;
+    }
+
+    uint64_t hash = ac_trace_hash(stack, size);
+    ac_trace_cache_entry_t *cached = &ac_trace_cache[hash & (AC_TRACE_CACHE_SIZE - 1)];
+    if (cached->id != AC_TRACE_ID_NONE && cached->hash == hash) {
+        ac_trace_record_t *record = ac_trace_record(cached->id);
+        if (record->size == size && memcmp(record->frames, stack, size * sizeof(void *)) == 0) {
+            return cached->id;
+        }
+    }
+
+    bool created = false;
+    pthread_mutex_lock(&ac_trace_lock);
+    ac_trace_id_t id = ac_trace_intern_locked(stack, size, hash, &created);
+    pthread_mutex_unlock(&ac_trace_lock);
+    if (created && atomic_load_explicit(&ac_trace_prefetch, memory_order_relaxed)) {
+        ac_trace_symbolize_deferred(stack, size);
+    }
+    if (id != AC_TRACE_ID_NONE) {
+        cached->hash = hash;
+        cached->id = id;
+    }
+    return id;
+}
+
+void ac_trace_set_prefetch(bool enable) { atomic_store_explicit(&ac_trace_prefetch, enable, memory_order_relaxed); }
+
+void **ac_trace_get(ac_trace_id_t id, int *size) {
+    if (id == AC_TRACE_ID_NONE || id > atomic_load_explicit(&ac_trace_count, memory_order_acquire)) {
+        *size = 0;
+        return NULL;
+    }
+    ac_trace_record_t *record = ac_trace_record(id);
+    *size = record->size;
+    return record->frames;
+}
+
+int ac_sprint_trace_id(ac_trace_id_t id, char *buffer, size_t offset) {
+    int size = 0;
+    void **frames = ac_trace_get(id, &size);
+    if (frames == NULL || (size_t)size <= offset + 1) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return ac_sprint_intermediate_trace(frames, buffer, offset, size);
+}
+
+int ac_sprint_trace_id_cached(ac_trace_id_t id, char *buffer, size_t offset) {
+    int size = 0;
+    void **frames = ac_trace_get(id, &size);
+    if (frames == NULL || (size_t)size <= offset + 1) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return ac_sprint_intermediate_trace_cached(frames, buffer, offset, size);
+}
+
+size_t ac_trace_table_count(void) { return atomic_load_explicit(&ac_trace_count, memory_order_acquire); }
+
+size_t ac_trace_table_bytes(void) {
+    pthread_mutex_lock(&ac_trace_lock);
+    size_t bytes = ac_trace_bytes;
+    pthread_mutex_unlock(&ac_trace_lock);
+    return bytes;
 }
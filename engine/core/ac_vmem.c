@@ -0,0 +1,106 @@
+#define _DEFAULT_SOURCE
+
+#include "core/ac_vmem.h"
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core/ac_log.h"
+#include "core/ac_mem.h"
+
+static atomic_size_t ac_vmem_reserved[AC_MEM_ENTRY_COUNT];
+static atomic_size_t ac_vmem_committed[AC_MEM_ENTRY_COUNT];
+
+static size_t ac_vmem_round_up(size_t size, size_t granularity) { return (size + granularity - 1) & ~(granularity - 1); }
+
+ac_vmem_t* ac_vmem_create(size_t reserve, uint32_t flags, ac_mem_entry_type_t mem_type) {
+    size_t granularity = (size_t)sysconf(_SC_PAGESIZE);
+    if (flags & AC_VMEM_HUGE_PAGES) {
+        granularity = AC_VMEM_HUGE_PAGE_SIZE;
+    }
+    reserve = ac_vmem_round_up(reserve == 0 ? 1 : reserve, granularity);
+
+    // mmap only guarantees page alignment, over-reserve and trim to align on
+    // huge pages.
+    size_t slack = granularity - (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t* mapping = mmap(NULL, reserve + slack, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        ac_log_error("Failed to reserve %zu bytes of address space\n", reserve);
+        return NULL;
+    }
+    uint8_t* base = (uint8_t*)ac_vmem_round_up((uintptr_t)mapping, granularity);
+    if (base != mapping) {
+        munmap(mapping, base - mapping);
+    }
+    if (base + reserve != mapping + reserve + slack) {
+        munmap(base + reserve, mapping + reserve + slack - (base + reserve));
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & AC_VMEM_HUGE_PAGES) {
+        // Only a hint, the region works with regular pages if it's refused
+        if (madvise(base, reserve, MADV_HUGEPAGE) != 0) {
+            ac_log_debug("Transparent huge pages unavailable for a %zu bytes region\n", reserve);
+        }
+    }
+#endif
+
+    ac_vmem_t* vmem = ac_malloc(sizeof(ac_vmem_t), mem_type);
+    vmem->base = base;
+    vmem->reserved = reserve;
+    vmem->committed = 0;
+    vmem->granularity = granularity;
+    vmem->flags = flags;
+    vmem->mem_type = mem_type;
+    atomic_fetch_add_explicit(&ac_vmem_reserved[mem_type], reserve, memory_order_relaxed);
+    return vmem;
+}
+
+void ac_vmem_destroy(ac_vmem_t* vmem) {
+    if (vmem == NULL) {
+        return;
+    }
+    munmap(vmem->base, vmem->reserved);
+    atomic_fetch_sub_explicit(&ac_vmem_reserved[vmem->mem_type], vmem->reserved, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&ac_vmem_committed[vmem->mem_type], vmem->committed, memory_order_relaxed);
+    ac_free(vmem);
+}
+
+bool ac_vmem_commit(ac_vmem_t* vmem, size_t size) {
+    if (size <= vmem->committed) {
+        return true;
+    }
+    if (size > vmem->reserved) {
+        return false;
+    }
+    size = ac_vmem_round_up(size, vmem->granularity);
+    if (mprotect(vmem->base + vmem->committed, size - vmem->committed, PROT_READ | PROT_WRITE) != 0) {
+        ac_log_error("Failed to commit %zu bytes of virtual memory\n", size - vmem->committed);
+        return false;
+    }
+    atomic_fetch_add_explicit(&ac_vmem_committed[vmem->mem_type], size - vmem->committed, memory_order_relaxed);
+    vmem->committed = size;
+    return true;
+}
+
+void ac_vmem_decommit(ac_vmem_t* vmem, size_t size) {
+    size = ac_vmem_round_up(size, vmem->granularity);
+    if (size >= vmem->committed) {
+        return;
+    }
+    // Dropping the pages first makes the kernel free them right away
+    madvise(vmem->base + size, vmem->committed - size, MADV_DONTNEED);
+    mprotect(vmem->base + size, vmem->committed - size, PROT_NONE);
+    atomic_fetch_sub_explicit(&ac_vmem_committed[vmem->mem_type], vmem->committed - size, memory_order_relaxed);
+    vmem->committed = size;
+}
+
+void ac_vmem_show_usage(void) {
+    for (size_t i = 0; i < AC_MEM_ENTRY_COUNT; i++) {
+        size_t reserved = atomic_load_explicit(&ac_vmem_reserved[i], memory_order_relaxed);
+        if (reserved != 0) {
+            ac_log_info("Virtual memory %s: reserved %zu, committed %zu\n", ac_mem_entry_type_str(i), reserved,
+                        atomic_load_explicit(&ac_vmem_committed[i], memory_order_relaxed));
+        }
+    }
+}
@@ -2,6 +2,10 @@
 
 #include "ds/ac_bitmask.h"
 
+#include "core/ac_pool.h"
+
+static size_t ac_bitmask_words(size_t num_bits) { return (num_bits + 63) / 64; }
+
 ac_bitmask_t* ac_bitmask_create(size_t num_bits, ac_mem_entry_type_t mem_type) {
     size_t num_bytes = num_bits / 8;
     if (num_bits % 8 != 0) {
@@ -11,15 +15,19 @@ ac_bitmask_t* ac_bitmask_create(size_t num_bits, ac_mem_entry_type_t mem_type) {
     if (num_bytes % sizeof(uint64_t) != 0) {
         num_words++;
     }
-    ac_bitmask_t* bitmask = ac_malloc(sizeof(ac_bitmask_t), mem_type);
-    bitmask->bits = ac_malloc(num_words * sizeof(uint64_t), mem_type);
+    ac_bitmask_t* bitmask = ac_pool_alloc(ac_pool_ds(), sizeof(ac_bitmask_t));
+    if (num_words * sizeof(uint64_t) <= AC_POOL_MAX_SIZE) {
+        bitmask->bits = ac_pool_alloc(ac_pool_ds(), num_words * sizeof(uint64_t));
+    } else {
+        bitmask->bits = ac_malloc(num_words * sizeof(uint64_t), mem_type);
+    }
     bitmask->num_bits = num_bits;
     return bitmask;
 }
 
 void ac_bitmask_destroy(ac_bitmask_t* bitmask) {
-    ac_free(bitmask->bits);
-    ac_free(bitmask);
+    ac_pool_free(ac_pool_ds(), bitmask->bits, ac_bitmask_words(bitmask->num_bits) * sizeof(uint64_t));
+    ac_pool_free(ac_pool_ds(), bitmask, sizeof(ac_bitmask_t));
 }
 
 void ac_bitmask_set(ac_bitmask_t* bitmask, size_t index) {
@@ -1,6 +1,9 @@
 #include "ds/ac_darray.h"
 
 #include "core/ac_mem.h"
+#include "core/ac_log.h"
+#include "core/ac_pool.h"
+#include "core/ac_vmem.h"
 
 #include <math.h>
 
@@ -9,24 +12,86 @@ static float AC_DARRAY_RESIZE_FACTOR = 1.6f;
 void ac_darray_set_resize_factor(float factor) { AC_DARRAY_RESIZE_FACTOR = factor; }
 
 ac_darray_t* ac_darray_create(uint64_t element_size, uint64_t capacity, ac_mem_entry_type_t mem_type) {
-    ac_darray_t* darray = ac_malloc(sizeof(ac_darray_t), AC_MEM_ENTRY_DS);
+    ac_darray_t* darray = ac_pool_alloc(ac_pool_ds(), sizeof(ac_darray_t));
     darray->element_size = element_size;
     darray->capacity = capacity;
     darray->size = 0;
     darray->mem_type = mem_type;
+    darray->alignment = 0;
+    darray->vmem = NULL;
     darray->data = ac_malloc(element_size * capacity, mem_type);
     return darray;
 }
 
+ac_darray_t* ac_darray_create_aligned(uint64_t element_size, uint64_t capacity, uint64_t alignment, ac_mem_entry_type_t mem_type) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        ac_log_fatal_exit("Invalid dynamic array alignment %llu\n", (unsigned long long)alignment);
+    }
+    ac_darray_t* darray = ac_pool_alloc(ac_pool_ds(), sizeof(ac_darray_t));
+    darray->element_size = element_size;
+    darray->capacity = capacity;
+    darray->size = 0;
+    darray->mem_type = mem_type;
+    darray->alignment = alignment;
+    darray->vmem = NULL;
+    darray->data = ac_malloc_aligned(element_size * capacity, alignment, mem_type);
+    if (darray->data == NULL && element_size * capacity != 0) {
+        ac_log_fatal_exit("Failed to allocate a dynamic array of %llu elements\n", (unsigned long long)capacity);
+    }
+    return darray;
+}
+
+ac_darray_t* ac_darray_create_virtual(uint64_t element_size, uint64_t max_capacity, ac_mem_entry_type_t mem_type) {
+    ac_vmem_t* vmem = ac_vmem_create(element_size * max_capacity, 0, mem_type);
+    if (vmem == NULL || !ac_vmem_commit(vmem, element_size)) {
+        ac_log_fatal_exit("Failed to reserve a dynamic array of %llu elements\n", (unsigned long long)max_capacity);
+    }
+    ac_darray_t* darray = ac_pool_alloc(ac_pool_ds(), sizeof(ac_darray_t));
+    darray->element_size = element_size;
+    darray->capacity = vmem->committed / element_size;
+    darray->size = 0;
+    darray->mem_type = mem_type;
+    darray->alignment = 0;
+    darray->vmem = vmem;
+    darray->data = vmem->base;
+    return darray;
+}
+
+static void ac_darray_grow(ac_darray_t* darray) {
+    if (darray->vmem != NULL) {
+        // Commit in place, the data doesn't move
+        uint64_t capacity = (uint64_t)ceilf((float)darray->capacity * AC_DARRAY_RESIZE_FACTOR);
+        if (capacity * darray->element_size > darray->vmem->reserved) {
+            capacity = darray->vmem->reserved / darray->element_size;
+        }
+        if (capacity == darray->capacity || !ac_vmem_commit(darray->vmem, capacity * darray->element_size)) {
+            ac_log_fatal_exit("Dynamic array is full at %llu elements\n", (unsigned long long)darray->capacity);
+        }
+        darray->capacity = darray->vmem->committed / darray->element_size;
+        return;
+    }
+    darray->capacity = (uint64_t)ceilf((float)darray->capacity * AC_DARRAY_RESIZE_FACTOR);
+    if (darray->alignment != 0) {
+        darray->data = ac_realloc_aligned(darray->data, darray->element_size * darray->capacity, darray->alignment, AC_MEM_ENTRY_DS);
+    } else {
+        darray->data = ac_realloc(darray->data, darray->element_size * darray->capacity, AC_MEM_ENTRY_DS);
+    }
+}
+
 void ac_darray_destroy(ac_darray_t* darray) {
-    ac_free(darray->data);
-    ac_free(darray);
+    if (darray->vmem != NULL) {
+        ac_vmem_destroy(darray->vmem);
+    } else if (darray->alignment != 0) {
+        ac_free_aligned(darray->data);
+    } else {
+        ac_free(darray->data);
+    }
+    ac_pool_free(ac_pool_ds(), darray, sizeof(ac_darray_t));
 }
 
 void ac_darray_push(ac_darray_t* darray, void* element) {
     if (darray->size == darray->capacity) {
-        darray->capacity = (uint64_t)ceilf((float)darray->capacity * AC_DARRAY_RESIZE_FACTOR);
-        darray->data = ac_realloc(darray->data, darray->element_size * darray->capacity, AC_MEM_ENTRY_DS);
+        ac_darray_grow(darray);
     }
     ac_memcpy((uint8_t*)darray->data + darray->size * darray->element_size, element, darray->element_size);
     darray->size++;
@@ -39,8 +104,7 @@ void ac_darray_pop(ac_darray_t* darray, void* element) {
 
 void ac_darray_insert(ac_darray_t* darray, uint64_t index, void* element) {
     if (darray->size == darray->capacity) {
-        darray->capacity = (uint64_t)ceilf((float)darray->capacity * AC_DARRAY_RESIZE_FACTOR);
-        darray->data = ac_realloc(darray->data, darray->element_size * darray->capacity, AC_MEM_ENTRY_DS);
+        ac_darray_grow(darray);
     }
     ac_memmove((uint8_t*)darray->data + (index + 1) * darray->element_size, (uint8_t*)darray->data + index * darray->element_size,
                (darray->size - index) * darray->element_size);
@@ -5,6 +5,7 @@
 
 #include "core/ac_log.h"
 #include "core/ac_mem.h"
+#include "core/ac_perf.h"
 #include "ds/ac_map.h"
 
 //-----------------------------------------------------------------------------
@@ -253,6 +254,7 @@ void ac_map_clear(ac_map_t* map) {
 }
 
 void* ac_map_get(ac_map_t* map, void* key) {
+    AC_PERF_SCOPE("ac_map_get");
     size_t hash = map->key_ops.hash(key);
     size_t index = hash % map->capacity;
     ac_map_entry_t entry = map->entries[index];
@@ -270,6 +272,7 @@ void* ac_map_get(ac_map_t* map, void* key) {
 }
 
 void ac_map_set(ac_map_t* map, void* key, void* value) {
+    AC_PERF_SCOPE("ac_map_set");
     ac_map_grow(map);
     size_t hash = map->key_ops.hash(key);
     size_t index = hash % map->capacity;
@@ -297,6 +300,7 @@ void ac_map_set(ac_map_t* map, void* key, void* value) {
 }
 
 void ac_map_remove(ac_map_t* map, void* key) {
+    AC_PERF_SCOPE("ac_map_remove");
     size_t hash = map->key_ops.hash(key);
     size_t index = hash % map->capacity;
     ac_map_entry_t entry = map->entries[index];
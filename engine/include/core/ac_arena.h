@@ -0,0 +1,170 @@
+#ifndef AC_CORE_ARENA_H
+#define AC_CORE_ARENA_H
+
+/**
+ * @file ac_arena.h
+ * @brief Linear (bump) arena allocator and per-frame arenas.
+ */
+
+#include <stddef.h>
+
+#include "core/ac_mem.h"
+
+/**
+ * Default capacity of each of the two frame arenas.
+ * @see ac_frame_arena_init
+ */
+#define AC_FRAME_ARENA_DEFAULT_CAPACITY (1024 * 1024)
+
+/**
+ * A chunk of arena memory.
+ * You won't need to use this struct directly.
+ */
+typedef struct ac_arena_chunk_t ac_arena_chunk_t;
+
+/**
+ * A linear allocator.
+ * Allocations are carved out of large chunks by bumping an offset and are all
+ * released at once by ac_arena_reset. Arenas are not thread safe.
+ * Individual allocations are not tracked, instead every arena records how many
+ * bytes each ac_mem_entry_type_t used since the last reset and the high-water
+ * mark of that, which ac_mem_show_usage reports.
+ * @brief Arena allocator.
+ * @see ac_arena_create
+ */
+typedef struct ac_arena_t {
+    /**
+     * The name shown in the usage report.
+     */
+    const char* name;
+    /**
+     * The memory type of the chunks backing the arena.
+     * @see ac_mem_entry_type_t
+     */
+    ac_mem_entry_type_t mem_type;
+    /**
+     * The chunk being allocated from. Older chunks are chained behind it.
+     */
+    ac_arena_chunk_t* chunks;
+    /**
+     * The capacity of a fresh chunk.
+     */
+    size_t chunk_capacity;
+    /**
+     * The number of bytes handed out since the last reset.
+     */
+    size_t used;
+    /**
+     * The largest value used reached before a reset.
+     */
+    size_t high_water;
+    /**
+     * The bytes handed out since the last reset, per memory type.
+     */
+    size_t type_used[AC_MEM_ENTRY_COUNT];
+    /**
+     * The largest value type_used reached before a reset, per memory type.
+     */
+    size_t type_high_water[AC_MEM_ENTRY_COUNT];
+    /**
+     * The number of resets.
+     */
+    size_t reset_count;
+    /**
+     * The next arena in the usage report.
+     */
+    struct ac_arena_t* next;
+} ac_arena_t;
+
+/**
+ * Create an arena.
+ * @param name The name shown in the usage report.
+ * @param capacity The capacity of the first chunk. The arena grows by chaining
+ * more chunks and folds them back into a single chunk on reset, at most twice
+ * as large as the previous one.
+ * @param mem_type The memory type of the chunks backing the arena.
+ * @return The new arena, NULL if mem_type is not a memory type.
+ */
+ac_arena_t* ac_arena_create(const char* name, size_t capacity, ac_mem_entry_type_t mem_type);
+
+/**
+ * Destroy an arena and everything allocated from it.
+ * @param arena The arena.
+ */
+void ac_arena_destroy(ac_arena_t* arena);
+
+/**
+ * Allocate from an arena, aligned for any scalar type.
+ * @param arena The arena.
+ * @param size The size of the allocation.
+ * @param type The memory type the allocation is accounted to.
+ * @return The allocation, valid until the next reset. NULL if type is not a
+ * memory type.
+ */
+void* ac_arena_alloc(ac_arena_t* arena, size_t size, ac_mem_entry_type_t type);
+
+/**
+ * Allocate from an arena with a given alignment.
+ * @param arena The arena.
+ * @param size The size of the allocation.
+ * @param alignment The alignment, a power of two.
+ * @param type The memory type the allocation is accounted to.
+ * @return The allocation, valid until the next reset. NULL if type is not a
+ * memory type, the alignment not a power of two or size too large to address.
+ */
+void* ac_arena_alloc_aligned(ac_arena_t* arena, size_t size, size_t alignment, ac_mem_entry_type_t type);
+
+/**
+ * Release everything allocated from an arena.
+ * @param arena The arena.
+ */
+void ac_arena_reset(ac_arena_t* arena);
+
+/**
+ * Log the high-water marks of every live arena.
+ * Called by ac_mem_show_usage.
+ */
+void ac_arena_show_usage(void);
+
+/**
+ * Create the two frame arenas.
+ * ac_window_init calls this, ac_window_update flips them every frame.
+ * @param capacity The initial capacity of each arena, 0 for
+ * AC_FRAME_ARENA_DEFAULT_CAPACITY.
+ */
+void ac_frame_arena_init(size_t capacity);
+
+/**
+ * Destroy the frame arenas.
+ */
+void ac_frame_arena_shutdown(void);
+
+/**
+ * Start a new frame.
+ * The arena of the previous frame is kept intact so its data stays valid
+ * while the GPU consumes it, the one used two frames ago is reset and
+ * becomes current.
+ */
+void ac_frame_arena_begin(void);
+
+/**
+ * Allocate scratch memory valid for this frame and the next one.
+ * @param size The size of the allocation.
+ * @param type The memory type the allocation is accounted to.
+ * @return The allocation.
+ */
+void* ac_frame_alloc(size_t size, ac_mem_entry_type_t type);
+
+/**
+ * Get the arena of the current frame.
+ * @return The current frame arena.
+ */
+ac_arena_t* ac_frame_arena_current(void);
+
+/**
+ * Get the arena of the previous frame.
+ * @return The previous frame arena.
+ */
+ac_arena_t* ac_frame_arena_previous(void);
+
+#endif  // AC_CORE_ARENA_H
@@ -0,0 +1,226 @@
+#ifndef AC_CORE_FRAME_STATS_H
+#define AC_CORE_FRAME_STATS_H
+
+/**
+ * @file ac_frame_stats.h
+ * @brief Frame time statistics.
+ *
+ * Durations are recorded per frame with the AC_FRAME_STATS_* macros, which
+ * compile to nothing unless AC_FRAME_STATS_ENABLE is defined. Recording never
+ * allocates: every sample goes to a fixed histogram covering the whole run and
+ * to a ring of the last AC_FRAME_STATS_HISTORY frames. Not thread safe, record
+ * from the thread running ac_window_update.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core/ac_time.h"
+
+/**
+ * Number of frames kept for ac_frame_stats_write_csv.
+ */
+#define AC_FRAME_STATS_HISTORY 1024
+
+/**
+ * Frame interval above which a frame counts as a hitch, until
+ * ac_frame_stats_set_hitch_threshold is called.
+ */
+#define AC_FRAME_STATS_DEFAULT_HITCH_NS 33333333
+
+/**
+ * What a duration measures.
+ */
+typedef enum ac_frame_stat_t {
+    /**
+     * Time between the starts of two frames, recorded by ac_frame_stats_frame_end.
+     */
+    AC_FRAME_STAT_FRAME,
+    /**
+     * Time the frame kept the CPU busy, the frame interval minus the FPS limiter.
+     */
+    AC_FRAME_STAT_CPU,
+    /**
+     * Time waiting for the fence of the frame.
+     */
+    AC_FRAME_STAT_FENCE_WAIT,
+    /**
+     * Time acquiring the swapchain image.
+     */
+    AC_FRAME_STAT_ACQUIRE,
+    /**
+     * Time presenting the swapchain image.
+     */
+    AC_FRAME_STAT_PRESENT,
+    /**
+     * GPU time of a frame, from timestamp queries. Lags the other stats by the
+     * number of frames in flight.
+     */
+    AC_FRAME_STAT_GPU,
+    AC_FRAME_STAT_COUNT
+} ac_frame_stat_t;
+
+/**
+ * Summary of the durations recorded for a stat.
+ * Percentiles are read from a histogram with 16 buckets per power of two,
+ * they overestimate by at most 1/16.
+ */
+typedef struct ac_frame_stats_summary_t {
+    /**
+     * Number of frames the stat was recorded in.
+     */
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p95_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+} ac_frame_stats_summary_t;
+
+/**
+ * Start recording.
+ * Called by ac_window_init, frames before the first ac_frame_stats_frame_end
+ * aren't recorded.
+ */
+void ac_frame_stats_init(void);
+
+/**
+ * Add a duration to the current frame.
+ * Durations recorded several times in a frame add up.
+ * @param stat What the duration measures.
+ * @param ns The duration in nanoseconds.
+ */
+void ac_frame_stats_record(ac_frame_stat_t stat, uint64_t ns);
+
+/**
+ * Add the duration between two tick counts to the current frame.
+ * @param stat What the duration measures.
+ * @param begin_ticks When it started, from ac_time_ticks.
+ * @param end_ticks When it ended.
+ */
+void ac_frame_stats_record_ticks(ac_frame_stat_t stat, uint64_t begin_ticks, uint64_t end_ticks);
+
+/**
+ * Add the time since the start of the current frame.
+ * @param stat What the duration measures.
+ */
+void ac_frame_stats_mark(ac_frame_stat_t stat);
+
+/**
+ * End the current frame and start the next one.
+ * Records AC_FRAME_STAT_FRAME and counts a hitch if it's above the
+ * threshold. Called by ac_window_update.
+ */
+void ac_frame_stats_frame_end(void);
+
+/**
+ * Drop the current frame instead of recording it when it ends.
+ * For frames that don't render, like while the window is minimized.
+ */
+void ac_frame_stats_frame_discard(void);
+
+/**
+ * Set the frame interval above which a frame counts as a hitch.
+ * ac_window_init sets it to twice the frame time of the FPS limit.
+ * @param ns The threshold in nanoseconds.
+ */
+void ac_frame_stats_set_hitch_threshold(uint64_t ns);
+
+/**
+ * Summarize the durations recorded for a stat since the start or the last
+ * ac_frame_stats_reset.
+ * @param stat The stat.
+ * @param summary Filled with the summary, zeroed if nothing was recorded.
+ */
+void ac_frame_stats_get(ac_frame_stat_t stat, ac_frame_stats_summary_t* summary);
+
+/**
+ * Get the number of hitches since the start or the last ac_frame_stats_reset.
+ * @return The number of frames above the hitch threshold.
+ */
+uint64_t ac_frame_stats_hitches(void);
+
+/**
+ * Forget everything recorded.
+ */
+void ac_frame_stats_reset(void);
+
+/**
+ * Log the summary of every stat with ac_log_info.
+ */
+void ac_frame_stats_log(void);
+
+/**
+ * Write the durations of the last AC_FRAME_STATS_HISTORY frames as CSV.
+ * One row per frame, one column per stat in microseconds, empty when the stat
+ * wasn't recorded in the frame.
+ * @param path The path of the file.
+ * @return false if the file can't be written.
+ */
+bool ac_frame_stats_write_csv(const char* path);
+
+/**
+ * Write the summary of every stat and the hitch count as JSON.
+ * @param path The path of the file.
+ * @return false if the file can't be written.
+ */
+bool ac_frame_stats_write_json(const char* path);
+
+#ifdef AC_FRAME_STATS_ENABLE
+
+/**
+ * Start recording.
+ * @see ac_frame_stats_init
+ */
+#define AC_FRAME_STATS_INIT() ac_frame_stats_init()
+
+/**
+ * End the current frame.
+ * @see ac_frame_stats_frame_end
+ */
+#define AC_FRAME_STATS_FRAME() ac_frame_stats_frame_end()
+
+/**
+ * Drop the current frame.
+ * @see ac_frame_stats_frame_discard
+ */
+#define AC_FRAME_STATS_DISCARD() ac_frame_stats_frame_discard()
+
+/**
+ * Time a statement.
+ * @param stat What the statement measures.
+ */
+#define AC_FRAME_STATS_TIME(stat, ...)                                              \
+    do {                                                                            \
+        uint64_t ac_frame_stats_begin_ = ac_time_ticks();                           \
+        __VA_ARGS__;                                                                \
+        ac_frame_stats_record_ticks((stat), ac_frame_stats_begin_, ac_time_ticks()); \
+    } while (0)
+
+/**
+ * Add a duration in nanoseconds.
+ * @see ac_frame_stats_record
+ */
+#define AC_FRAME_STATS_RECORD(stat, ns) ac_frame_stats_record((stat), (ns))
+
+/**
+ * Add the time since the start of the frame.
+ * @see ac_frame_stats_mark
+ */
+#define AC_FRAME_STATS_MARK(stat) ac_frame_stats_mark(stat)
+
+#else
+
+#define AC_FRAME_STATS_INIT() ((void)0)
+#define AC_FRAME_STATS_FRAME() ((void)0)
+#define AC_FRAME_STATS_DISCARD() ((void)0)
+#define AC_FRAME_STATS_TIME(stat, ...) \
+    do {                               \
+        __VA_ARGS__;                   \
+    } while (0)
+#define AC_FRAME_STATS_RECORD(stat, ns) ((void)0)
+#define AC_FRAME_STATS_MARK(stat) ((void)0)
+
+#endif  // AC_FRAME_STATS_ENABLE
+
+#endif  // AC_CORE_FRAME_STATS_H
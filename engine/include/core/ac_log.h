@@ -6,7 +6,9 @@
  * @brief Logging functions.
  */
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -23,17 +25,121 @@ typedef enum ac_log_level_t {
     AC_LOG_LEVEL_FATAL
 } ac_log_level_t;
 
+/// Maximum length of a message formatted without allocating, prefix
+/// included. Longer messages are written to the console synchronously.
+#define AC_LOG_MESSAGE_SIZE 512
+
+/// Number of messages the asynchronous writer can have queued.
+/// Must be a power of two.
+#define AC_LOG_RING_SIZE 1024
+
+/// What to do with a message when the queue of the asynchronous writer is full.
+/// @see ac_log_set_async
+typedef enum ac_log_overflow_t {
+    /// Wait for the writer to make room.
+    AC_LOG_OVERFLOW_BLOCK,
+    /// Drop the message, the writer reports how many were dropped.
+    AC_LOG_OVERFLOW_DROP
+} ac_log_overflow_t;
+
 /// Whether to use ANSI color codes in log output.
 /// This is enabled by default.
 /// Disable color codes if you are logging to a file or a non-terminal output.
 /// @param enable Whether to enable color codes.
 void ac_log_enable_color(bool enable);
 
-/// Set the log level.
-/// Log messages with a level lower than the set level will be ignored.
+/// Set the log level of the console.
+/// Log messages with a level lower than the set level will not be printed,
+/// other sinks have their own level.
 /// @param level The log level.
+/// @see ac_log_set_sink_level
 void ac_log_set_level(ac_log_level_t level);
 
+/// Maximum number of sinks, the console included.
+#define AC_LOG_MAX_SINKS 8
+
+/// Id of the console sink, the stream chosen by the logging macros.
+/// It can't be removed, its level can be raised.
+#define AC_LOG_SINK_CONSOLE 0
+
+/// A destination of log messages.
+/// Messages are formatted once and given to every sink whose level they
+/// reach. Sinks are called on the logging thread, from several threads at
+/// once, and must not log themselves.
+/// @param user The pointer given to ac_log_add_sink.
+/// @param level The level of the message.
+/// @param message The message, the level name, ": " and the formatted text,
+/// without color codes nor NUL terminator.
+/// @param length The length of the message.
+typedef void (*ac_log_sink_fn)(void *user, ac_log_level_t level, const char *message, size_t length);
+
+/// Add a sink.
+/// @param write Called with every message at or above the level.
+/// @param close Called once the sink is removed and no message is being
+/// written to it anymore, can be NULL.
+/// @param user Passed to write and close.
+/// @param level The level of the sink.
+/// @return The id of the sink, -1 if all AC_LOG_MAX_SINKS are in use.
+int ac_log_add_sink(ac_log_sink_fn write, void (*close)(void *user), void *user, ac_log_level_t level);
+
+/// Remove a sink.
+/// Returns once no message is being written to it, after closing it.
+/// @param sink The id of the sink.
+void ac_log_remove_sink(int sink);
+
+/// Set the level of a sink.
+/// @param sink The id of the sink, AC_LOG_SINK_CONSOLE for the console.
+/// @param level The level.
+void ac_log_set_sink_level(int sink, ac_log_level_t level);
+
+/// Add a sink appending messages to a memory mapped file.
+/// The file is created with its full size, writing a message is a copy
+/// without system call. Messages that don't fit are dropped and counted.
+/// Removing the sink truncates the file after the last message, a file left
+/// by a crash ends with zeros.
+/// @param path The path of the file, truncated if it exists.
+/// @param size The size of the file in bytes.
+/// @param level The level of the sink.
+/// @return The id of the sink, -1 on failure.
+int ac_log_add_file_sink(const char *path, size_t size, ac_log_level_t level);
+
+/// Add a sink keeping the last messages in memory.
+/// Its content is written to stderr once per fatal error, by
+/// ac_log_fatal_exit or at exit after FATAL messages, usually with a lower
+/// level than the console to show what led to the error. Only one crash ring
+/// can exist at a time.
+/// @param size The size of the ring in bytes, rounded up to a power of two.
+/// @param level The level of the sink.
+/// @return The id of the sink, -1 on failure.
+/// @see ac_log_dump_crash_ring
+int ac_log_add_crash_ring(size_t size, ac_log_level_t level);
+
+/// Write the content of the crash ring.
+/// Only uses write(), it can be called from a signal handler. Does nothing
+/// without a crash ring.
+/// @param fd The file descriptor to write to.
+void ac_log_dump_crash_ring(int fd);
+
+/// Write the crash ring to stderr if FATAL messages were logged since it was
+/// last written.
+/// Called by ac_log_fatal_exit and at exit, the FATAL messages of one error
+/// give one dump.
+void ac_log_crash_report(void);
+
+/// Write console messages from a background thread.
+/// Messages are formatted on the calling thread and queued, a writer thread
+/// writes them in batches with one write() per run of messages to the same
+/// stream. FATAL messages and messages longer than AC_LOG_MESSAGE_SIZE are
+/// written synchronously after everything queued before them. Queued
+/// messages are flushed at exit. Synchronous by default.
+/// @param enable Whether to write messages asynchronously.
+/// @param overflow What to do when the queue is full.
+void ac_log_set_async(bool enable, ac_log_overflow_t overflow);
+
+/// Wait until every message logged before the call is written.
+/// Does nothing when logging is synchronous.
+void ac_log_flush(void);
+
 /// Log a message.
 /// Not intended to be called directly, but nobody is stopping you.
 /// @param fd The file descriptor to log to.
@@ -42,25 +148,48 @@ void ac_log_set_level(ac_log_level_t level);
 /// @param ... The format arguments.
 void ac_log(FILE *fd, ac_log_level_t level, const char *fmt, ...);
 
+/// Lowest level compiled in, as the value of its ac_log_level_t.
+/// Calls below it are removed by the compiler, arguments included, while the
+/// arguments are still type checked. ERROR and FATAL are always kept. Define
+/// it on the command line, -DAC_LOG_MIN_LEVEL=2 keeps INFO and above.
+#ifndef AC_LOG_MIN_LEVEL
+#define AC_LOG_MIN_LEVEL 0
+#endif
+
+/// Whether calls at a level are compiled in, a constant expression. The guard
+/// of every logging macro.
+/// @param level The level, an ac_log_level_t constant.
+#define AC_LOG_COMPILED(level) ((level) >= AC_LOG_MIN_LEVEL || (level) >= AC_LOG_LEVEL_ERROR)
+
+/// Expands to a call that is compiled out when the level is below
+/// AC_LOG_MIN_LEVEL.
+/// Not intended to be used directly.
+#define AC_LOG_IF_COMPILED(level, call) \
+    do {                                \
+        if (AC_LOG_COMPILED(level)) {   \
+            call;                       \
+        }                               \
+    } while (0)
+
 /// Log a message with the TRACE level.
 /// @param fmt The format string.
 /// @param ... The format arguments.
-#define ac_log_trace(fmt, ...) ac_log(stdout, AC_LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+#define ac_log_trace(fmt, ...) AC_LOG_IF_COMPILED(0, ac_log(stdout, AC_LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__))
 
 /// Log a message with the DEBUG level.
 /// @param fmt The format string.
 /// @param ... The format arguments.
-#define ac_log_debug(fmt, ...) ac_log(stdout, AC_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#define ac_log_debug(fmt, ...) AC_LOG_IF_COMPILED(1, ac_log(stdout, AC_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__))
 
 /// Log a message with the INFO level.
 /// @param fmt The format string.
 /// @param ... The format arguments.
-#define ac_log_info(fmt, ...) ac_log(stdout, AC_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define ac_log_info(fmt, ...) AC_LOG_IF_COMPILED(2, ac_log(stdout, AC_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__))
 
 /// Log a message with the WARN level.
 /// @param fmt The format string.
 /// @param ... The format arguments.
-#define ac_log_warn(fmt, ...) ac_log(stdout, AC_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#define ac_log_warn(fmt, ...) AC_LOG_IF_COMPILED(3, ac_log(stdout, AC_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__))
 
 /// Log a message with the ERROR level.
 /// @param fmt The format string.
@@ -82,6 +211,139 @@ void ac_log(FILE *fd, ac_log_level_t level, const char *fmt, ...);
 #define ac_log_fatal_exit(fmt, ...)                             \
     do {                                                        \
         ac_log(stderr, AC_LOG_LEVEL_FATAL, fmt, ##__VA_ARGS__); \
+        ac_log_crash_report();                                  \
         exit(1);                                                \
     } while (0)
+
+/// State of a rate limited call site, declared static by AC_LOG_LIMITED.
+typedef struct ac_log_limit_t {
+    /// End of the current window in nanoseconds, 0 before the first call.
+    _Atomic uint64_t window_end;
+    /// Messages let through in the current window.
+    _Atomic uint32_t count;
+    /// Messages suppressed since the last one let through.
+    _Atomic uint32_t suppressed;
+} ac_log_limit_t;
+
+/// Decide whether a rate limited message is logged.
+/// Not intended to be called directly, use AC_LOG_LIMITED.
+/// @param limit The state of the call site.
+/// @param count How many messages each window lets through.
+/// @param interval_ms The length of a window in milliseconds.
+/// @param suppressed Set to the number of messages suppressed since the last
+/// one let through, when returning true.
+/// @return Whether to log the message.
+bool ac_log_limit_pass(ac_log_limit_t *limit, uint32_t count, uint64_t interval_ms, uint32_t *suppressed);
+
+/// Log at most count messages per interval from this call site.
+/// Suppressed calls cost a clock read and two atomics, their arguments are
+/// neither evaluated nor formatted. The next message let through is followed
+/// by the number of messages suppressed before it.
+/// @param fd The stream to log to.
+/// @param log_level The log level.
+/// @param count How many messages each window lets through.
+/// @param interval_ms The length of a window in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+#define AC_LOG_LIMITED(fd, log_level, count, interval_ms, fmt, ...)                                                     \
+    do {                                                                                                                \
+        if (AC_LOG_COMPILED(log_level)) {                                                                               \
+            static ac_log_limit_t ac_log_limit_;                                                                        \
+            uint32_t ac_log_suppressed_;                                                                                \
+            if (ac_log_limit_pass(&ac_log_limit_, (count), (interval_ms), &ac_log_suppressed_)) {                       \
+                ac_log(fd, log_level, fmt, ##__VA_ARGS__);                                                              \
+                if (ac_log_suppressed_ > 0) {                                                                           \
+                    ac_log(fd, log_level, "%u more messages from %s:%d were suppressed\n", ac_log_suppressed_, __FILE__, \
+                           __LINE__);                                                                                   \
+                }                                                                                                       \
+            }                                                                                                           \
+        }                                                                                                               \
+    } while (0)
+
+/// Log a message from this call site only the first time it's reached.
+/// Later calls cost one atomic load, their arguments are not evaluated.
+/// @param fd The stream to log to.
+/// @param log_level The log level.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+#define AC_LOG_ONCE(fd, log_level, fmt, ...)                                                  \
+    do {                                                                                      \
+        if (AC_LOG_COMPILED(log_level)) {                                                     \
+            static _Atomic bool ac_log_done_;                                                 \
+            if (!atomic_load_explicit(&ac_log_done_, memory_order_relaxed) &&                 \
+                !atomic_exchange_explicit(&ac_log_done_, true, memory_order_relaxed)) {       \
+                ac_log(fd, log_level, fmt, ##__VA_ARGS__);                                    \
+            }                                                                                 \
+        }                                                                                     \
+    } while (0)
+
+/// Log a message with the TRACE level at most once per interval from this call site.
+/// @param interval_ms The interval in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_LIMITED
+#define ac_log_trace_every(interval_ms, fmt, ...) \
+    AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_TRACE, 1, interval_ms, fmt, ##__VA_ARGS__)
+
+/// Log a message with the DEBUG level at most once per interval from this call site.
+/// @param interval_ms The interval in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_LIMITED
+#define ac_log_debug_every(interval_ms, fmt, ...) \
+    AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_DEBUG, 1, interval_ms, fmt, ##__VA_ARGS__)
+
+/// Log a message with the INFO level at most once per interval from this call site.
+/// @param interval_ms The interval in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_LIMITED
+#define ac_log_info_every(interval_ms, fmt, ...) \
+    AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_INFO, 1, interval_ms, fmt, ##__VA_ARGS__)
+
+/// Log a message with the WARN level at most once per interval from this call site.
+/// @param interval_ms The interval in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_LIMITED
+#define ac_log_warn_every(interval_ms, fmt, ...) \
+    AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_WARN, 1, interval_ms, fmt, ##__VA_ARGS__)
+
+/// Log a message with the ERROR level at most once per interval from this call site.
+/// @param interval_ms The interval in milliseconds.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_LIMITED
+#define ac_log_error_every(interval_ms, fmt, ...) \
+    AC_LOG_LIMITED(stderr, AC_LOG_LEVEL_ERROR, 1, interval_ms, fmt, ##__VA_ARGS__)
+
+/// Log a message with the TRACE level the first time this call site is reached.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_ONCE
+#define ac_log_trace_once(fmt, ...) AC_LOG_ONCE(stdout, AC_LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+
+/// Log a message with the DEBUG level the first time this call site is reached.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_ONCE
+#define ac_log_debug_once(fmt, ...) AC_LOG_ONCE(stdout, AC_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+/// Log a message with the INFO level the first time this call site is reached.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_ONCE
+#define ac_log_info_once(fmt, ...) AC_LOG_ONCE(stdout, AC_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+
+/// Log a message with the WARN level the first time this call site is reached.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_ONCE
+#define ac_log_warn_once(fmt, ...) AC_LOG_ONCE(stdout, AC_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+
+/// Log a message with the ERROR level the first time this call site is reached.
+/// @param fmt The format string.
+/// @param ... The format arguments.
+/// @see AC_LOG_ONCE
+#define ac_log_error_once(fmt, ...) AC_LOG_ONCE(stderr, AC_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
 #endif  // ACETATE_CORE_LOG_H
@@ -0,0 +1,325 @@
+#ifndef ACETATE_CORE_LOG_BINARY_H
+#define ACETATE_CORE_LOG_BINARY_H
+
+/**
+ * @file ac_log_binary.h
+ * @brief Binary logging with deferred formatting.
+ *
+ * Call sites register their format string once, then every call only stores
+ * the id of the site, a timestamp and the raw bytes of the arguments in a
+ * memory mapped file. Nothing is formatted at run time, ac_logdecode renders
+ * the file as text later. The file is written through a shared mapping, what
+ * was logged before a crash is in it.
+ *
+ * The file is, in the byte order of the host:
+ * - an ac_log_binary_header_t,
+ * - records, each an ac_log_binary_record_t followed by its arguments and
+ *   padded to 8 bytes, up to the first record with a size of 0.
+ *
+ * Records with the site AC_LOG_BINARY_SITE_DEFINITION define a call site, an
+ * ac_log_binary_site_t follows followed by the format and the file name, not
+ * NUL terminated. Messages may come before the definition of their site.
+ *
+ * The arguments of a message follow the conversions of its format in order:
+ * 4 bytes for int and narrower, 8 for long, long long, size_t, intmax_t,
+ * ptrdiff_t, pointers and doubles, 16 for long double, and for strings a
+ * uint32_t length followed by the bytes. Values are unaligned.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "core/ac_log.h"
+
+/**
+ * "ACLB" in little endian.
+ */
+#define AC_LOG_BINARY_MAGIC 0x424C4341u
+
+/**
+ * Bumped on every change of the format.
+ */
+#define AC_LOG_BINARY_VERSION 1u
+
+/**
+ * Maximum number of arguments of a format, width and precision given as '*'
+ * included.
+ */
+#define AC_LOG_BINARY_MAX_ARGS 16
+
+/**
+ * Maximum number of bytes stored of a string argument, longer strings are
+ * cut.
+ */
+#define AC_LOG_BINARY_MAX_STRING 256
+
+/**
+ * Site id of the records defining a site.
+ */
+#define AC_LOG_BINARY_SITE_DEFINITION 0u
+
+/**
+ * Start of a binary log.
+ */
+typedef struct ac_log_binary_header_t {
+    /**
+     * AC_LOG_BINARY_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * AC_LOG_BINARY_VERSION.
+     */
+    uint32_t version;
+    /**
+     * Size the file was created with, records stop before it. Closing the
+     * log truncates the file after the last record.
+     */
+    uint64_t size;
+    /**
+     * Number of messages that didn't fit in the file.
+     */
+    uint64_t dropped;
+    /**
+     * Tick count when the file was opened, with its time in nanoseconds
+     * since the Unix epoch.
+     * @see ac_time_ticks
+     */
+    uint64_t base_ticks;
+    uint64_t base_realtime_ns;
+    /**
+     * Length of a tick in nanoseconds.
+     */
+    double ns_per_tick;
+} ac_log_binary_header_t;
+
+/**
+ * Start of a record.
+ */
+typedef struct ac_log_binary_record_t {
+    /**
+     * Size of the record, header and padding included. Written last, a
+     * record with a size of 0 is the end of the log.
+     */
+    uint32_t size;
+    /**
+     * Id of the call site, AC_LOG_BINARY_SITE_DEFINITION for definitions.
+     */
+    uint32_t site;
+    /**
+     * ac_time_ticks when the message was logged.
+     */
+    uint64_t ticks;
+    /**
+     * Kernel id of the thread that logged the message.
+     */
+    uint32_t thread;
+    /**
+     * Keeps the struct free of implicit padding.
+     */
+    uint32_t padding;
+} ac_log_binary_record_t;
+
+/**
+ * Definition of a call site.
+ */
+typedef struct ac_log_binary_site_t {
+    /**
+     * The id messages of the site refer to it with, from 1.
+     */
+    uint32_t id;
+    /**
+     * The ac_log_level_t of the site.
+     */
+    uint32_t level;
+    /**
+     * Line of the call.
+     */
+    uint32_t line;
+    /**
+     * Length of the format that follows.
+     */
+    uint32_t format_len;
+    /**
+     * Length of the file name that follows the format.
+     */
+    uint32_t file_len;
+    /**
+     * Keeps the struct free of implicit padding.
+     */
+    uint32_t padding;
+} ac_log_binary_site_t;
+
+/**
+ * How an argument is stored.
+ */
+typedef enum ac_log_binary_arg_t {
+    /**
+     * Takes no argument, %%.
+     */
+    AC_LOG_BINARY_ARG_NONE,
+    /**
+     * int and narrower, also width and precision given as '*'.
+     */
+    AC_LOG_BINARY_ARG_INT,
+    AC_LOG_BINARY_ARG_LONG,
+    AC_LOG_BINARY_ARG_LONG_LONG,
+    AC_LOG_BINARY_ARG_SIZE,
+    AC_LOG_BINARY_ARG_INTMAX,
+    AC_LOG_BINARY_ARG_PTRDIFF,
+    AC_LOG_BINARY_ARG_POINTER,
+    AC_LOG_BINARY_ARG_DOUBLE,
+    AC_LOG_BINARY_ARG_LONG_DOUBLE,
+    AC_LOG_BINARY_ARG_STRING,
+    /**
+     * A conversion that can't be logged, %n, wide strings or malformed.
+     */
+    AC_LOG_BINARY_ARG_INVALID
+} ac_log_binary_arg_t;
+
+/**
+ * A conversion of a format.
+ * @see ac_log_binary_conversion
+ */
+typedef struct ac_log_binary_conversion_t {
+    /**
+     * The text of the conversion, from the '%' to the conversion character.
+     */
+    const char* start;
+    size_t length;
+    /**
+     * Whether width and precision are int arguments before the value.
+     */
+    bool star_width;
+    bool star_precision;
+    /**
+     * The precision written in the format, -1 if none or '*'.
+     */
+    int precision;
+    /**
+     * How the value is stored.
+     */
+    ac_log_binary_arg_t arg;
+} ac_log_binary_conversion_t;
+
+/**
+ * A call site, declared static by the logging macros.
+ */
+typedef struct ac_log_site_t {
+    const char* format;
+    const char* file;
+    uint32_t line;
+    ac_log_level_t level;
+    /**
+     * 0 until the first call, UINT32_MAX if the format can't be logged.
+     */
+    _Atomic uint32_t id;
+    uint8_t arg_count;
+    /**
+     * How each argument is stored, an ac_log_binary_arg_t.
+     */
+    uint8_t args[AC_LOG_BINARY_MAX_ARGS];
+    /**
+     * Most bytes read of each string argument.
+     */
+    uint16_t limits[AC_LOG_BINARY_MAX_ARGS];
+    struct ac_log_site_t* next;
+} ac_log_site_t;
+
+/**
+ * Start logging to a file.
+ * The file is created with its full size and mapped, messages that don't fit
+ * are dropped and counted. Sites already used are defined again at the start
+ * of the file. Closes the previous file.
+ * @param path The path of the file.
+ * @param size The size of the file in bytes.
+ * @return false if the file can't be created.
+ */
+bool ac_log_binary_open(const char* path, size_t size);
+
+/**
+ * Stop logging and close the file.
+ * Returns once no message is being written anymore, the file is truncated
+ * after the last record.
+ */
+void ac_log_binary_close(void);
+
+/**
+ * Log a message.
+ * Not intended to be called directly, use the macros.
+ * @param site The call site.
+ * @param ... The format arguments.
+ */
+void ac_log_binary(ac_log_site_t* site, ...);
+
+/**
+ * Find the next conversion of a format.
+ * The logger and ac_logdecode both read formats with it.
+ * @param format The format, or the pointer returned by the previous call.
+ * @param conversion Filled with the conversion found.
+ * @return The text right after the conversion, NULL if there is none left.
+ */
+const char* ac_log_binary_conversion(const char* format, ac_log_binary_conversion_t* conversion);
+
+/**
+ * Checks the arguments against the format, never called.
+ */
+static inline __attribute__((format(printf, 1, 2))) void ac_log_binary_check(const char* fmt, ...) { (void)fmt; }
+
+/**
+ * Log a message at a level.
+ * Compiled out when the level is below AC_LOG_MIN_LEVEL, ERROR is always
+ * kept. Nothing is written while no file is open. Strings are copied, up to
+ * AC_LOG_BINARY_MAX_STRING bytes, %n and wide strings aren't supported.
+ * @param log_level The level, an ac_log_level_t constant.
+ * @param fmt The format string, a string literal.
+ * @param ... The format arguments.
+ */
+#define AC_LOG_BINARY(log_level, fmt, ...)                                                  \
+    do {                                                                                    \
+        if (AC_LOG_COMPILED(log_level)) {                                                   \
+            static ac_log_site_t ac_log_site_ = {                                           \
+                .format = (fmt), .file = __FILE__, .line = __LINE__, .level = (log_level)}; \
+            if (0) {                                                                        \
+                ac_log_binary_check(fmt, ##__VA_ARGS__);                                    \
+            }                                                                               \
+            ac_log_binary(&ac_log_site_, ##__VA_ARGS__);                                    \
+        }                                                                                   \
+    } while (0)
+
+/**
+ * Log a binary message with the TRACE level.
+ * @param fmt The format string.
+ * @param ... The format arguments.
+ */
+#define ac_log_binary_trace(fmt, ...) AC_LOG_BINARY(AC_LOG_LEVEL_TRACE, fmt, ##__VA_ARGS__)
+
+/**
+ * Log a binary message with the DEBUG level.
+ * @param fmt The format string.
+ * @param ... The format arguments.
+ */
+#define ac_log_binary_debug(fmt, ...) AC_LOG_BINARY(AC_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+/**
+ * Log a binary message with the INFO level.
+ * @param fmt The format string.
+ * @param ... The format arguments.
+ */
+#define ac_log_binary_info(fmt, ...) AC_LOG_BINARY(AC_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+
+/**
+ * Log a binary message with the WARN level.
+ * @param fmt The format string.
+ * @param ... The format arguments.
+ */
+#define ac_log_binary_warn(fmt, ...) AC_LOG_BINARY(AC_LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+
+/**
+ * Log a binary message with the ERROR level.
+ * @param fmt The format string.
+ * @param ... The format arguments.
+ */
+#define ac_log_binary_error(fmt, ...) AC_LOG_BINARY(AC_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+
+#endif  // ACETATE_CORE_LOG_BINARY_H
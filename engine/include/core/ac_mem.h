@@ -75,6 +75,9 @@ void set_custom_realloc(ac_realloc_t realloc);
 /**
  * Enable/Disable memory tracking.
  * Memory tracking is enabled by default.
+ * Tracked blocks carry a header that untracked blocks don't have, so this
+ * has to be decided before the first allocation. Calls made after the first
+ * tracked allocation are ignored.
  * @param enabled Whether to enable memory tracking.
  */
 void ac_mem_track_enabled(bool enabled);
@@ -103,22 +106,88 @@ typedef enum ac_mem_entry_type_t {
 } ac_mem_entry_type_t;
 
 /**
- * The struct holding the details of a memory entry.
+ * Get the name of a memory entry type.
+ * @param type The memory entry type.
+ * @return The name of the type, e.g. "AC_MEM_ENTRY_CORE".
+ */
+const char *ac_mem_entry_type_str(ac_mem_entry_type_t type);
+
+/**
+ * Canary stored in the header of every live tracked block.
+ * @see ac_mem_entry_t
+ */
+#define AC_MEM_CANARY_ALIVE 0xAC3E7A7Eu
+
+/**
+ * Canary stored in the header of a tracked block once it has been freed.
+ * @see ac_mem_entry_t
+ */
+#define AC_MEM_CANARY_FREED 0xDEADF4EEu
+
+/**
+ * The entry has a stack trace and is linked in the live list.
+ * Every tracked entry has it unless sampling skipped it.
+ * @see ac_mem_set_sample_interval
+ */
+#define AC_MEM_ENTRY_FLAG_TRACED 0x1u
+
+/**
+ * The entry was picked by the sampler and stands for about
+ * interval / size allocations of its size.
+ * @see ac_mem_set_sample_interval
+ */
+#define AC_MEM_ENTRY_FLAG_SAMPLED 0x2u
+
+/**
+ * The block has a mapping of its own instead of coming from the malloc
+ * function.
+ * @see ac_mem_set_large_threshold
+ */
+#define AC_MEM_ENTRY_FLAG_MAPPED 0x4u
+
+/**
+ * The header placed in front of every tracked memory block.
+ * The pointer handed out by ac_malloc points right past it, so the entry of
+ * a block is found in O(1) without any lookup. Live entries are chained in
+ * an intrusive list owned by the thread that allocated them, so tracking
+ * never takes a global lock. ac_mem_show_usage and ac_mem_exit merge the
+ * per-thread lists when they run.
  * You won't need to use this struct directly.
  * @brief A memory entry.
  * @see ac_mem_entry_state_t
  * @see ac_mem_entry_type_t
- * @see ac_mem_entry_t
  */
 typedef struct ac_mem_entry_t {
     /**
-     * The pointer to the memory block.
+     * The previous live entry.
+     */
+    struct ac_mem_entry_t *prev;
+    /**
+     * The next live entry.
+     */
+    struct ac_mem_entry_t *next;
+    /**
+     * The per-thread record the entry is linked in.
      */
-    void *ptr;
+    void *owner;
     /**
-     * The size of the memory block.
+     * The size of the memory block, without the header.
      */
     size_t size;
+    /**
+     * The interned stack trace of the allocation.
+     * @see ac_trace_intern
+     */
+    uint32_t alloc_trace;
+    /**
+     * The interned stack trace of the last reallocation.
+     * @see ac_trace_intern
+     */
+    uint32_t realloc_trace;
+    /**
+     * The number of reallocations.
+     */
+    int32_t realloc_count;
     /**
      * The state of the memory entry.
      * @see ac_mem_entry_state_t
@@ -130,57 +199,209 @@ typedef struct ac_mem_entry_t {
      */
     ac_mem_entry_type_t type;
     /**
-     * The stack trace of the allocation.
+     * AC_MEM_ENTRY_FLAG_* bits.
      */
-    void **alloc_trace;
+    uint32_t flags;
     /**
-     * The size of the stack trace.
+     * Bytes between the start of the underlying allocation and the header.
+     * Only aligned blocks have any.
+     * @see ac_malloc_aligned
      */
-    int32_t alloc_trace_size;
+    uint16_t offset;
     /**
-     * The stack trace of the free.
+     * The alignment the block was allocated with, 0 for the default one.
+     * Kept across reallocations.
+     * @see ac_malloc_aligned
      */
-    void **free_trace;
+    uint16_t alignment;
     /**
-     * The size of the stack trace.
+     * AC_MEM_CANARY_ALIVE while the block is live, AC_MEM_CANARY_FREED after.
+     * The last field, right before the user data, so underflows clobber it
+     * first.
      */
-    int32_t free_trace_size;
+    uint32_t canary;
+} ac_mem_entry_t;
+
+/**
+ * Set the sampling interval of memory tracking.
+ * With an interval of 0, the default, every tracked allocation captures a
+ * stack trace and is linked in the live list. Otherwise allocations are
+ * sampled with a mean of one per interval bytes, following a Poisson process
+ * over allocated bytes, and the rest only bump the counters.
+ * ac_mem_show_usage scales the samples back up to estimate the live heap and
+ * the leak report only lists sampled blocks.
+ * Can be changed at any time, it applies to allocations made afterwards.
+ * @param interval The mean number of bytes between samples, 0 to trace all.
+ */
+void ac_mem_set_sample_interval(size_t interval);
+
+/**
+ * Default size from which tracked blocks get a mapping of their own.
+ * @see ac_mem_set_large_threshold
+ */
+#define AC_MEM_LARGE_THRESHOLD (1024 * 1024)
+
+/**
+ * Set the size from which tracked blocks get a mapping of their own.
+ * Such blocks are mmapped and grown with mremap, which moves pages instead of
+ * copying the data, so growing large buffers costs no copy. A block that
+ * grows past the threshold is copied once into a mapping and stays mapped.
+ * Large blocks bypass the custom malloc functions.
+ * Can be changed at any time, it applies to allocations made afterwards.
+ * @param threshold The size in bytes, 0 to never map blocks.
+ */
+void ac_mem_set_large_threshold(size_t threshold);
+
+/**
+ * Called when a memory type goes over one of its budgets.
+ * Runs on the allocating thread, in the middle of the allocation, so it
+ * should be quick. It may free memory, allocations it makes don't call it
+ * again.
+ * @param type The memory type.
+ * @param live_bytes The live bytes of the type.
+ * @param budget The budget that was crossed.
+ * @param hard Whether it's the hard budget. The allocation fails if the
+ * callback doesn't free enough for it to fit.
+ * @param user_data The pointer given to ac_mem_set_budget.
+ * @see ac_mem_set_budget
+ */
+typedef void (*ac_mem_budget_callback_t)(ac_mem_entry_type_t type, size_t live_bytes, size_t budget, bool hard, void *user_data);
+
+/**
+ * Set the budgets of a memory type.
+ * Checked in O(1) against the counters on every tracked allocation. Going
+ * over the soft budget calls the callback once per crossing, so subsystems
+ * can evict caches. An allocation that would go over the hard budget calls
+ * it too and returns NULL if it still doesn't fit. Threads allocating the
+ * same type concurrently can overshoot the hard budget slightly.
+ * Meant to be set up before other threads allocate.
+ * @param type The memory type, an invalid one is logged and ignored.
+ * @param soft The soft budget in bytes, 0 for none.
+ * @param hard The hard budget in bytes, 0 for none.
+ * @param callback The function to call, can be NULL.
+ * @param user_data Passed to the callback.
+ */
+void ac_mem_set_budget(ac_mem_entry_type_t type, size_t soft, size_t hard, ac_mem_budget_callback_t callback, void *user_data);
+
+/**
+ * Attribute the allocations of the calling thread to a memory type.
+ * Until the matching ac_mem_pop_type, ac_malloc, ac_calloc and
+ * ac_malloc_aligned ignore their type argument and use this one instead, so
+ * a whole subsystem can be accounted without passing the type everywhere.
+ * Scopes nest. Reallocated blocks keep their type.
+ * @param type The memory type.
+ */
+void ac_mem_push_type(ac_mem_entry_type_t type);
+
+/**
+ * End the scope of the last ac_mem_push_type.
+ */
+void ac_mem_pop_type(void);
+
+/**
+ * Initialize memory management.
+ * This function should be called at the beginning of the program.
+ * ac_malloc and friends are thread safe, tracking included.
+ */
+void ac_mem_init(void);
+
+/**
+ * Display usage
+ */
+void ac_mem_show_usage(void);
+
+/**
+ * Counters of one memory entry type.
+ * Reallocations count as one free of the old size and one allocation of the
+ * new size.
+ * @see ac_mem_get_stats
+ * @see ac_mem_frame_stats_t
+ */
+typedef struct ac_mem_stats_t {
     /**
-     * The stack traces of the reallocation, its a darray
+     * Bytes currently allocated.
      */
-    void **realloc_traces;
+    size_t live_bytes;
     /**
-     * size of the realloc_traces darray
+     * Highest value live_bytes has reached.
      */
-    int32_t realloc_traces_size;
+    size_t peak_bytes;
     /**
-     * The capacity of the realloc_traces darray
+     * Number of allocations.
      */
-    int32_t realloc_traces_capacity;
+    size_t alloc_count;
     /**
-     * The sizes of the reallocated memory blocks.
+     * Bytes allocated.
      */
-    int32_t *realloc_trace_sizes;
+    size_t alloc_bytes;
     /**
-     * The number of reallocations.
+     * Number of frees.
      */
-    int32_t realloc_count;
+    size_t free_count;
     /**
-     * The capacity of the realloc_trace_sizes darray
+     * Bytes freed.
      */
-    int32_t realloc_trace_sizes_capacity;
-} ac_mem_entry_t;
+    size_t free_bytes;
+} ac_mem_stats_t;
 
 /**
- * Initialize memory management.
- * This function should be called at the beginning of the program.
+ * Get the counters of a memory entry type since the start of the program.
+ * The counters are atomics updated by ac_malloc and friends, so this is O(1)
+ * and can be called every frame. They are only kept while tracking is enabled.
+ * @param type The memory entry type.
+ * @param stats Filled with the counters, zeroed for an invalid type.
  */
-void ac_mem_init(void);
+void ac_mem_get_stats(ac_mem_entry_type_t type, ac_mem_stats_t *stats);
 
 /**
- * Display usage
+ * Number of frames kept by ac_mem_frame_end.
  */
-void ac_mem_show_usage(void);
+#define AC_MEM_FRAME_HISTORY 128
+
+/**
+ * Memory activity of one frame.
+ * In each entry of types, live_bytes is the value at the end of the frame,
+ * peak_bytes the highest value during the frame and the other counters only
+ * count what happened during the frame.
+ * @see ac_mem_get_frame_stats
+ */
+typedef struct ac_mem_frame_stats_t {
+    /**
+     * Index of the frame, counting from 0.
+     */
+    uint64_t frame;
+    /**
+     * Counters per memory entry type.
+     */
+    ac_mem_stats_t types[AC_MEM_ENTRY_COUNT];
+} ac_mem_frame_stats_t;
+
+/**
+ * End the current frame and start the next one.
+ * Records a snapshot of the counters in a ring of the last
+ * AC_MEM_FRAME_HISTORY frames. Called by ac_window_update, the first frame
+ * covers everything allocated before it.
+ */
+void ac_mem_frame_end(void);
+
+/**
+ * Get the memory activity of a past frame.
+ * @param frames_ago 0 for the last ended frame, 1 for the one before...
+ * @param stats Filled with the frame.
+ * @return false if the frame is not in the history.
+ */
+bool ac_mem_get_frame_stats(size_t frames_ago, ac_mem_frame_stats_t *stats);
+
+/**
+ * Write a binary snapshot of the live traced blocks to a file.
+ * Nothing is symbolized, the snapshot holds raw trace addresses and the
+ * executable modules of the process so it can be done offline. It can be
+ * taken at any time, compare two of them with the ac_memdiff tool.
+ * @param path The file to write.
+ * @return false if tracking is disabled or the file can't be written.
+ * @see ac_mem_snapshot.h
+ */
+bool ac_mem_write_snapshot(const char *path);
 
 /**
  * Malloc function.
@@ -221,6 +442,48 @@ void *ac_calloc(size_t nmemb, size_t size, ac_mem_entry_type_t type);
  */
 void *ac_realloc(void *ptr, size_t size, ac_mem_entry_type_t type);
 
+/**
+ * The largest alignment ac_malloc_aligned accepts.
+ */
+#define AC_MEM_MAX_ALIGNMENT 4096
+
+/**
+ * Aligned malloc function.
+ * Tracked like ac_malloc, the padding needed to align the block is not
+ * counted in its size.
+ * @param size The size of the memory block to allocate.
+ * @param alignment The alignment of the block, a power of two up to
+ * AC_MEM_MAX_ALIGNMENT.
+ * @param type The type of the memory block.
+ * @see ac_mem_entry_type_t
+ * @return A pointer to the allocated memory block, NULL if the alignment is
+ * invalid.
+ * @see ac_free_aligned
+ */
+void *ac_malloc_aligned(size_t size, size_t alignment, ac_mem_entry_type_t type);
+
+/**
+ * Aligned realloc function.
+ * The block keeps its alignment, the content is moved if the new memory
+ * doesn't have it.
+ * @param ptr A pointer to the memory block to reallocate, from
+ * ac_malloc_aligned.
+ * @param size The new size of the memory block.
+ * @param alignment The alignment the block was allocated with.
+ * @param type The type of the memory block.
+ * @see ac_mem_entry_type_t
+ * @return A pointer to the reallocated memory block.
+ */
+void *ac_realloc_aligned(void *ptr, size_t size, size_t alignment, ac_mem_entry_type_t type);
+
+/**
+ * Aligned free function.
+ * Blocks from ac_malloc_aligned have to be freed with it. ac_free only
+ * handles them while memory tracking is enabled.
+ * @param ptr A pointer to the memory block to free.
+ */
+void ac_free_aligned(void *ptr);
+
 /**
  * Memcpy function.
  * @param dest The destination memory block.
@@ -0,0 +1,141 @@
+#ifndef AC_CORE_MEM_SNAPSHOT_H
+#define AC_CORE_MEM_SNAPSHOT_H
+
+/**
+ * @file ac_mem_snapshot.h
+ * @brief File format of the heap snapshots written by ac_mem_write_snapshot.
+ *
+ * A snapshot is, in this order and in the byte order of the host:
+ * - an ac_mem_snapshot_header_t,
+ * - module_count ac_mem_snapshot_module_t, each followed by path_len bytes
+ *   of path, not NUL terminated,
+ * - block_count ac_mem_snapshot_block_t,
+ * - trace_count traces, each an ac_mem_snapshot_trace_t followed by
+ *   frame_count uint64_t return addresses.
+ *
+ * Traces are the interned ones, ids included, so blocks refer to them by id
+ * and the addresses are written once per call stack, not once per block.
+ * Addresses are raw, the modules are what is needed to symbolize them
+ * offline, relative to the file they come from.
+ */
+
+#include <stdint.h>
+
+/**
+ * "ACMS" in little endian.
+ */
+#define AC_MEM_SNAPSHOT_MAGIC 0x534D4341u
+
+/**
+ * Bumped on every change of the format.
+ */
+#define AC_MEM_SNAPSHOT_VERSION 1u
+
+/**
+ * Number of frames at the top of every trace that belong to the tracking
+ * itself, ac_get_intermediate_trace then ac_malloc and friends. The
+ * allocating code starts right after them.
+ */
+#define AC_MEM_SNAPSHOT_TRACE_SKIP 2
+
+/**
+ * Start of a snapshot.
+ */
+typedef struct ac_mem_snapshot_header_t {
+    /**
+     * AC_MEM_SNAPSHOT_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * AC_MEM_SNAPSHOT_VERSION.
+     */
+    uint32_t version;
+    /**
+     * The sample interval when the snapshot was taken, 0 if every block is
+     * in it.
+     * @see ac_mem_set_sample_interval
+     */
+    uint64_t sample_interval;
+    /**
+     * Number of modules.
+     */
+    uint32_t module_count;
+    /**
+     * Number of traces.
+     */
+    uint32_t trace_count;
+    /**
+     * Number of blocks.
+     */
+    uint64_t block_count;
+} ac_mem_snapshot_header_t;
+
+/**
+ * An executable mapping of /proc/self/maps.
+ */
+typedef struct ac_mem_snapshot_module_t {
+    /**
+     * First address of the mapping.
+     */
+    uint64_t start;
+    /**
+     * Address right past the mapping.
+     */
+    uint64_t end;
+    /**
+     * Offset of the mapping in the file.
+     */
+    uint64_t file_offset;
+    /**
+     * Length of the path that follows.
+     */
+    uint32_t path_len;
+    /**
+     * Keeps the struct free of implicit padding.
+     */
+    uint32_t padding;
+} ac_mem_snapshot_module_t;
+
+/**
+ * An interned stack trace.
+ */
+typedef struct ac_mem_snapshot_trace_t {
+    /**
+     * The id blocks refer to it with.
+     * @see ac_trace_intern
+     */
+    uint32_t id;
+    /**
+     * Number of addresses that follow.
+     * @see AC_MEM_SNAPSHOT_TRACE_SKIP
+     */
+    uint32_t frame_count;
+} ac_mem_snapshot_trace_t;
+
+/**
+ * A live traced block.
+ */
+typedef struct ac_mem_snapshot_block_t {
+    /**
+     * Size of the block.
+     */
+    uint64_t size;
+    /**
+     * Trace of the allocation.
+     */
+    uint32_t alloc_trace;
+    /**
+     * Trace of the last reallocation, 0 if none.
+     */
+    uint32_t realloc_trace;
+    /**
+     * The ac_mem_entry_type_t of the block.
+     */
+    uint32_t type;
+    /**
+     * The AC_MEM_ENTRY_FLAG_* bits of the block.
+     */
+    uint32_t flags;
+} ac_mem_snapshot_block_t;
+
+#endif  // AC_CORE_MEM_SNAPSHOT_H
@@ -0,0 +1,152 @@
+#ifndef AC_CORE_PERF_H
+#define AC_CORE_PERF_H
+
+/**
+ * @file ac_perf.h
+ * @brief Hardware performance counters of code regions.
+ *
+ * Regions are measured with AC_PERF_SCOPE, which compiles to nothing unless
+ * AC_PERF_ENABLE is defined. Each thread reads its own perf_event_open group
+ * counting user space only. Reading the group is a system call, about a
+ * microsecond, so measure regions well above that. Where perf events aren't
+ * permitted, see /proc/sys/kernel/perf_event_paranoid, regions only count
+ * calls.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Counters of the group.
+ */
+typedef enum ac_perf_counter_t {
+    AC_PERF_CYCLES,
+    AC_PERF_INSTRUCTIONS,
+    AC_PERF_CACHE_MISSES,
+    AC_PERF_BRANCH_MISSES,
+    AC_PERF_COUNTER_COUNT
+} ac_perf_counter_t;
+
+/**
+ * Values of the counters of the calling thread at some point.
+ * @see ac_perf_read
+ */
+typedef struct ac_perf_sample_t {
+    uint64_t values[AC_PERF_COUNTER_COUNT];
+    /**
+     * Time the group was enabled and running, they differ when the kernel
+     * multiplexes more events than the CPU has counters.
+     */
+    uint64_t time_enabled;
+    uint64_t time_running;
+    /**
+     * Bit i is set if values[i] was read.
+     */
+    uint32_t valid;
+} ac_perf_sample_t;
+
+/**
+ * A measured region, declared static by AC_PERF_SCOPE.
+ * Totals are summed over every thread and every call.
+ */
+typedef struct ac_perf_zone_t {
+    const char* name;
+    struct ac_perf_zone_t* next;
+    _Atomic bool registered;
+    _Atomic uint64_t calls;
+    /**
+     * Calls where the counter could be read.
+     */
+    _Atomic uint64_t measured[AC_PERF_COUNTER_COUNT];
+    _Atomic uint64_t totals[AC_PERF_COUNTER_COUNT];
+} ac_perf_zone_t;
+
+/**
+ * A region being measured.
+ * @see ac_perf_scope_begin
+ */
+typedef struct ac_perf_scope_t {
+    ac_perf_zone_t* zone;
+    ac_perf_sample_t start;
+} ac_perf_scope_t;
+
+/**
+ * Per call averages of a zone.
+ * @see ac_perf_zone_summary
+ */
+typedef struct ac_perf_summary_t {
+    uint64_t calls;
+    /**
+     * Average of each counter per call, 0 when it was never read.
+     */
+    double per_call[AC_PERF_COUNTER_COUNT];
+    /**
+     * Whether each counter was read at least once.
+     */
+    bool available[AC_PERF_COUNTER_COUNT];
+    /**
+     * Instructions per cycle, 0 without both counters.
+     */
+    double ipc;
+} ac_perf_summary_t;
+
+/**
+ * Read the counters of the calling thread.
+ * The group of the thread is opened on the first call, counters the CPU or
+ * the kernel don't provide are left out, a warning is logged once if none
+ * can be opened.
+ * @param sample Filled with the counters read.
+ * @return false if no counter could be read.
+ */
+bool ac_perf_read(ac_perf_sample_t* sample);
+
+/**
+ * Start measuring a zone.
+ * Not intended to be called directly.
+ * @param zone The zone.
+ * @return The scope to pass to ac_perf_scope_end.
+ */
+ac_perf_scope_t ac_perf_scope_begin(ac_perf_zone_t* zone);
+
+/**
+ * Stop measuring a zone and add the difference to its totals.
+ * Not intended to be called directly.
+ * @param scope The scope returned by ac_perf_scope_begin.
+ */
+void ac_perf_scope_end(ac_perf_scope_t* scope);
+
+/**
+ * Get the per call averages of a zone.
+ * @param zone The zone.
+ * @param summary Filled with the averages.
+ */
+void ac_perf_zone_summary(ac_perf_zone_t* zone, ac_perf_summary_t* summary);
+
+/**
+ * Log the averages of every zone measured so far with ac_log_info.
+ */
+void ac_perf_log(void);
+
+#define AC_PERF_CONCAT_(a, b) a##b
+#define AC_PERF_CONCAT(a, b) AC_PERF_CONCAT_(a, b)
+
+#ifdef AC_PERF_ENABLE
+
+/**
+ * Measure the rest of the enclosing block.
+ * The counters are read once here and once when the block is left. Zones
+ * nest, the counts of a zone include the zones inside it.
+ * @param zone_name The name of the zone, a string literal.
+ */
+#define AC_PERF_SCOPE(zone_name)                                                                             \
+    static ac_perf_zone_t AC_PERF_CONCAT(ac_perf_zone_, __LINE__) = {.name = (zone_name)};                 \
+    ac_perf_scope_t AC_PERF_CONCAT(ac_perf_scope_, __LINE__) __attribute__((cleanup(ac_perf_scope_end))) = \
+        ac_perf_scope_begin(&AC_PERF_CONCAT(ac_perf_zone_, __LINE__))
+
+#else
+
+#define AC_PERF_SCOPE(zone_name) ((void)0)
+
+#endif  // AC_PERF_ENABLE
+
+#endif  // AC_CORE_PERF_H
@@ -0,0 +1,146 @@
+#ifndef AC_CORE_POOL_H
+#define AC_CORE_POOL_H
+
+/**
+ * @file ac_pool.h
+ * @brief Fixed-size slab allocator for small objects.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "core/ac_mem.h"
+
+/**
+ * Number of size classes of a pool.
+ */
+#define AC_POOL_CLASS_COUNT 8
+
+/**
+ * Largest request served from a size class.
+ * Anything larger is forwarded to ac_malloc.
+ */
+#define AC_POOL_MAX_SIZE 256
+
+/**
+ * Size of a slab, the unit a size class grows by.
+ */
+#define AC_POOL_SLAB_SIZE (64 * 1024)
+
+/**
+ * Number of blocks a thread-local magazine holds per size class.
+ */
+#define AC_POOL_MAGAZINE_SIZE 32
+
+/**
+ * Number of thread cached pools that can exist at the same time.
+ */
+#define AC_POOL_MAX_CACHED_POOLS 4
+
+/**
+ * Pool object.
+ */
+typedef struct ac_pool_t ac_pool_t;
+
+/**
+ * Statistics of one size class of a pool.
+ * In thread cached pools the counts are taken at the central free list, blocks
+ * parked in a thread's magazine count as live.
+ * @see ac_pool_get_stats
+ */
+typedef struct ac_pool_stats_t {
+    /**
+     * The size of the blocks of the class.
+     */
+    size_t block_size;
+    /**
+     * The number of blocks handed out.
+     */
+    size_t alloc_count;
+    /**
+     * The number of blocks given back.
+     */
+    size_t free_count;
+    /**
+     * The number of blocks currently handed out.
+     */
+    size_t live;
+    /**
+     * The largest value live reached.
+     */
+    size_t peak_live;
+    /**
+     * The number of slabs owned by the class.
+     */
+    size_t slab_count;
+} ac_pool_stats_t;
+
+/**
+ * Create a pool.
+ * Blocks are served from per-size-class free lists refilled from slabs, so
+ * alloc and free are O(1).
+ * @param name The name shown in the usage report.
+ * @param thread_cached Whether the pool may be used from several threads.
+ * Such pools keep a magazine of blocks per thread and size class and only
+ * lock to refill or drain it in batches. Otherwise the pool is not thread safe.
+ * @param mem_type The memory type of the slabs.
+ * @return The new pool, NULL if AC_POOL_MAX_CACHED_POOLS thread cached pools
+ * already exist.
+ */
+ac_pool_t* ac_pool_create(const char* name, bool thread_cached, ac_mem_entry_type_t mem_type);
+
+/**
+ * Destroy a pool and release its slabs.
+ * Blocks still handed out become invalid.
+ * @param pool The pool.
+ */
+void ac_pool_destroy(ac_pool_t* pool);
+
+/**
+ * Allocate a block.
+ * @param pool The pool.
+ * @param size The size of the block. Sizes above AC_POOL_MAX_SIZE go to ac_malloc.
+ * @return The block, aligned to 16 bytes.
+ */
+void* ac_pool_alloc(ac_pool_t* pool, size_t size);
+
+/**
+ * Free a block.
+ * @param pool The pool the block came from.
+ * @param ptr The block, may be NULL.
+ * @param size The size the block was allocated with.
+ */
+void ac_pool_free(ac_pool_t* pool, void* ptr, size_t size);
+
+/**
+ * Get the statistics of a size class.
+ * @param pool The pool.
+ * @param class_index The size class, below AC_POOL_CLASS_COUNT.
+ * @param stats The statistics.
+ */
+void ac_pool_get_stats(ac_pool_t* pool, size_t class_index, ac_pool_stats_t* stats);
+
+/**
+ * Log the statistics of every live pool.
+ * Called by ac_mem_show_usage.
+ */
+void ac_pool_show_usage(void);
+
+/**
+ * Get the pool the ds/ constructors take their headers and small buffers from.
+ * It is thread cached and created on first use, failing to create it is
+ * fatal.
+ * @return The data structure pool, never NULL.
+ */
+ac_pool_t* ac_pool_ds(void);
+
+/**
+ * Destroy the data structure pool, reporting blocks that were never freed.
+ * Blocks parked in the magazines of any thread are returned first, the other
+ * threads must not use the pool anymore. Pooled blocks carry no allocation
+ * trace, leaks are reported as counts per size class.
+ * Called by ac_mem_exit.
+ */
+void ac_pool_ds_shutdown(void);
+
+#endif  // AC_CORE_POOL_H
@@ -0,0 +1,127 @@
+#ifndef AC_CORE_PROFILE_H
+#define AC_CORE_PROFILE_H
+
+/**
+ * @file ac_profile.h
+ * @brief CPU profiling zones.
+ *
+ * Zones are recorded with the AC_PROFILE_* macros, which compile to nothing
+ * unless AC_PROFILE_ENABLE is defined. The functions behind them are always
+ * available.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Number of events kept per thread, older ones are overwritten.
+ */
+#define AC_PROFILE_RING_SIZE 65536
+
+/**
+ * Number of frames that can be exported.
+ * @see ac_profile_export
+ */
+#define AC_PROFILE_FRAME_HISTORY 1024
+
+/**
+ * Open a zone on the calling thread.
+ * Zones nest and are closed in reverse order. Writes a timestamp to a ring
+ * buffer owned by the thread, no lock is taken.
+ * @param name The name of the zone, must live as long as the program, a
+ * string literal.
+ */
+void ac_profile_begin(const char* name);
+
+/**
+ * Close the innermost zone of the calling thread.
+ */
+void ac_profile_end(void);
+
+/**
+ * Close a zone opened by AC_PROFILE_SCOPE.
+ * Not intended to be called directly.
+ * @param scope The scope variable.
+ */
+void ac_profile_scope_end(int* scope);
+
+/**
+ * Record a zone measured on the GPU.
+ * GPU zones go to their own track of the timeline. They're recorded once the
+ * GPU is done, always from the same thread, in the order they started.
+ * @param name The name of the zone, a string literal.
+ * @param begin_ticks When the zone started, converted with ac_time_ns_to_ticks.
+ * @param end_ticks When the zone ended.
+ */
+void ac_profile_gpu_zone(const char* name, uint64_t begin_ticks, uint64_t end_ticks);
+
+/**
+ * Start a new frame.
+ * Called by ac_window_update. Frames are numbered from 1, frame 0 covers
+ * everything before the first call.
+ */
+void ac_profile_frame_mark(void);
+
+/**
+ * Get the number of the current frame.
+ * @return The frame number.
+ * @see ac_profile_frame_mark
+ */
+uint64_t ac_profile_frame(void);
+
+/**
+ * Write the zones of a range of frames as Chrome trace JSON.
+ * The file opens in chrome://tracing and ui.perfetto.dev. Zones of every
+ * thread overlapping the range are written, cut to the range. Frames must be
+ * among the last AC_PROFILE_FRAME_HISTORY ones, and zones overwritten in the
+ * ring buffers are lost.
+ * @param path The path of the file.
+ * @param first_frame The first frame of the range.
+ * @param last_frame The last frame of the range, included.
+ * @return false if the range isn't available or the file can't be written.
+ */
+bool ac_profile_export(const char* path, uint64_t first_frame, uint64_t last_frame);
+
+#define AC_PROFILE_CONCAT_(a, b) a##b
+#define AC_PROFILE_CONCAT(a, b) AC_PROFILE_CONCAT_(a, b)
+
+#ifdef AC_PROFILE_ENABLE
+
+/**
+ * Profile the rest of the enclosing block as a zone.
+ * The zone is closed when the block is left, whichever way.
+ * @param name The name of the zone, a string literal.
+ */
+#define AC_PROFILE_SCOPE(name)                                                                           \
+    int AC_PROFILE_CONCAT(ac_profile_scope_, __LINE__) __attribute__((cleanup(ac_profile_scope_end))) = \
+        (ac_profile_begin(name), 0)
+
+/**
+ * Open a zone.
+ * @param name The name of the zone, a string literal.
+ * @see ac_profile_begin
+ */
+#define AC_PROFILE_BEGIN(name) ac_profile_begin(name)
+
+/**
+ * Close the innermost zone.
+ * @see ac_profile_end
+ */
+#define AC_PROFILE_END() ac_profile_end()
+
+/**
+ * Start a new frame.
+ * @see ac_profile_frame_mark
+ */
+#define AC_PROFILE_FRAME() ac_profile_frame_mark()
+
+#else
+
+#define AC_PROFILE_SCOPE(name) ((void)0)
+#define AC_PROFILE_BEGIN(name) ((void)0)
+#define AC_PROFILE_END() ((void)0)
+#define AC_PROFILE_FRAME() ((void)0)
+
+#endif  // AC_PROFILE_ENABLE
+
+#endif  // AC_CORE_PROFILE_H
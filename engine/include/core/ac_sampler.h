@@ -0,0 +1,77 @@
+#ifndef AC_CORE_SAMPLER_H
+#define AC_CORE_SAMPLER_H
+
+/**
+ * @file ac_sampler.h
+ * @brief Sampling CPU profiler.
+ *
+ * A SIGPROF timer interrupts whichever thread is using the CPU and records its
+ * stack by following frame pointers, code built without them shows up as its
+ * innermost function only. Samples are stored raw, symbols are only resolved
+ * when they are written out.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of frames recorded per sample.
+ */
+#define AC_SAMPLER_MAX_DEPTH 64
+
+/**
+ * Size of the sample buffer in bytes, samples taken once it's full are
+ * dropped. Holds about 100 seconds at 1000 Hz with 20 frames per sample.
+ */
+#define AC_SAMPLER_BUFFER_SIZE (16 * 1024 * 1024)
+
+/**
+ * Start sampling.
+ * Samples taken by a previous run are discarded. The buffer is mapped on the
+ * first call and kept, sampling itself never allocates, locks or calls into
+ * the C library. Registers the calling thread.
+ * @param frequency Samples per second of CPU time used by the process. The
+ * timer only fires on scheduler ticks, higher rates than the kernel HZ are
+ * capped to it.
+ * @return false if sampling is already running or can't be set up.
+ * @see ac_sampler_register_thread
+ */
+bool ac_sampler_start(uint32_t frequency);
+
+/**
+ * Stop sampling.
+ * Returns once no sample is being written anymore.
+ */
+void ac_sampler_stop(void);
+
+/**
+ * Let samples of the calling thread record its whole stack.
+ * The walk needs the top of the stack of the thread to know where to stop,
+ * samples of threads that never called this only record the interrupted
+ * function.
+ */
+void ac_sampler_register_thread(void);
+
+/**
+ * Get the number of samples recorded by the last run.
+ * @param dropped Set to the number of samples dropped because the buffer was
+ * full, can be NULL.
+ * @return The number of samples in the buffer.
+ */
+size_t ac_sampler_samples(size_t* dropped);
+
+/**
+ * Write the samples as folded stacks.
+ * One line per distinct stack, functions from main to the innermost joined
+ * by ';' followed by the number of samples, the input of flamegraph.pl,
+ * inferno and speedscope. Identical stacks are folded in a table of their
+ * own, the traces of ac_trace are left alone, then resolved with
+ * ac_symbol_resolve, so the first write after a run takes a while. Sampling
+ * must be stopped.
+ * @param path The path of the file.
+ * @return false if sampling is running or the file can't be written.
+ */
+bool ac_sampler_write_folded(const char* path);
+
+#endif  // AC_CORE_SAMPLER_H
@@ -0,0 +1,116 @@
+#ifndef AC_CORE_SYMBOL_H
+#define AC_CORE_SYMBOL_H
+
+/**
+ * @file ac_symbol.h
+ * @brief In-process address symbolizer.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * What is known about a code address.
+ * The strings point into the loaded symbol tables and stay valid for the
+ * lifetime of the process.
+ * @see ac_symbol_resolve
+ */
+typedef struct ac_symbol_t {
+    /**
+     * Name of the function containing the address, NULL if unknown.
+     */
+    const char* function;
+    /**
+     * Offset of the address from the start of function.
+     */
+    uintptr_t offset;
+    /**
+     * Path of the module containing the address, NULL if it's in no module.
+     */
+    const char* module;
+    /**
+     * Offset of the address from the load address of module.
+     */
+    uintptr_t module_offset;
+    /**
+     * Source file of the address, NULL without line info.
+     */
+    const char* file;
+    /**
+     * Directory file is relative to, NULL if file is absolute or relative to
+     * the compilation directory.
+     */
+    const char* directory;
+    /**
+     * Source line of the address, 0 without line info.
+     */
+    uint32_t line;
+} ac_symbol_t;
+
+/**
+ * Resolve a code address.
+ * The symbol table, and the DWARF line table when line info is enabled, of a
+ * module are loaded the first time one of its addresses is resolved, later
+ * lookups are binary searches. Modules loaded with dlopen are picked up on the
+ * fly. Thread safe.
+ * @param addr The address. Pass return addresses minus one so calls at the end
+ * of a function resolve to the caller.
+ * @param symbol Filled with what is known about the address.
+ * @return true if the function of the address is known.
+ */
+bool ac_symbol_resolve(const void* addr, ac_symbol_t* symbol);
+
+/**
+ * Print a resolved address on one line.
+ * Prints "function at file:line" with line info, "function+0x1f (module)"
+ * without, with the current working directory stripped from paths.
+ * @param symbol The resolved address.
+ * @param buffer The buffer to print to.
+ * @param size The size of the buffer.
+ * @return The number of characters printed, truncated to fit the buffer.
+ * @see ac_symbol_resolve
+ */
+int ac_symbol_sprint(const ac_symbol_t* symbol, char* buffer, size_t size);
+
+/**
+ * Number of slots of the symbol cache, it fills up to three quarters of them.
+ * @see ac_symbol_sprint_address
+ */
+#define AC_SYMBOL_CACHE_SIZE 16384
+
+/**
+ * Print the symbol of an address on one line, through a process-wide cache.
+ * The first time an address is seen it is resolved and printed with
+ * ac_symbol_sprint, the line is kept and reused by every later call. Once the
+ * cache is full new addresses are resolved each time. Thread safe.
+ * @param addr The address, as for ac_symbol_resolve.
+ * @param buffer The buffer to print to.
+ * @param size The size of the buffer.
+ * @return The number of characters printed, truncated to fit the buffer.
+ * @see ac_symbol_sprint_cached
+ */
+int ac_symbol_sprint_address(const void* addr, char* buffer, size_t size);
+
+/**
+ * Print the cached symbol of an address, or the raw address if it isn't
+ * cached yet.
+ * Never resolves, takes no lock and doesn't allocate, for paths where the
+ * process may be about to die or the heap may be corrupted.
+ * @param addr The address.
+ * @param buffer The buffer to print to.
+ * @param size The size of the buffer.
+ * @return The number of characters printed, truncated to fit the buffer.
+ * @see ac_symbol_sprint_address
+ */
+int ac_symbol_sprint_cached(const void* addr, char* buffer, size_t size);
+
+/**
+ * Enable or disable loading of DWARF line tables.
+ * Line tables are far bigger than symbol tables, disabling them makes the
+ * first lookup in a module cheaper. Enabled by default.
+ * @param enable Whether to resolve source lines.
+ */
+void ac_symbol_set_line_info(bool enable);
+
+#endif  // AC_CORE_SYMBOL_H
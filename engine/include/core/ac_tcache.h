@@ -0,0 +1,111 @@
+#ifndef AC_CORE_TCACHE_H
+#define AC_CORE_TCACHE_H
+
+/**
+ * @file ac_tcache.h
+ * @brief Thread-caching general purpose allocator.
+ */
+
+#include <stddef.h>
+
+/**
+ * Number of size classes.
+ */
+#define AC_TCACHE_CLASS_COUNT 40
+
+/**
+ * Largest block served from a size class, the 16 byte prefix included.
+ * Anything larger goes to the system malloc.
+ */
+#define AC_TCACHE_MAX_SIZE (32 * 1024)
+
+/**
+ * Statistics of one thread, or of all threads together.
+ * @see ac_tcache_get_stats
+ */
+typedef struct ac_tcache_stats_t {
+    /**
+     * The number of allocations.
+     */
+    size_t alloc_count;
+    /**
+     * The number of frees.
+     */
+    size_t free_count;
+    /**
+     * The number of allocations too large for a size class.
+     */
+    size_t large_count;
+    /**
+     * The number of batches taken from the central heap.
+     */
+    size_t refill_count;
+    /**
+     * The number of batches given back to the central heap.
+     */
+    size_t flush_count;
+    /**
+     * The bytes of free blocks sitting in the thread cache.
+     */
+    size_t cached_bytes;
+} ac_tcache_stats_t;
+
+/**
+ * Malloc function of the allocator.
+ * Blocks up to AC_TCACHE_MAX_SIZE come from per-thread caches of size-classed
+ * blocks, so the common case takes no lock. The caches are refilled from and
+ * flushed to a central heap in batches. Blocks carry a 16 byte prefix with
+ * their size and are 16 byte aligned.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block.
+ * @see ac_tcache_install
+ */
+void* ac_tcache_malloc(size_t size);
+
+/**
+ * Free function of the allocator.
+ * Blocks can be freed from any thread, they go to the cache of the freeing
+ * thread.
+ * @param ptr A pointer to the memory block to free, may be NULL.
+ */
+void ac_tcache_free(void* ptr);
+
+/**
+ * Calloc function of the allocator.
+ * @param nmemb The number of elements to allocate.
+ * @param size The size of each element.
+ * @return A pointer to the allocated memory block.
+ */
+void* ac_tcache_calloc(size_t nmemb, size_t size);
+
+/**
+ * Realloc function of the allocator.
+ * Stays in place while the new size fits the size class of the block.
+ * @param ptr A pointer to the memory block to reallocate.
+ * @param size The new size of the memory block.
+ * @return A pointer to the reallocated memory block.
+ */
+void* ac_tcache_realloc(void* ptr, size_t size);
+
+/**
+ * Make ac_malloc and friends use this allocator.
+ * Shorthand for set_custom_malloc and friends with the functions above. Has
+ * to be called before the first allocation, blocks from the previous
+ * functions can't be freed by this allocator.
+ */
+void ac_tcache_install(void);
+
+/**
+ * Get the statistics of the calling thread.
+ * Records of exited threads are reused by new ones, their counts carry over.
+ * @param stats Filled with the statistics.
+ */
+void ac_tcache_get_stats(ac_tcache_stats_t* stats);
+
+/**
+ * Log the statistics of every thread and the size of the central heap.
+ * Called by ac_mem_show_usage.
+ */
+void ac_tcache_show_usage(void);
+
+#endif  // AC_CORE_TCACHE_H
@@ -0,0 +1,61 @@
+#ifndef AC_CORE_TIME_H
+#define AC_CORE_TIME_H
+
+/**
+ * @file ac_time.h
+ * @brief Clocks for timing code.
+ */
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Read the monotonic clock.
+ * @return CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t ac_time_ns(void);
+
+/**
+ * Read the cheapest monotonic clock there is.
+ * The time stamp counter on x86, a few cycles and no system call, the
+ * monotonic clock in nanoseconds elsewhere. Ticks only mean something once
+ * converted with ac_time_ticks_to_ns.
+ * @return The current tick count.
+ */
+static inline uint64_t ac_time_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return ac_time_ns();
+#endif
+}
+
+/**
+ * Start measuring the rate of the tick counter.
+ * The rate is measured between this call and the first conversion, the
+ * longer in between the more precise. Called by whatever starts recording
+ * ticks, later calls do nothing.
+ */
+void ac_time_init(void);
+
+/**
+ * Convert a tick count to a time of the monotonic clock.
+ * The first call waits for at least 10 milliseconds to have passed since
+ * ac_time_init to measure the tick rate.
+ * @param ticks A tick count from ac_time_ticks.
+ * @return The matching CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t ac_time_ticks_to_ns(uint64_t ticks);
+
+/**
+ * Convert a time of the monotonic clock to a tick count.
+ * The inverse of ac_time_ticks_to_ns, for times measured on other clocks.
+ * @param ns A CLOCK_MONOTONIC time in nanoseconds.
+ * @return The matching tick count.
+ */
+uint64_t ac_time_ns_to_ticks(uint64_t ns);
+
+#endif  // AC_CORE_TIME_H
@@ -6,22 +6,82 @@
  * @brief Stack trace functions.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+/**
+ * Size of the buffers the sprint functions print to. Frames past it are cut.
+ */
+#define AC_TRACE_BUFFER_SIZE 4096
+
+/**
+ * How ac_get_intermediate_trace walks the stack.
+ * @see ac_trace_set_unwinder
+ */
+typedef enum ac_trace_unwinder_t {
+    /**
+     * glibc backtrace, walks the .eh_frame unwind tables. Works with any
+     * build but costs microseconds per trace.
+     */
+    AC_TRACE_UNWINDER_BACKTRACE,
+    /**
+     * Follows the chain of saved frame pointers, a few loads per frame. Needs
+     * the code on the stack built with -fno-omit-frame-pointer, the walk stops
+     * at the first frame without one. The default when built with
+     * AC_TRACE_FRAME_POINTERS.
+     */
+    AC_TRACE_UNWINDER_FRAME_POINTER,
+    /**
+     * Records only the caller. Tracked allocations record the caller of
+     * ac_malloc and friends, ac_get_intermediate_trace records its own caller.
+     */
+    AC_TRACE_UNWINDER_CALLER,
+} ac_trace_unwinder_t;
+
+/**
+ * Choose how stack traces are captured.
+ * Only affects ac_get_intermediate_trace and the traces of tracked
+ * allocations, the print functions capturing the current stack always use
+ * backtrace.
+ * @param unwinder The unwinder.
+ * @param depth The maximum number of frames captured, 0 for as many as fit.
+ */
+void ac_trace_set_unwinder(ac_trace_unwinder_t unwinder, size_t depth);
+
+/**
+ * Get the unwinder used to capture stack traces.
+ * @return The unwinder.
+ * @see ac_trace_set_unwinder
+ */
+ac_trace_unwinder_t ac_trace_get_unwinder(void);
+
+/**
+ * Get the address the call to this function returns to.
+ * Stands for the current position of the caller in traces built by hand.
+ * @return The return address.
+ */
+void* ac_trace_pc(void);
+
 /**
  * Get the current stack trace.
+ * The first frame is in ac_get_intermediate_trace itself, the second in its
+ * caller.
  * @param stack The stack trace.
  * @param size The size of the stack trace.
  * @return The number of stack frames.
+ * @see ac_trace_set_unwinder
  */
 int ac_get_intermediate_trace(void** stack, size_t size);
 
 /**
  * Print the given stack trace to the buffer received from
  * ac_get_intermediate_trace.
+ * One frame per line, symbolized in-process, up to main.
  * @param stack The stack trace.
  * @param size The size of the stack trace.
- * @param buffer The buffer to print the stack trace to.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
  * @param offset The offset to start printing from.
  * @return The number of characters printed.
  * @see ac_get_intermediate_trace
@@ -44,9 +104,157 @@ int ac_fprint_trace(FILE* fp, size_t offset);
 
 /**
  * Print the current stack trace to the given buffer.
- * @param buffer The buffer to print the stack trace to.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
  * @param offset The offset the stack trace by this amount.
  */
 int ac_sprint_trace(char* buffer, size_t offset);
 
+/**
+ * Print the given stack trace to the buffer using only symbols already cached.
+ * Frames never symbolized print as raw addresses. Never symbolizes, for fatal
+ * paths.
+ * @param stack The stack trace.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
+ * @param offset The offset to start printing from.
+ * @param size The size of the stack trace.
+ * @return The number of characters printed.
+ * @see ac_sprint_intermediate_trace
+ * @see ac_symbol_sprint_cached
+ */
+int ac_sprint_intermediate_trace_cached(void** stack, char* buffer, size_t offset, size_t size);
+
+/**
+ * Print the current stack trace to stdout using only symbols already cached.
+ * @param offset The offset the stack trace by this amount.
+ * @see ac_sprint_intermediate_trace_cached
+ */
+void ac_print_trace_cached(size_t offset);
+
+/**
+ * Print the current stack trace to the given file using only symbols already
+ * cached.
+ * @param fp The file to print the stack trace to.
+ * @param offset The offset the stack trace by this amount.
+ * @see ac_sprint_intermediate_trace_cached
+ */
+int ac_fprint_trace_cached(FILE* fp, size_t offset);
+
+/**
+ * Print the current stack trace to the given buffer using only symbols already
+ * cached.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
+ * @param offset The offset the stack trace by this amount.
+ * @see ac_sprint_intermediate_trace_cached
+ */
+int ac_sprint_trace_cached(char* buffer, size_t offset);
+
+/**
+ * Print the given stack trace to the given file from a background thread.
+ * The frames are copied and the call returns right away, the trace is
+ * symbolized and printed later, in call order. The file must stay open until
+ * ac_trace_flush.
+ * @param fp The file to print the stack trace to.
+ * @param stack The stack trace.
+ * @param offset The offset to start printing from.
+ * @param size The size of the stack trace.
+ * @see ac_sprint_intermediate_trace
+ */
+void ac_fprint_intermediate_trace_deferred(FILE* fp, void** stack, size_t offset, size_t size);
+
+/**
+ * Symbolize the given stack trace from a background thread.
+ * Nothing is printed, the symbols land in the symbol cache so the cached
+ * variants can print them later.
+ * @param stack The stack trace.
+ * @param size The size of the stack trace.
+ * @see ac_sprint_intermediate_trace_cached
+ */
+void ac_trace_symbolize_deferred(void** stack, size_t size);
+
+/**
+ * Wait until every deferred trace has been symbolized and printed.
+ */
+void ac_trace_flush(void);
+
+/**
+ * Id of an interned stack trace.
+ * @see ac_trace_intern
+ */
+typedef uint32_t ac_trace_id_t;
+
+/**
+ * The id standing for "no trace".
+ * @see ac_trace_id_t
+ */
+#define AC_TRACE_ID_NONE 0
+
+/**
+ * Intern a stack trace received from ac_get_intermediate_trace.
+ * Every distinct trace is hashed and stored once in a global table, repeated
+ * calls with the same frames return the same id. Thread safe.
+ * @param stack The stack trace.
+ * @param size The number of frames in the stack trace.
+ * @return The id of the trace, AC_TRACE_ID_NONE if size is 0 or the table is
+ * out of memory.
+ */
+ac_trace_id_t ac_trace_intern(void** stack, int size);
+
+/**
+ * Symbolize every new trace in the background as it is interned.
+ * Makes the cached print functions find symbols for the traces of the tracked
+ * allocations, at the cost of a thread symbolizing them while the program
+ * runs. Disabled by default.
+ * @param enable Whether to prefetch the symbols of interned traces.
+ * @see ac_trace_symbolize_deferred
+ */
+void ac_trace_set_prefetch(bool enable);
+
+/**
+ * Get the frames of an interned stack trace.
+ * The returned frames live as long as the trace table.
+ * @param id The id of the trace.
+ * @param size Set to the number of frames in the trace, 0 for an unknown id.
+ * @return The frames of the trace, NULL for an unknown id.
+ * @see ac_trace_intern
+ */
+void** ac_trace_get(ac_trace_id_t id, int* size);
+
+/**
+ * Print an interned stack trace to the buffer.
+ * @param id The id of the trace.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
+ * @param offset The offset to start printing from.
+ * @return The number of characters printed.
+ * @see ac_sprint_intermediate_trace
+ */
+int ac_sprint_trace_id(ac_trace_id_t id, char* buffer, size_t offset);
+
+/**
+ * Print an interned stack trace to the buffer using only symbols already
+ * cached.
+ * @param id The id of the trace.
+ * @param buffer The buffer to print the stack trace to, AC_TRACE_BUFFER_SIZE
+ * bytes.
+ * @param offset The offset to start printing from.
+ * @return The number of characters printed.
+ * @see ac_sprint_intermediate_trace_cached
+ */
+int ac_sprint_trace_id_cached(ac_trace_id_t id, char* buffer, size_t offset);
+
+/**
+ * Get the number of distinct traces in the trace table.
+ * @return The number of interned traces.
+ */
+size_t ac_trace_table_count(void);
+
+/**
+ * Get the memory used by the trace table.
+ * @return The number of bytes held by the trace table.
+ */
+size_t ac_trace_table_bytes(void);
+
 #endif  // AC_CORE_TRACE_H
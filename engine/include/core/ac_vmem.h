@@ -0,0 +1,107 @@
+#ifndef AC_CORE_VMEM_H
+#define AC_CORE_VMEM_H
+
+/**
+ * @file ac_vmem.h
+ * @brief Reserve/commit virtual memory.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "core/ac_mem.h"
+
+/**
+ * Back the committed memory with transparent huge pages when the kernel
+ * allows it. The reservation is aligned to, and commits are rounded up to,
+ * AC_VMEM_HUGE_PAGE_SIZE.
+ * @see ac_vmem_create
+ */
+#define AC_VMEM_HUGE_PAGES 0x1u
+
+/**
+ * Size of a transparent huge page.
+ */
+#define AC_VMEM_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * A range of address space reserved up front and backed by memory on demand.
+ * Memory is committed from the start of the range and never moves, so
+ * pointers into it stay valid as it grows, and growing never copies.
+ * Regions are not thread safe. The reserved and committed bytes of every
+ * region are accounted per ac_mem_entry_type_t and reported by
+ * ac_mem_show_usage, the address space itself costs no memory.
+ * @brief Virtual memory region.
+ * @see ac_vmem_create
+ */
+typedef struct ac_vmem_t {
+    /**
+     * Start of the reserved range, page aligned.
+     */
+    uint8_t* base;
+    /**
+     * Size of the reserved range.
+     */
+    size_t reserved;
+    /**
+     * Bytes committed from base.
+     */
+    size_t committed;
+    /**
+     * Granularity of commits, the page size or AC_VMEM_HUGE_PAGE_SIZE.
+     */
+    size_t granularity;
+    /**
+     * AC_VMEM_* flags.
+     */
+    uint32_t flags;
+    /**
+     * The memory type the region is accounted to.
+     * @see ac_mem_entry_type_t
+     */
+    ac_mem_entry_type_t mem_type;
+} ac_vmem_t;
+
+/**
+ * Reserve a range of address space.
+ * Nothing is committed yet, touching the range faults until ac_vmem_commit.
+ * @param reserve The size of the range, rounded up to the commit granularity.
+ * @param flags AC_VMEM_* flags.
+ * @param mem_type The memory type the region is accounted to.
+ * @return The new region, NULL if the address space can't be reserved.
+ */
+ac_vmem_t* ac_vmem_create(size_t reserve, uint32_t flags, ac_mem_entry_type_t mem_type);
+
+/**
+ * Release a region and all its memory.
+ * @param vmem The region.
+ */
+void ac_vmem_destroy(ac_vmem_t* vmem);
+
+/**
+ * Make sure the first size bytes of a region are committed.
+ * @param vmem The region.
+ * @param size The number of bytes needed from base, rounded up to the commit
+ * granularity.
+ * @return false if size is past the reservation or the memory can't be
+ * committed.
+ */
+bool ac_vmem_commit(ac_vmem_t* vmem, size_t size);
+
+/**
+ * Give back the memory past the first size bytes of a region.
+ * The address space stays reserved and can be committed again.
+ * @param vmem The region.
+ * @param size The number of bytes to keep from base, rounded up to the commit
+ * granularity.
+ */
+void ac_vmem_decommit(ac_vmem_t* vmem, size_t size);
+
+/**
+ * Log the reserved and committed bytes per memory type.
+ * Called by ac_mem_show_usage.
+ */
+void ac_vmem_show_usage(void);
+
+#endif  // AC_CORE_VMEM_H
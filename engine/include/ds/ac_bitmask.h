@@ -28,9 +28,11 @@ typedef struct ac_bitmask {
 
 /**
  * Creates a new bitmask.
+ * The header and bits of up to AC_POOL_MAX_SIZE bytes come from the data
+ * structure pool.
  *
  * @param num_bits The number of bits in the bitmask.
- * @param mem_type The memory entry type to use.
+ * @param mem_type The memory entry type of bits that don't fit the pool.
  * @return The new bitmask.
  * @see ac_mem_entry_type_t
  */
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "core/ac_mem.h"
+#include "core/ac_vmem.h"
 
 /**
  * @brief Dynamic array structure.
@@ -32,6 +33,16 @@ typedef struct ac_darray_t {
      * @brief The memory type of the array.
      */
     ac_mem_entry_type_t mem_type;
+    /**
+     * @brief The alignment of the data, 0 for the one of ac_malloc.
+     * @see ac_darray_create_aligned
+     */
+    uint64_t alignment;
+    /**
+     * @brief The region backing the data, NULL unless created with
+     * ac_darray_create_virtual.
+     */
+    ac_vmem_t* vmem;
     /**
      * @brief The data of the array.
      */
@@ -46,6 +57,8 @@ void ac_darray_set_resize_factor(float factor);
 
 /**
  * @brief Create a new dynamic array.
+ * The array header comes from the data structure pool, the data from ac_malloc.
+ * @see ac_pool_ds
  * @param element_size The size of each element in the array.
  * @param capacity The initial capacity of the array.
  * @param mem_type The memory type of the array.
@@ -53,6 +66,33 @@ void ac_darray_set_resize_factor(float factor);
  */
 ac_darray_t* ac_darray_create(uint64_t element_size, uint64_t capacity, ac_mem_entry_type_t mem_type);
 
+/**
+ * @brief Create a new dynamic array with aligned data.
+ * The data comes from ac_malloc_aligned and stays aligned when the array grows.
+ * Every element is aligned if element_size is a multiple of the alignment.
+ * @see ac_malloc_aligned
+ * @param element_size The size of each element in the array.
+ * @param capacity The initial capacity of the array.
+ * @param alignment The alignment of the data, a power of two from sizeof(void*)
+ * up to AC_MEM_MAX_ALIGNMENT. An invalid alignment is fatal.
+ * @param mem_type The memory type of the array.
+ * @return A pointer to the new dynamic array.
+ */
+ac_darray_t* ac_darray_create_aligned(uint64_t element_size, uint64_t capacity, uint64_t alignment, ac_mem_entry_type_t mem_type);
+
+/**
+ * @brief Create a new dynamic array backed by reserved virtual memory.
+ * Room for max_capacity elements is reserved up front and memory is committed
+ * as the array grows, so the data never moves: growing doesn't copy and
+ * pointers to elements stay valid. Pushing past max_capacity is fatal.
+ * @see ac_vmem_create
+ * @param element_size The size of each element in the array.
+ * @param max_capacity The most elements the array can ever hold.
+ * @param mem_type The memory type of the array.
+ * @return A pointer to the new dynamic array.
+ */
+ac_darray_t* ac_darray_create_virtual(uint64_t element_size, uint64_t max_capacity, ac_mem_entry_type_t mem_type);
+
 /**
  * @brief Destroy the dynamic array.
  * @param darray The dynamic array to destroy.
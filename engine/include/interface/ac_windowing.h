@@ -7,6 +7,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <vulkan/vulkan.h>
 #include "vk_man/ac_vulkan.h"
@@ -44,6 +45,19 @@ typedef struct ac_window_settings_t {
      * If 0, no limit is set.
      */
     uint32_t fps;
+    /**
+     * Capacity of each of the two frame arenas.
+     * If 0, AC_FRAME_ARENA_DEFAULT_CAPACITY is used.
+     * @see ac_frame_alloc
+     */
+    size_t frame_arena_size;
+    /**
+     * Whether to write log messages from a background thread, keeping
+     * terminal writes off the render thread. Logging blocks when the queue
+     * is full. If false, the logging mode is left as the application set it.
+     * @see ac_log_set_async
+     */
+    bool async_log;
 } ac_window_settings_t;
 
 /**
@@ -60,6 +74,9 @@ ac_window_t* ac_window_init(ac_window_settings_t* settings);
 
 /**
  * Updates the window.
+ * Starts a new frame in the frame arenas before anything else, so memory from
+ * ac_frame_alloc stays valid for the current and the next call.
+ * Also ends the previous frame of the memory telemetry, see ac_mem_frame_end.
  * @param window The window object.
  * @param update The user-defined update function.
  * @param user_data User-defined data to pass to the update function.
@@ -3,12 +3,15 @@
 
 #include <vulkan/vulkan.h>
 
+#include "vk_man/ac_vk_gpu_timer.h"
+
 typedef struct ac_vk_frame_data {
     VkCommandPool command_pool;
     VkCommandBuffer command_buffer;
     VkSemaphore swapchain_semaphore;
     VkSemaphore render_semaphore;
     VkFence render_fence;
+    ac_vk_gpu_timer* gpu_timer;  // NULL unless profiling
 } ac_vk_frame_data;
 
 ac_vk_frame_data init_vk_frame_data(VkDevice device, uint32_t queue_family_index);
@@ -0,0 +1,56 @@
+#ifndef AC_VK_GPU_TIMER_H
+#define AC_VK_GPU_TIMER_H
+
+#include <stdbool.h>
+#include <vulkan/vulkan.h>
+
+#include "vk_man/ac_vk_device.h"
+
+#define AC_VK_GPU_TIMER_MAX_ZONES 32
+#define AC_VK_GPU_TIMER_MAX_DEPTH 8
+
+/// GPU timer
+/// Times regions of the command buffer of a frame with timestamp queries, read
+/// back once the fence of the frame has signaled so reading never stalls. The
+/// regions land on the GPU track of the profiler.
+/// Fields:
+/// - query_pool: Begin and end timestamps of each zone
+/// - names: Name of each zone
+/// - zone_count: Number of zones recorded
+/// - stack: Open zones
+/// - depth: Number of open zones
+/// - pending: Whether recorded zones wait to be read back
+/// - timestamp_mask: Valid bits of a timestamp
+/// - timestamp_period: Nanoseconds per timestamp tick
+/// - last_frame_ns: GPU time of the last frame read back
+/// Methods:
+/// - init_vk_gpu_timer: Creates a timer, NULL if the queue can't write timestamps
+/// - calibrate_vk_gpu_timer: Measures the offset of the GPU clock to the CPU one
+/// - cleanup_vk_gpu_timer: Destroys a timer
+/// - gpu_timer_collect: Reads back the zones, after the fence of the frame
+/// - gpu_timer_begin_frame: Resets the zones, at the start of the command buffer
+/// - gpu_timer_begin: Opens a zone
+/// - gpu_timer_end: Closes the innermost zone
+typedef struct ac_vk_gpu_timer {
+    VkQueryPool query_pool;
+    const char* names[AC_VK_GPU_TIMER_MAX_ZONES];
+    uint32_t zone_count;
+    uint32_t stack[AC_VK_GPU_TIMER_MAX_DEPTH];
+    uint32_t depth;
+    bool pending;
+    uint64_t timestamp_mask;
+    double timestamp_period;
+    uint64_t last_frame_ns;
+} ac_vk_gpu_timer;
+
+ac_vk_gpu_timer* init_vk_gpu_timer(ac_vk_device_data* vk_device_data);
+void calibrate_vk_gpu_timer(ac_vk_device_data* vk_device_data, ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd,
+                            VkFence fence);
+void cleanup_vk_gpu_timer(VkDevice device, ac_vk_gpu_timer* gpu_timer);
+
+void gpu_timer_collect(VkDevice device, ac_vk_gpu_timer* gpu_timer);
+void gpu_timer_begin_frame(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd);
+void gpu_timer_begin(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd, const char* name);
+void gpu_timer_end(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd);
+
+#endif  // AC_VK_GPU_TIMER_H
@@ -11,7 +11,7 @@
         VkResult err = x;                                     \
         if (err) {                                            \
             const char* err_str = string_VkResult(err);       \
-            ac_print_trace(3);                                \
+            ac_print_trace_cached(3);                         \
             ac_log_fatal_exit("Vulkan error: %s\n", err_str); \
         }                                                     \
     } while (0)
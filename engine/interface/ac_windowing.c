@@ -8,8 +8,11 @@
 #include <SDL2/SDL_video.h>
 #include <SDL2/SDL_vulkan.h>
 
+#include "core/ac_arena.h"
+#include "core/ac_frame_stats.h"
 #include "core/ac_mem.h"
 #include "core/ac_log.h"
+#include "core/ac_profile.h"
 #include "vk_man/ac_vulkan.h"
 
 typedef struct ac_window_t {
@@ -21,6 +24,10 @@ typedef struct ac_window_t {
 } ac_window_t;
 
 ac_window_t* ac_window_init(ac_window_settings_t* settings) {
+    if (settings->async_log) {
+        // Keep terminal writes off the render thread, warnings can come every frame
+        ac_log_set_async(true, AC_LOG_OVERFLOW_BLOCK);
+    }
     // Check if host is running wayland. If so, use wayland windowing system
     char* wayland_display = getenv("XDG_SESSION_TYPE");
     ac_log_debug("XDG_SESSION_TYPE: %s", wayland_display);
@@ -41,6 +48,11 @@ ac_window_t* ac_window_init(ac_window_settings_t* settings) {
         ac_log_fatal_exit("Failed to create window");
         return NULL;
     }
+    ac_frame_arena_init(settings->frame_arena_size);
+    AC_FRAME_STATS_INIT();
+    if (settings->fps > 0) {
+        ac_frame_stats_set_hitch_threshold(2000000000ull / settings->fps);
+    }
     window->vk_data = ac_vk_init(settings->title, true, ac_window_get_sdl_window(window));
     window->running = true;
     return window;
@@ -54,6 +66,11 @@ void ac_window_draw(ac_vk_data* vk_data) {
 void ac_window_update(ac_window_t* window, void (*update)(void* user_data), void* user_data) {
     static uint32_t last_time = 0;
     uint32_t current_time = SDL_GetTicks();
+    ac_mem_frame_end();
+    AC_PROFILE_FRAME();
+    AC_FRAME_STATS_FRAME();
+    AC_PROFILE_SCOPE("ac_window_update");
+    ac_frame_arena_begin();
     SDL_Event e;
     while (SDL_PollEvent(&e)) {
         if (e.type == SDL_QUIT) {
@@ -78,6 +95,7 @@ void ac_window_update(ac_window_t* window, void (*update)(void* user_data), void
     if (!window->is_minimized) {
         ac_window_draw(window->vk_data);
         if (update) update(user_data);
+        AC_FRAME_STATS_MARK(AC_FRAME_STAT_CPU);
         if (window->settings.fps > 0) {
             uint32_t frame_time = 1000 / window->settings.fps;
             if (current_time - last_time < frame_time) {
@@ -85,6 +103,7 @@ void ac_window_update(ac_window_t* window, void (*update)(void* user_data), void
             }
         }
     } else {
+        AC_FRAME_STATS_DISCARD();
         SDL_Delay(100);
     }
 }
@@ -92,6 +111,7 @@ void ac_window_shutdown(ac_window_t* window, void (*shutdown)(void* user_data),
     ac_vk_cleanup(window->vk_data);
     SDL_DestroyWindow(window->window);
     SDL_Quit();
+    ac_frame_arena_shutdown();
     ac_free(window);
     if (shutdown) shutdown(user_data);
 }
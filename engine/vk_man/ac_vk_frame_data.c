@@ -17,6 +17,7 @@ ac_vk_frame_data init_vk_frame_data(VkDevice device, uint32_t queue_family_index
 }
 
 void cleanup_vk_frame_data(VkDevice device, ac_vk_frame_data* frame_data) {
+    cleanup_vk_gpu_timer(device, frame_data->gpu_timer);
     cleanup_fence(device, frame_data->render_fence);
     cleanup_semaphore(device, frame_data->render_semaphore);
     cleanup_semaphore(device, frame_data->swapchain_semaphore);
@@ -0,0 +1,191 @@
+#include "vk_man/ac_vk_gpu_timer.h"
+
+#include "core/ac_frame_stats.h"
+#include "core/ac_log.h"
+#include "core/ac_mem.h"
+#include "core/ac_profile.h"
+#include "core/ac_time.h"
+#include "vk_man/utils/ac_vk_command.h"
+#include "vk_man/utils/ac_vk_common.h"
+
+#define AC_VK_GPU_TIMER_QUERY_COUNT (AC_VK_GPU_TIMER_MAX_ZONES * 2)
+#define AC_VK_GPU_TIMER_CALIBRATION_ROUNDS 8
+
+// Slot of zones past AC_VK_GPU_TIMER_MAX_ZONES, they aren't timed
+#define AC_VK_GPU_TIMER_DROPPED UINT32_MAX
+
+// CLOCK_MONOTONIC minus GPU time, in nanoseconds. Every queue of a device
+// shares one timestamp clock.
+static int64_t gpu_timer_offset_ns = 0;
+
+ac_vk_gpu_timer* init_vk_gpu_timer(ac_vk_device_data* vk_device_data) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_device_data->physical_device, &properties);
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_device_data->physical_device, &queue_family_count, NULL);
+    VkQueueFamilyProperties* queue_families =
+        ac_malloc(sizeof(VkQueueFamilyProperties) * queue_family_count, AC_MEM_ENTRY_VULKAN);
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_device_data->physical_device, &queue_family_count, queue_families);
+    uint32_t valid_bits = queue_families[vk_device_data->graphics_queue_idx].timestampValidBits;
+    ac_free(queue_families);
+
+    if (valid_bits == 0 || properties.limits.timestampPeriod == 0.0f) {
+        ac_log_warn("Graphics queue can't write timestamps, GPU timing disabled\n");
+        return NULL;
+    }
+
+    VkQueryPoolCreateInfo pool_info = {0};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = AC_VK_GPU_TIMER_QUERY_COUNT;
+
+    ac_vk_gpu_timer* gpu_timer = ac_malloc(sizeof(ac_vk_gpu_timer), AC_MEM_ENTRY_VULKAN);
+    *gpu_timer = (ac_vk_gpu_timer){0};
+    VkResult res = vkCreateQueryPool(vk_device_data->device, &pool_info, NULL, &gpu_timer->query_pool);
+    VK_CHECK(res);
+
+    gpu_timer->timestamp_mask = valid_bits >= 64 ? UINT64_MAX : (UINT64_C(1) << valid_bits) - 1;
+    gpu_timer->timestamp_period = properties.limits.timestampPeriod;
+    return gpu_timer;
+}
+
+// Writes a single timestamp between two reads of the CPU clock, the GPU ran it
+// somewhere in between. The narrowest of a few rounds wins.
+void calibrate_vk_gpu_timer(ac_vk_device_data* vk_device_data, ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd,
+                            VkFence fence) {
+    if (gpu_timer == NULL) {
+        return;
+    }
+    VkDevice device = vk_device_data->device;
+    uint64_t best_window = UINT64_MAX;
+    for (uint32_t i = 0; i < AC_VK_GPU_TIMER_CALIBRATION_ROUNDS; i++) {
+        VkResult res = vkResetFences(device, 1, &fence);
+        VK_CHECK(res);
+        res = vkResetCommandBuffer(cmd, 0);
+        VK_CHECK(res);
+        begin_command_buffer(cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        vkCmdResetQueryPool(cmd, gpu_timer->query_pool, 0, 1);
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, gpu_timer->query_pool, 0);
+        end_command_buffer(cmd);
+
+        VkCommandBufferSubmitInfo cmd_info = {0};
+        cmd_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO;
+        cmd_info.commandBuffer = cmd;
+        VkSubmitInfo2 submit = {0};
+        submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2;
+        submit.commandBufferInfoCount = 1;
+        submit.pCommandBufferInfos = &cmd_info;
+
+        uint64_t before = ac_time_ns();
+        res = vkQueueSubmit2(vk_device_data->graphics_queue, 1, &submit, fence);
+        VK_CHECK(res);
+        res = vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+        VK_CHECK(res);
+        uint64_t after = ac_time_ns();
+
+        uint64_t timestamp = 0;
+        res = vkGetQueryPoolResults(device, gpu_timer->query_pool, 0, 1, sizeof(timestamp), &timestamp,
+                                    sizeof(timestamp), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+        VK_CHECK(res);
+
+        if (after - before < best_window) {
+            best_window = after - before;
+            uint64_t gpu_ns = (uint64_t)((double)(timestamp & gpu_timer->timestamp_mask) * gpu_timer->timestamp_period);
+            gpu_timer_offset_ns = (int64_t)(before + (after - before) / 2) - (int64_t)gpu_ns;
+        }
+    }
+    gpu_timer->pending = false;
+    ac_log_debug("GPU clock calibrated to +-%lu ns\n", best_window / 2);
+}
+
+void cleanup_vk_gpu_timer(VkDevice device, ac_vk_gpu_timer* gpu_timer) {
+    if (gpu_timer == NULL) {
+        return;
+    }
+    vkDestroyQueryPool(device, gpu_timer->query_pool, NULL);
+    ac_free(gpu_timer);
+}
+
+void gpu_timer_collect(VkDevice device, ac_vk_gpu_timer* gpu_timer) {
+    if (gpu_timer == NULL || !gpu_timer->pending) {
+        return;
+    }
+    gpu_timer->pending = false;
+    if (gpu_timer->depth != 0) {
+        ac_log_warn("%u GPU zones left open, frame not timed\n", gpu_timer->depth);
+        return;
+    }
+    if (gpu_timer->zone_count == 0) {
+        return;
+    }
+
+    uint64_t timestamps[AC_VK_GPU_TIMER_QUERY_COUNT];
+    VkResult res = vkGetQueryPoolResults(device, gpu_timer->query_pool, 0, gpu_timer->zone_count * 2, sizeof(timestamps),
+                                         timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (res == VK_NOT_READY) {
+        return;
+    }
+    VK_CHECK(res);
+
+    uint64_t mask = gpu_timer->timestamp_mask;
+    uint64_t first = timestamps[0] & mask;
+    uint64_t frame_ticks = 0;
+    for (uint32_t i = 0; i < gpu_timer->zone_count; i++) {
+        uint64_t begin = timestamps[i * 2] & mask;
+        uint64_t end = timestamps[i * 2 + 1] & mask;
+        // Differences are taken modulo the valid bits in case the counter wrapped
+        uint64_t duration = (end - begin) & mask;
+        uint64_t since_first = (begin - first) & mask;
+        if (since_first + duration > frame_ticks) {
+            frame_ticks = since_first + duration;
+        }
+
+        int64_t begin_ns = (int64_t)((double)begin * gpu_timer->timestamp_period) + gpu_timer_offset_ns;
+        uint64_t end_ns = (uint64_t)begin_ns + (uint64_t)((double)duration * gpu_timer->timestamp_period);
+        ac_profile_gpu_zone(gpu_timer->names[i], ac_time_ns_to_ticks((uint64_t)begin_ns), ac_time_ns_to_ticks(end_ns));
+    }
+    gpu_timer->last_frame_ns = (uint64_t)((double)frame_ticks * gpu_timer->timestamp_period);
+    AC_FRAME_STATS_RECORD(AC_FRAME_STAT_GPU, gpu_timer->last_frame_ns);
+}
+
+void gpu_timer_begin_frame(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd) {
+    if (gpu_timer == NULL) {
+        return;
+    }
+    vkCmdResetQueryPool(cmd, gpu_timer->query_pool, 0, AC_VK_GPU_TIMER_QUERY_COUNT);
+    gpu_timer->zone_count = 0;
+    gpu_timer->depth = 0;
+    gpu_timer->pending = true;
+}
+
+void gpu_timer_begin(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd, const char* name) {
+    if (gpu_timer == NULL) {
+        return;
+    }
+    if (gpu_timer->depth == AC_VK_GPU_TIMER_MAX_DEPTH) {
+        ac_log_fatal_exit("GPU zones nested deeper than %d\n", AC_VK_GPU_TIMER_MAX_DEPTH);
+    }
+    if (gpu_timer->zone_count == AC_VK_GPU_TIMER_MAX_ZONES) {
+        gpu_timer->stack[gpu_timer->depth++] = AC_VK_GPU_TIMER_DROPPED;
+        return;
+    }
+    uint32_t zone = gpu_timer->zone_count++;
+    gpu_timer->names[zone] = name;
+    gpu_timer->stack[gpu_timer->depth++] = zone;
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, gpu_timer->query_pool, zone * 2);
+}
+
+void gpu_timer_end(ac_vk_gpu_timer* gpu_timer, VkCommandBuffer cmd) {
+    if (gpu_timer == NULL) {
+        return;
+    }
+    if (gpu_timer->depth == 0) {
+        ac_log_fatal_exit("GPU zone closed without being opened\n");
+    }
+    uint32_t zone = gpu_timer->stack[--gpu_timer->depth];
+    if (zone == AC_VK_GPU_TIMER_DROPPED) {
+        return;
+    }
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, gpu_timer->query_pool, zone * 2 + 1);
+}
@@ -6,6 +6,7 @@
 
 #include "core/ac_mem.h"
 #include "core/ac_log.h"
+#include "core/ac_profile.h"
 #include "ds/ac_darray.h"
 #include "math/ac_math_common.h"
 #include "vk_man/utils/ac_vk_init.h"
@@ -165,6 +166,7 @@ ac_vk_swapchain_data init_vk_swapchain(ac_vk_device_data* vk_device_data) {
 }
 
 void recreate_vk_swapchain(ac_vk_swapchain_data* vk_swapchain_data, ac_vk_device_data* vk_device_data) {
+    AC_PROFILE_SCOPE("recreate_vk_swapchain");
     cleanup_vk_swapchain(vk_swapchain_data, vk_device_data);
     *vk_swapchain_data = init_vk_swapchain(vk_device_data);
 }
@@ -2,12 +2,17 @@
 #include <time.h>
 #include <vulkan/vulkan_core.h>
 
+#include "core/ac_frame_stats.h"
 #include "core/ac_log.h"
+#include "core/ac_log_binary.h"
 #include "core/ac_mem.h"
+#include "core/ac_perf.h"
+#include "core/ac_profile.h"
 #include "ds/ac_darray.h"
 
 #include "math/ac_math_common.h"
 #include "vk_man/ac_vk_frame_data.h"
+#include "vk_man/ac_vk_gpu_timer.h"
 #include "vk_man/ac_vk_swapchain.h"
 #include "vk_man/utils/ac_vk_command.h"
 #include "vk_man/utils/ac_vk_common.h"
@@ -23,6 +28,13 @@ ac_vk_data* ac_vk_init(const char* app_name, bool enable_validation_layers, stru
         ac_darray_create(sizeof(ac_vk_frame_data), vk_data->swapchain_data.swapchain_image_count, AC_MEM_ENTRY_VULKAN);
     for (uint32_t i = 0; i < vk_data->swapchain_data.swapchain_image_count; i++) {
         ac_vk_frame_data frame_data = init_vk_frame_data(vk_data->device_data.device, vk_data->device_data.graphics_queue_idx);
+#ifdef AC_PROFILE_ENABLE
+        frame_data.gpu_timer = init_vk_gpu_timer(&vk_data->device_data);
+        if (i == 0) {
+            calibrate_vk_gpu_timer(&vk_data->device_data, frame_data.gpu_timer, frame_data.command_buffer,
+                                   frame_data.render_fence);
+        }
+#endif
         ac_darray_push(vk_data->frame_data, &frame_data);
         ac_log_debug("Frame data %d created\n", i);
     }
@@ -95,21 +107,31 @@ VkSubmitInfo2 submit_info(VkCommandBufferSubmitInfo* cmd, VkSemaphoreSubmitInfo*
 }
 
 void ac_vk_draw_frame(ac_vk_data* vk_data) {
+    AC_PROFILE_SCOPE("ac_vk_draw_frame");
+    AC_PERF_SCOPE("ac_vk_draw_frame");
     ac_vk_frame_data frame_d = ac_vk_get_current_frame_data(vk_data);
     ac_vk_frame_data* frame_data = &frame_d;
     VkResult res;
 
-    res = vkWaitForFences(vk_data->device_data.device, 1, &frame_data->render_fence, VK_TRUE, UINT64_MAX);
+    AC_PROFILE_BEGIN("vkWaitForFences");
+    AC_FRAME_STATS_TIME(AC_FRAME_STAT_FENCE_WAIT, res = vkWaitForFences(vk_data->device_data.device, 1,
+                                                                        &frame_data->render_fence, VK_TRUE, UINT64_MAX));
+    AC_PROFILE_END();
     VK_CHECK(res);
+    gpu_timer_collect(vk_data->device_data.device, frame_data->gpu_timer);
     res = vkResetFences(vk_data->device_data.device, 1, &frame_data->render_fence);
     uint32_t image_index;
 
-    res = vkAcquireNextImageKHR(vk_data->device_data.device, vk_data->swapchain_data.swapchain, UINT64_MAX,
-                                frame_data->swapchain_semaphore, VK_NULL_HANDLE, &image_index);
+    AC_PROFILE_BEGIN("vkAcquireNextImageKHR");
+    AC_FRAME_STATS_TIME(AC_FRAME_STAT_ACQUIRE,
+                        res = vkAcquireNextImageKHR(vk_data->device_data.device, vk_data->swapchain_data.swapchain,
+                                                    UINT64_MAX, frame_data->swapchain_semaphore, VK_NULL_HANDLE,
+                                                    &image_index));
+    AC_PROFILE_END();
     if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-        ac_log_warn("Swapchain out of date\n");
+        ac_log_warn_every(1000, "Swapchain out of date\n");
         recreate_vk_swapchain(&vk_data->swapchain_data, &vk_data->device_data);
-        ac_log_info("Swapchain recreated\n");
+        ac_log_info_every(1000, "Swapchain recreated\n");
         return;
     } else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
         VK_CHECK(res);
@@ -120,6 +142,8 @@ void ac_vk_draw_frame(ac_vk_data* vk_data) {
     VK_CHECK(res);
 
     begin_command_buffer(cmd, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    gpu_timer_begin_frame(frame_data->gpu_timer, cmd);
+    gpu_timer_begin(frame_data->gpu_timer, cmd, "frame");
     VkImage swapchain_image = {0};
     ac_darray_get(vk_data->swapchain_data.swapchain_images, image_index, &swapchain_image);
     transition_image(cmd, swapchain_image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
@@ -129,9 +153,12 @@ void ac_vk_draw_frame(ac_vk_data* vk_data) {
 
     VkClearColorValue clear_color = {{0.0f, g, 0.0f, 1.0f}};
     VkImageSubresourceRange clear_range = image_subresource_range(VK_IMAGE_ASPECT_COLOR_BIT);
+    gpu_timer_begin(frame_data->gpu_timer, cmd, "clear");
     vkCmdClearColorImage(cmd, swapchain_image, VK_IMAGE_LAYOUT_GENERAL, &clear_color, 1, &clear_range);
+    gpu_timer_end(frame_data->gpu_timer, cmd);
 
     transition_image(cmd, swapchain_image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    gpu_timer_end(frame_data->gpu_timer, cmd);
     end_command_buffer(cmd);
 
     VkCommandBufferSubmitInfo cmdinfo = command_buffer_submit_info(cmd);
@@ -145,6 +172,7 @@ void ac_vk_draw_frame(ac_vk_data* vk_data) {
 
     res = vkQueueSubmit2(vk_data->device_data.graphics_queue, 1, &submit, frame_data->render_fence);
     VK_CHECK(res);
+    ac_log_binary_trace("Frame %zu submitted, image %u\n", frame, image_index);
 
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -157,11 +185,11 @@ void ac_vk_draw_frame(ac_vk_data* vk_data) {
 
     presentInfo.pImageIndices = &image_index;
 
-    res = vkQueuePresentKHR(vk_data->device_data.graphics_queue, &presentInfo);
+    AC_FRAME_STATS_TIME(AC_FRAME_STAT_PRESENT, res = vkQueuePresentKHR(vk_data->device_data.graphics_queue, &presentInfo));
     if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-        ac_log_warn("Swapchain out of date\n");
+        ac_log_warn_every(1000, "Swapchain out of date\n");
         recreate_vk_swapchain(&vk_data->swapchain_data, &vk_data->device_data);
-        ac_log_info("Swapchain recreated\n");
+        ac_log_info_every(1000, "Swapchain recreated\n");
         return;
     } else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
         VK_CHECK(res);
@@ -77,21 +77,23 @@ VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBits
                                              const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData) {
     (void)messageType;
     (void)pUserData;
+    // The same error can come every draw, 10 messages per second and severity
+    // still show distinct errors of a burst
     switch (messageSeverity) {
         case VK_DEBUG_UTILS_MESSAGE_SEVERITY_VERBOSE_BIT_EXT:
-            ac_log_trace("Validation layer: %s\n", pCallbackData->pMessage);
+            AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_TRACE, 10, 1000, "Validation layer: %s\n", pCallbackData->pMessage);
             break;
         case VK_DEBUG_UTILS_MESSAGE_SEVERITY_INFO_BIT_EXT:
-            ac_log_info("Validation layer: %s\n", pCallbackData->pMessage);
+            AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_INFO, 10, 1000, "Validation layer: %s\n", pCallbackData->pMessage);
             break;
         case VK_DEBUG_UTILS_MESSAGE_SEVERITY_WARNING_BIT_EXT:
-            ac_log_warn("Validation layer: %s\n", pCallbackData->pMessage);
+            AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_WARN, 10, 1000, "Validation layer: %s\n", pCallbackData->pMessage);
             break;
         case VK_DEBUG_UTILS_MESSAGE_SEVERITY_ERROR_BIT_EXT:
-            ac_log_error("Validation layer: %s\n", pCallbackData->pMessage);
+            AC_LOG_LIMITED(stderr, AC_LOG_LEVEL_ERROR, 10, 1000, "Validation layer: %s\n", pCallbackData->pMessage);
             break;
         default:
-            ac_log_warn("Validation layer: %s\n", pCallbackData->pMessage);
+            AC_LOG_LIMITED(stdout, AC_LOG_LEVEL_WARN, 10, 1000, "Validation layer: %s\n", pCallbackData->pMessage);
             break;
     }
     return VK_FALSE;
@@ -1,5 +1,10 @@
+#include <core/ac_frame_stats.h>
 #include <core/ac_log.h>
+#include <core/ac_log_binary.h>
 #include <core/ac_mem.h>
+#include <core/ac_perf.h>
+#include <core/ac_profile.h>
+#include <core/ac_sampler.h>
 #include <core/ac_trace.h>
 #include <interface/ac_windowing.h>
 
@@ -16,6 +21,21 @@ void segfaulter(int sig) {
 int main() {
     signal(SIGSEGV, segfaulter);
     ac_mem_init();
+    // What led to a fatal error is printed with it
+    ac_log_add_crash_ring(64 * 1024, AC_LOG_LEVEL_DEBUG);
+    const char* log_file = getenv("AC_LOG_FILE");
+    int log_file_sink = -1;
+    if (log_file != NULL) {
+        log_file_sink = ac_log_add_file_sink(log_file, 64 * 1024 * 1024, AC_LOG_LEVEL_TRACE);
+    }
+    const char* binary_log = getenv("AC_LOG_BINARY");
+    if (binary_log != NULL) {
+        ac_log_binary_open(binary_log, 64 * 1024 * 1024);
+    }
+    const char* sampler_hz = getenv("AC_SAMPLER_HZ");
+    if (sampler_hz != NULL) {
+        ac_sampler_start((uint32_t)atoi(sampler_hz));
+    }
     ac_window_settings_t settings = {
         .width = 800,
         .height = 600,
@@ -23,6 +43,7 @@ int main() {
         .fullscreen = false,
         .resizable = true,
         .fps = 60,
+        .async_log = true,
     };
 
     ac_window_t* window = ac_window_init(&settings);
@@ -34,7 +55,32 @@ int main() {
         ac_window_update(window, NULL, NULL);
     }
 
+#ifdef AC_FRAME_STATS_ENABLE
+    ac_frame_stats_log();
+    ac_frame_stats_write_csv("testbed_frame_stats.csv");
+    ac_frame_stats_write_json("testbed_frame_stats.json");
+#endif
+#ifdef AC_PERF_ENABLE
+    ac_perf_log();
+#endif
+#ifdef AC_PROFILE_ENABLE
+    uint64_t last_frame = ac_profile_frame();
+    ac_profile_export("testbed_profile.json", last_frame > 300 ? last_frame - 300 : 0, last_frame);
+#endif
+
+    if (sampler_hz != NULL) {
+        ac_sampler_stop();
+        ac_sampler_write_folded("testbed.folded");
+    }
+
+    if (binary_log != NULL) {
+        ac_log_binary_close();
+    }
+
     ac_window_shutdown(window, NULL, NULL);
     ac_mem_exit();
+    if (log_file_sink >= 0) {
+        ac_log_remove_sink(log_file_sink);
+    }
     return 0;
 }
@@ -0,0 +1,355 @@
+// Renders a binary log written by ac_log_binary_open as text.
+//
+// usage: ac_logdecode [-l level] log.aclb
+//
+// One line per message, seconds since the log was opened, the thread and the
+// level, then the message formatted with its original format. Messages below
+// level, a number or a name like "info", are skipped. The whole file is read
+// in memory, the site definitions first, so messages logged before their
+// definition still decode.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <core/ac_log.h>
+#include <core/ac_log_binary.h>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define LINE_SIZE 8192
+
+typedef struct site_t {
+    ac_log_binary_site_t info;
+    char* format;
+    char* file;
+} site_t;
+
+// The arguments of a message, read front to back
+typedef struct cursor_t {
+    const uint8_t* data;
+    size_t remaining;
+} cursor_t;
+
+static const char* level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+
+static site_t* sites = NULL;
+static uint32_t site_capacity = 0;
+
+static void* checked_realloc(void* ptr, size_t size) {
+    ptr = realloc(ptr, size == 0 ? 1 : size);
+    if (ptr == NULL) {
+        ac_log_fatal_exit("Out of memory\n");
+    }
+    return ptr;
+}
+
+static char* copy_string(const uint8_t* data, size_t length) {
+    char* string = checked_realloc(NULL, length + 1);
+    memcpy(string, data, length);
+    string[length] = '\0';
+    return string;
+}
+
+static bool read_file(const char* path, uint8_t** data, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s\n", path);
+        return false;
+    }
+    size_t capacity = 1 << 20;
+    *data = checked_realloc(NULL, capacity);
+    *size = 0;
+    size_t count;
+    while ((count = fread(*data + *size, 1, capacity - *size, fp)) > 0) {
+        *size += count;
+        if (*size == capacity) {
+            capacity *= 2;
+            *data = checked_realloc(*data, capacity);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static void define_site(const uint8_t* payload, size_t length) {
+    ac_log_binary_site_t info;
+    if (length < sizeof(info)) {
+        return;
+    }
+    memcpy(&info, payload, sizeof(info));
+    if (info.id == AC_LOG_BINARY_SITE_DEFINITION || (size_t)info.format_len + info.file_len > length - sizeof(info)) {
+        return;
+    }
+    if (info.id >= site_capacity) {
+        uint32_t capacity = site_capacity == 0 ? 64 : site_capacity;
+        while (capacity <= info.id) {
+            capacity *= 2;
+        }
+        sites = checked_realloc(sites, capacity * sizeof(site_t));
+        memset(sites + site_capacity, 0, (capacity - site_capacity) * sizeof(site_t));
+        site_capacity = capacity;
+    }
+    site_t* site = &sites[info.id];
+    if (site->format != NULL) {
+        // Defined again by a reopen of the log
+        return;
+    }
+    site->info = info;
+    site->format = copy_string(payload + sizeof(info), info.format_len);
+    site->file = copy_string(payload + sizeof(info) + info.format_len, info.file_len);
+}
+
+static bool cursor_read(cursor_t* cursor, void* value, size_t size) {
+    if (cursor->remaining < size) {
+        return false;
+    }
+    memcpy(value, cursor->data, size);
+    cursor->data += size;
+    cursor->remaining -= size;
+    return true;
+}
+
+// Appends to line, keeping it NUL terminated when it's full
+static void append(char* line, size_t* length, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+static void append(char* line, size_t* length, const char* fmt, ...) {
+    if (*length >= LINE_SIZE - 1) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(line + *length, LINE_SIZE - *length, fmt, args);
+    va_end(args);
+    if (written > 0) {
+        *length += (size_t)written < LINE_SIZE - *length ? (size_t)written : LINE_SIZE - 1 - *length;
+    }
+}
+
+// Formats one conversion with the stars replaced by the values read
+static bool render_conversion(ac_log_binary_conversion_t* conversion, cursor_t* cursor, char* line, size_t* length) {
+    char spec[64];
+    size_t spec_length = 0;
+    for (size_t i = 0; i < conversion->length && spec_length < sizeof(spec) - 16; i++) {
+        char c = conversion->start[i];
+        if (c == '*') {
+            int value;
+            if (!cursor_read(cursor, &value, sizeof(value))) {
+                return false;
+            }
+            spec_length += (size_t)snprintf(spec + spec_length, sizeof(spec) - spec_length, "%d", value);
+        } else {
+            spec[spec_length++] = c;
+        }
+    }
+    spec[spec_length] = '\0';
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    switch (conversion->arg) {
+        case AC_LOG_BINARY_ARG_NONE:
+            append(line, length, "%%");
+            return true;
+        case AC_LOG_BINARY_ARG_INT: {
+            int value;
+            if (!cursor_read(cursor, &value, sizeof(value))) {
+                return false;
+            }
+            append(line, length, spec, value);
+            return true;
+        }
+        case AC_LOG_BINARY_ARG_LONG:
+        case AC_LOG_BINARY_ARG_LONG_LONG:
+        case AC_LOG_BINARY_ARG_SIZE:
+        case AC_LOG_BINARY_ARG_INTMAX:
+        case AC_LOG_BINARY_ARG_PTRDIFF: {
+            uint64_t value;
+            if (!cursor_read(cursor, &value, sizeof(value))) {
+                return false;
+            }
+            if (conversion->arg == AC_LOG_BINARY_ARG_LONG) {
+                append(line, length, spec, (long)value);
+            } else if (conversion->arg == AC_LOG_BINARY_ARG_LONG_LONG) {
+                append(line, length, spec, (long long)value);
+            } else if (conversion->arg == AC_LOG_BINARY_ARG_SIZE) {
+                append(line, length, spec, (size_t)value);
+            } else if (conversion->arg == AC_LOG_BINARY_ARG_INTMAX) {
+                append(line, length, spec, (intmax_t)value);
+            } else {
+                append(line, length, spec, (ptrdiff_t)value);
+            }
+            return true;
+        }
+        case AC_LOG_BINARY_ARG_POINTER: {
+            uint64_t value;
+            if (!cursor_read(cursor, &value, sizeof(value))) {
+                return false;
+            }
+            append(line, length, spec, (void*)(uintptr_t)value);
+            return true;
+        }
+        case AC_LOG_BINARY_ARG_DOUBLE: {
+            double value;
+            if (!cursor_read(cursor, &value, sizeof(value))) {
+                return false;
+            }
+            append(line, length, spec, value);
+            return true;
+        }
+        case AC_LOG_BINARY_ARG_LONG_DOUBLE: {
+            uint8_t bytes[16];
+            long double value = 0;
+            if (!cursor_read(cursor, bytes, sizeof(bytes))) {
+                return false;
+            }
+            memcpy(&value, bytes, sizeof(value) < sizeof(bytes) ? sizeof(value) : sizeof(bytes));
+            append(line, length, spec, value);
+            return true;
+        }
+        case AC_LOG_BINARY_ARG_STRING: {
+            uint32_t string_len;
+            if (!cursor_read(cursor, &string_len, sizeof(string_len)) || cursor->remaining < string_len) {
+                return false;
+            }
+            char string[AC_LOG_BINARY_MAX_STRING + 1];
+            size_t copied = string_len < AC_LOG_BINARY_MAX_STRING ? string_len : AC_LOG_BINARY_MAX_STRING;
+            memcpy(string, cursor->data, copied);
+            string[copied] = '\0';
+            cursor->data += string_len;
+            cursor->remaining -= string_len;
+            append(line, length, spec, string);
+            return true;
+        }
+        default:
+            return false;
+    }
+#pragma GCC diagnostic pop
+}
+
+static void render_message(ac_log_binary_header_t* header, ac_log_binary_record_t* record, const uint8_t* payload,
+                           size_t payload_length, int min_level) {
+    site_t* site = record->site < site_capacity ? &sites[record->site] : NULL;
+    if (site != NULL && site->format == NULL) {
+        site = NULL;
+    }
+    if (site != NULL && (int)site->info.level < min_level) {
+        return;
+    }
+
+    char line[LINE_SIZE];
+    size_t length = 0;
+    line[0] = '\0';
+    double seconds = ((double)record->ticks - (double)header->base_ticks) * header->ns_per_tick * 1e-9;
+    append(line, &length, "[%12.6f] %6u ", seconds, record->thread);
+    if (site == NULL) {
+        append(line, &length, "<undefined site %u>\n", record->site);
+        fwrite(line, 1, length, stdout);
+        return;
+    }
+    const char* level = site->info.level < sizeof(level_names) / sizeof(level_names[0]) ? level_names[site->info.level] : "?";
+    append(line, &length, "%s: ", level);
+
+    cursor_t cursor = {payload, payload_length};
+    const char* text = site->format;
+    ac_log_binary_conversion_t conversion;
+    const char* next;
+    while ((next = ac_log_binary_conversion(text, &conversion)) != NULL) {
+        append(line, &length, "%.*s", (int)(conversion.start - text), text);
+        if (!render_conversion(&conversion, &cursor, line, &length)) {
+            append(line, &length, "<truncated>");
+            text = "";
+            break;
+        }
+        text = next;
+    }
+    append(line, &length, "%s", text);
+    if (length == 0 || line[length - 1] != '\n') {
+        if (length == LINE_SIZE - 1) {
+            length--;
+        }
+        line[length++] = '\n';
+    }
+    fwrite(line, 1, length, stdout);
+}
+
+static int parse_level(const char* text) {
+    for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i++) {
+        if (strcasecmp(text, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    char* end;
+    long level = strtol(text, &end, 10);
+    return *end == '\0' && level >= 0 && level <= AC_LOG_LEVEL_FATAL ? (int)level : -1;
+}
+
+static void usage(void) { fprintf(stderr, "usage: ac_logdecode [-l level] log.aclb\n"); }
+
+int main(int argc, char** argv) {
+    int min_level = AC_LOG_LEVEL_TRACE;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            min_level = parse_level(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (path == NULL || min_level < 0) {
+        usage();
+        return 1;
+    }
+
+    uint8_t* data;
+    size_t size;
+    if (!read_file(path, &data, &size)) {
+        return 1;
+    }
+    ac_log_binary_header_t header;
+    if (size < sizeof(header)) {
+        ac_log_error("%s is not a binary log\n", path);
+        return 1;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != AC_LOG_BINARY_MAGIC) {
+        ac_log_error("%s is not a binary log\n", path);
+        return 1;
+    }
+    if (header.version != AC_LOG_BINARY_VERSION) {
+        ac_log_error("%s has version %u, expected %u\n", path, header.version, AC_LOG_BINARY_VERSION);
+        return 1;
+    }
+    if (header.size < size) {
+        size = header.size;
+    }
+
+    // Definitions first, then the messages
+    for (int pass = 0; pass < 2; pass++) {
+        size_t offset = sizeof(header);
+        while (offset + sizeof(ac_log_binary_record_t) <= size) {
+            ac_log_binary_record_t record;
+            memcpy(&record, data + offset, sizeof(record));
+            if (record.size < sizeof(record) || record.size > size - offset) {
+                break;
+            }
+            const uint8_t* payload = data + offset + sizeof(record);
+            size_t payload_length = record.size - sizeof(record);
+            if (pass == 0 && record.site == AC_LOG_BINARY_SITE_DEFINITION) {
+                define_site(payload, payload_length);
+            } else if (pass == 1 && record.site != AC_LOG_BINARY_SITE_DEFINITION) {
+                render_message(&header, &record, payload, payload_length, min_level);
+            }
+            offset += record.size;
+        }
+    }
+    if (header.dropped > 0) {
+        ac_log_warn("%llu messages didn't fit in %s\n", (unsigned long long)header.dropped, path);
+    }
+    return 0;
+}
@@ -0,0 +1,297 @@
+// Compares two heap snapshots written by ac_mem_write_snapshot and prints the
+// callsites whose live memory grew the most between them.
+//
+// usage: ac_memdiff [-d depth] [-n count] before.acms after.acms
+//
+// Callsites are keyed on the module relative addresses of the first depth
+// frames of the allocation trace, so snapshots of two runs of the same build
+// compare fine despite ASLR. Only the printed rows are symbolized, with one
+// addr2line call per frame.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <core/ac_log.h>
+#include <core/ac_mem.h>
+#include <core/ac_mem_snapshot.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DEPTH 16
+
+typedef struct module_t {
+    ac_mem_snapshot_module_t info;
+    char* path;
+} module_t;
+
+typedef struct trace_t {
+    uint32_t frame_count;
+    uint64_t* frames;
+} trace_t;
+
+typedef struct snapshot_t {
+    ac_mem_snapshot_header_t header;
+    module_t* modules;
+    ac_mem_snapshot_block_t* blocks;
+    // Indexed by trace id
+    trace_t* traces;
+} snapshot_t;
+
+// A frame relative to the file it comes from
+typedef struct frame_t {
+    const char* path;
+    uint64_t offset;
+} frame_t;
+
+typedef struct callsite_t {
+    frame_t frames[MAX_DEPTH];
+    int frame_count;
+    double bytes[2];
+    uint64_t count[2];
+    struct callsite_t* next;
+} callsite_t;
+
+#define CALLSITE_BUCKETS 4096
+
+static callsite_t* callsites[CALLSITE_BUCKETS];
+static size_t callsite_count = 0;
+
+static bool read_exact(FILE* fp, void* data, size_t size) { return size == 0 || fread(data, size, 1, fp) == 1; }
+
+static void* checked_calloc(size_t count, size_t size) {
+    void* ptr = calloc(count == 0 ? 1 : count, size);
+    if (ptr == NULL) {
+        ac_log_fatal_exit("Out of memory\n");
+    }
+    return ptr;
+}
+
+static bool snapshot_load(const char* path, snapshot_t* snapshot) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        ac_log_error("Failed to open %s\n", path);
+        return false;
+    }
+    ac_mem_snapshot_header_t* header = &snapshot->header;
+    if (!read_exact(fp, header, sizeof(*header)) || header->magic != AC_MEM_SNAPSHOT_MAGIC) {
+        ac_log_error("%s is not a heap snapshot\n", path);
+        fclose(fp);
+        return false;
+    }
+    if (header->version != AC_MEM_SNAPSHOT_VERSION) {
+        ac_log_error("%s has version %u, expected %u\n", path, header->version, AC_MEM_SNAPSHOT_VERSION);
+        fclose(fp);
+        return false;
+    }
+
+    snapshot->modules = checked_calloc(header->module_count, sizeof(module_t));
+    for (uint32_t i = 0; i < header->module_count; i++) {
+        module_t* module = &snapshot->modules[i];
+        if (!read_exact(fp, &module->info, sizeof(module->info))) {
+            goto truncated;
+        }
+        module->path = checked_calloc(module->info.path_len + 1, 1);
+        if (!read_exact(fp, module->path, module->info.path_len)) {
+            goto truncated;
+        }
+    }
+
+    snapshot->blocks = checked_calloc(header->block_count, sizeof(ac_mem_snapshot_block_t));
+    if (!read_exact(fp, snapshot->blocks, header->block_count * sizeof(ac_mem_snapshot_block_t))) {
+        goto truncated;
+    }
+
+    snapshot->traces = checked_calloc((size_t)header->trace_count + 1, sizeof(trace_t));
+    for (uint32_t i = 0; i < header->trace_count; i++) {
+        ac_mem_snapshot_trace_t info;
+        if (!read_exact(fp, &info, sizeof(info)) || info.id == 0 || info.id > header->trace_count) {
+            goto truncated;
+        }
+        trace_t* trace = &snapshot->traces[info.id];
+        trace->frame_count = info.frame_count;
+        trace->frames = checked_calloc(info.frame_count, sizeof(uint64_t));
+        if (!read_exact(fp, trace->frames, info.frame_count * sizeof(uint64_t))) {
+            goto truncated;
+        }
+    }
+    fclose(fp);
+    return true;
+
+truncated:
+    ac_log_error("%s is truncated or corrupted\n", path);
+    fclose(fp);
+    return false;
+}
+
+static frame_t snapshot_frame(snapshot_t* snapshot, uint64_t address) {
+    for (uint32_t i = 0; i < snapshot->header.module_count; i++) {
+        ac_mem_snapshot_module_t* info = &snapshot->modules[i].info;
+        if (address >= info->start && address < info->end) {
+            return (frame_t){snapshot->modules[i].path, address - info->start + info->file_offset};
+        }
+    }
+    return (frame_t){NULL, address};
+}
+
+static uint64_t callsite_hash(frame_t* frames, int frame_count) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < frame_count; i++) {
+        for (const char* c = frames[i].path; c != NULL && *c != '\0'; c++) {
+            hash = (hash ^ (uint8_t)*c) * 0x100000001B3ULL;
+        }
+        hash = (hash ^ frames[i].offset) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static bool frame_equal(frame_t* a, frame_t* b) {
+    if (a->offset != b->offset) {
+        return false;
+    }
+    if (a->path == NULL || b->path == NULL) {
+        return a->path == b->path;
+    }
+    return strcmp(a->path, b->path) == 0;
+}
+
+static callsite_t* callsite_get(frame_t* frames, int frame_count) {
+    callsite_t** bucket = &callsites[callsite_hash(frames, frame_count) % CALLSITE_BUCKETS];
+    for (callsite_t* callsite = *bucket; callsite != NULL; callsite = callsite->next) {
+        if (callsite->frame_count != frame_count) {
+            continue;
+        }
+        int i = 0;
+        while (i < frame_count && frame_equal(&callsite->frames[i], &frames[i])) {
+            i++;
+        }
+        if (i == frame_count) {
+            return callsite;
+        }
+    }
+    callsite_t* callsite = checked_calloc(1, sizeof(callsite_t));
+    memcpy(callsite->frames, frames, frame_count * sizeof(frame_t));
+    callsite->frame_count = frame_count;
+    callsite->next = *bucket;
+    *bucket = callsite;
+    callsite_count++;
+    return callsite;
+}
+
+// Same scaling as ac_mem_show_usage
+static double block_weight(ac_mem_snapshot_block_t* block, uint64_t interval) {
+    if (!(block->flags & AC_MEM_ENTRY_FLAG_SAMPLED) || interval == 0 || block->size == 0) {
+        return (double)block->size;
+    }
+    return (double)block->size / (1.0 - exp(-(double)block->size / (double)interval));
+}
+
+static void snapshot_accumulate(snapshot_t* snapshot, int side, int depth) {
+    for (uint64_t i = 0; i < snapshot->header.block_count; i++) {
+        ac_mem_snapshot_block_t* block = &snapshot->blocks[i];
+        frame_t frames[MAX_DEPTH];
+        int frame_count = 0;
+        if (block->alloc_trace != 0 && block->alloc_trace <= snapshot->header.trace_count) {
+            trace_t* trace = &snapshot->traces[block->alloc_trace];
+            for (uint32_t f = AC_MEM_SNAPSHOT_TRACE_SKIP; f < trace->frame_count && frame_count < depth; f++) {
+                frames[frame_count++] = snapshot_frame(snapshot, trace->frames[f]);
+            }
+        }
+        callsite_t* callsite = callsite_get(frames, frame_count);
+        callsite->bytes[side] += block_weight(block, snapshot->header.sample_interval);
+        callsite->count[side]++;
+    }
+}
+
+static int callsite_compare(const void* a, const void* b) {
+    const callsite_t* x = *(const callsite_t* const*)a;
+    const callsite_t* y = *(const callsite_t* const*)b;
+    double dx = x->bytes[1] - x->bytes[0];
+    double dy = y->bytes[1] - y->bytes[0];
+    return (dy > dx) - (dy < dx);
+}
+
+static void print_frame(frame_t* frame) {
+    if (frame->path == NULL) {
+        printf("        0x%llx (no module)\n", (unsigned long long)frame->offset);
+        return;
+    }
+    // Return addresses point past the call, step back into it
+    char cmd[4200];
+    snprintf(cmd, sizeof(cmd), "addr2line -p -f -C -e '%s' 0x%llx", frame->path, (unsigned long long)frame->offset - 1);
+    char line[512] = "";
+    FILE* addr2line = popen(cmd, "r");
+    if (addr2line != NULL) {
+        if (fgets(line, sizeof(line), addr2line) == NULL) {
+            line[0] = '\0';
+        }
+        pclose(addr2line);
+    }
+    line[strcspn(line, "\n")] = '\0';
+    printf("        %s+0x%llx %s\n", frame->path, (unsigned long long)frame->offset, line[0] == '?' ? "" : line);
+}
+
+static void usage(void) { fprintf(stderr, "usage: ac_memdiff [-d depth] [-n count] before.acms after.acms\n"); }
+
+int main(int argc, char** argv) {
+    int depth = 1;
+    size_t top = 20;
+    const char* paths[2] = {NULL, NULL};
+    int path_count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = (size_t)atol(argv[++i]);
+        } else if (argv[i][0] != '-' && path_count < 2) {
+            paths[path_count++] = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (path_count != 2 || depth < 1 || depth > MAX_DEPTH) {
+        usage();
+        return 1;
+    }
+
+    snapshot_t snapshots[2] = {0};
+    for (int side = 0; side < 2; side++) {
+        if (!snapshot_load(paths[side], &snapshots[side])) {
+            return 1;
+        }
+        snapshot_accumulate(&snapshots[side], side, depth);
+    }
+
+    callsite_t** sorted = checked_calloc(callsite_count, sizeof(callsite_t*));
+    size_t n = 0;
+    double totals[2] = {0, 0};
+    for (size_t b = 0; b < CALLSITE_BUCKETS; b++) {
+        for (callsite_t* callsite = callsites[b]; callsite != NULL; callsite = callsite->next) {
+            sorted[n++] = callsite;
+            totals[0] += callsite->bytes[0];
+            totals[1] += callsite->bytes[1];
+        }
+    }
+    qsort(sorted, n, sizeof(callsite_t*), callsite_compare);
+
+    printf("Live bytes: %.0f -> %.0f (%+.0f)\n", totals[0], totals[1], totals[1] - totals[0]);
+    printf("%14s %12s %14s  callsite\n", "delta bytes", "delta blocks", "bytes after");
+    for (size_t i = 0; i < n && i < top; i++) {
+        callsite_t* callsite = sorted[i];
+        if (callsite->bytes[1] <= callsite->bytes[0]) {
+            break;
+        }
+        printf("%+14.0f %+12lld %14.0f\n", callsite->bytes[1] - callsite->bytes[0],
+               (long long)callsite->count[1] - (long long)callsite->count[0], callsite->bytes[1]);
+        if (callsite->frame_count == 0) {
+            printf("        (no trace)\n");
+        }
+        for (int f = 0; f < callsite->frame_count; f++) {
+            print_frame(&callsite->frames[f]);
+        }
+    }
+    return 0;
+}